@@ -0,0 +1,898 @@
+/*
+
+  Copyright (c) 2018, Martin Mišúth - /ETC, 960 01 Zvolen, Slovak Republic
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+/***********************************************************************
+ * libpipechat - chatdir protocol of pipechat for embedding            *
+ ***********************************************************************/
+
+/* Everything pipechat(1) keeps in process globals for its single
+ * chatroom is kept in pipechat_t here, so one process can be member
+ * of many chatrooms. On disk it's the very same protocol:
+ * - records are appended to chatdir's 'log' with single write()
+ * - then newline is written into every pipe in 'event', so members
+ *   wake up and read chatlog from where they left off
+ * - control events, like 'D' for destroyed chatroom, come through
+ *   the same pipe
+ *
+ * Library members don't use broker, presence table nor direct message
+ * inboxes, pipechat(1) members fall back to fifodir for them. Neither
+ * do they merge per-member chatlogs in 'log.d', so they refuse chatroom
+ * with split_log on, nor retry control events that don't fit into
+ * full pipe, nor stamp records for latency measurement.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "pipechat.h"
+
+
+// maximum length of nick
+#define MAX_NICK_LEN 15
+
+// record timestamp format, UTC
+#define TIME_STR_FORMAT "%Y.%m.%d %H:%M:%S"
+#define MAX_TIME_STR_LEN 20
+
+// maximum length of listener pipe name, i.e. pid
+#define MAX_NOTIFY_NAME_LEN 32
+
+// maximum length of status and identification lines
+#define MAX_INFO_LINE_LEN 256
+
+// maximum of event bytes read at once
+#define MAX_EVENT_READ_LEN 512
+
+// maximum length of chatdir config file
+#define MAX_CONFIG_LEN 4096
+
+// chatlog data sealed on stack, longer messages are sealed on heap
+#define MAX_SEAL_STACK_LEN 4096
+
+// CRC32C (Castagnoli) polynomial, reversed
+#define CRC32C_POLY 0x82F63B78
+
+// time in ms a torn chatlog tail must stay unchanged before join seals it
+#define CHATLOG_TORN_GRACE 100
+
+// default chat lines member may send at once and per second, unlimited
+#define RATE_BURST 0
+#define RATE_SUSTAINED 0
+
+
+// membership in single chatroom
+struct pipechat_s {
+    int fd_chatdir;                        // chatdir itself
+    int fd_chatlog;                        // chatlog, appended to and read at read_pos
+    int fd_event;                          // our listener pipe
+    DIR * eventdir;                        // fifodir of listener pipes
+    long read_pos;                         // how far we read chatlog
+    int destroyed;                         // got 'D', chatroom is gone
+    char pid[MAX_NOTIFY_NAME_LEN];         // our pid, name of our pipe
+    char nick[MAX_NICK_LEN + 1];           // our nick
+    pipechat_config_t config;              // chatroom settings
+    struct timespec chatdir_mtime;         // when we looked for 'log.d' last time
+    pipechat_rate_t rate;                  // lines we may send right now
+};
+
+
+// CRC32C implementation picked on first use and its software fallback table
+static uint32_t (*crc32c_update)(uint32_t, const char *, size_t) = NULL;
+static uint32_t crc32c_table[256];
+
+
+// CRC32C update, table driven, one byte at a time
+static uint32_t
+crc32c_update_sw (uint32_t crc, const char * data, size_t len)
+{
+    const unsigned char * p = (const unsigned char *) data;
+
+    while (len--) {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+
+#if defined(__x86_64__)
+// CRC32C update using SSE4.2 crc32 instruction, eight bytes at a time
+__attribute__ ((target("sse4.2")))
+static uint32_t
+crc32c_update_hw (uint32_t crc, const char * data, size_t len)
+{
+    uint64_t crc64 = crc;
+
+    for (; len >= sizeof(uint64_t); data += sizeof(uint64_t), len -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+
+    crc = (uint32_t) crc64;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, (unsigned char) *data++);
+    }
+
+    return crc;
+}
+#endif
+
+
+// picks crc32c_update implementation on first use
+static void
+crc32c_init (void)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_update_hw;
+    }
+#endif
+    if (crc32c_update == NULL) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            }
+            crc32c_table[i] = crc;
+        }
+        crc32c_update = crc32c_update_sw;
+    }
+}
+
+
+uint32_t
+pipechat_crc32c (const char * data, size_t len)
+{
+    return pipechat_crc32c_extend(0, data, len);
+}
+
+
+uint32_t
+pipechat_crc32c_extend (uint32_t crc, const char * data, size_t len)
+{
+    if (crc32c_update == NULL) {
+        crc32c_init();
+    }
+
+    return ~crc32c_update(~crc, data, len);
+}
+
+
+size_t
+pipechat_seal (const char * data, size_t len, char * sealed)
+{
+    size_t sealed_len = 0;
+
+    for (const char * p = data, * end = data + len; p < end; ) {
+        const char * eol = memchr(p, '\n', end - p);
+        size_t line_len = (eol ? eol : end) - p;
+        char field[PIPECHAT_CRC_FIELD_LEN + 2];
+
+        if (eol == NULL) {
+            break;
+        }
+
+        memcpy(sealed + sealed_len, p, line_len);
+        sealed_len += line_len;
+        snprintf(field, sizeof(field), "%cC%08x\n", PIPECHAT_FIELD_SEP, pipechat_crc32c(p, line_len));
+        memcpy(sealed + sealed_len, field, PIPECHAT_CRC_FIELD_LEN + 1);
+        sealed_len += PIPECHAT_CRC_FIELD_LEN + 1;
+        p = eol + 1;
+    }
+
+    return sealed_len;
+}
+
+
+int
+pipechat_seal_tail (int fd_chatlog, int grace)
+{
+    char seal[] = { PIPECHAT_FIELD_SEP, 'X', '\n' };
+    char last = '\n';
+    off_t size = lseek(fd_chatlog, 0, SEEK_END);
+    int sealed = 0;
+
+    if (size <= 0 || pread(fd_chatlog, &last, 1, size - 1) != 1 || last == '\n') {
+        return 0;
+    }
+
+    // racing joiners take turns, those after the first one find tail sealed
+    if (flock(fd_chatlog, LOCK_EX) < 0) {
+        return 0;
+    }
+
+    size = lseek(fd_chatlog, 0, SEEK_END);
+    if (size > 0 && pread(fd_chatlog, &last, 1, size - 1) == 1 && last != '\n') {
+        usleep(grace * 1000);
+        if (lseek(fd_chatlog, 0, SEEK_END) == size && write(fd_chatlog, seal, sizeof(seal)) == sizeof(seal)) {
+            fsync(fd_chatlog);
+            sealed = 1;
+        }
+    }
+
+    flock(fd_chatlog, LOCK_UN);
+
+    return sealed;
+}
+
+
+const char *
+pipechat_parse_prefix (const char * p, const char * end, pid_t * pid, int64_t * time)
+{
+    static const char sep[6] = { '.', '.', ' ', ':', ':', ']' };
+    long v[6] = {0};
+    long y = 0, m = 0, days = 0;
+
+    if (p >= end || *p++ != '[') {
+        return NULL;
+    }
+    for (*pid = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+        *pid = *pid * 10 + (*p - '0');
+    }
+    if (*pid <= 0 || end - p < 2 || p[0] != ']' || p[1] != '[') {
+        return NULL;
+    }
+    p += 2;
+
+    for (int i = 0; i < 6; i++) {
+        if (p >= end || *p < '0' || *p > '9') {
+            return NULL;
+        }
+        while (p < end && *p >= '0' && *p <= '9') {
+            v[i] = v[i] * 10 + (*p++ - '0');
+        }
+        if (p >= end || *p++ != sep[i]) {
+            return NULL;
+        }
+    }
+
+    // days since epoch of gregorian date
+    y = v[0] - (v[1] <= 2);
+    m = v[1] <= 2 ? v[1] + 9 : v[1] - 3;
+    days = 365 * y + y / 4 - y / 100 + y / 400 + (153 * m + 2) / 5 + v[2] - 1 - 719468;
+
+    *time = ((int64_t) days * 86400 + v[3] * 3600 + v[4] * 60 + v[5]) * 1000;
+
+    return p;
+}
+
+
+void
+pipechat_frame_encode (const pipechat_frame_t * frame, char * out)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t len = frame->len < PIPECHAT_MAX_FRAME_PAYLOAD ? frame->len : PIPECHAT_MAX_FRAME_PAYLOAD;
+    char * p = out;
+
+    *p++ = PIPECHAT_FRAME_START;
+    *p++ = frame->type;
+    p += sprintf(p, "%08x%08x%04zx", (uint32_t) frame->pid, frame->request, len);
+
+    for (size_t i = 0; i < PIPECHAT_MAX_FRAME_PAYLOAD; i++) {
+        unsigned char c = i < len ? frame->payload[i] : 0;
+        *p++ = hex[c >> 4];
+        *p++ = hex[c & 0x0f];
+    }
+}
+
+
+// returns value of count hex digits at p, or -1 when there's anything else
+static long long
+frame_hex (const char * p, size_t count)
+{
+    long long value = 0;
+
+    while (count--) {
+        int c = *p++;
+        if (c >= '0' && c <= '9') {
+            value = value * 16 + c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value = value * 16 + c - 'a' + 10;
+        } else {
+            return -1;
+        }
+    }
+
+    return value;
+}
+
+
+int
+pipechat_frame_decode (const char * data, pipechat_frame_t * frame)
+{
+    long long pid = frame_hex(data + 2, 8), request = frame_hex(data + 10, 8), len = frame_hex(data + 18, 4);
+
+    if (data[0] != PIPECHAT_FRAME_START || pid <= 0 || request < 0 || len < 0 || len > PIPECHAT_MAX_FRAME_PAYLOAD) {
+        return -1;
+    }
+
+    frame->type = data[1];
+    frame->pid = pid;
+    frame->request = request;
+    frame->len = len;
+    for (long long i = 0; i < len; i++) {
+        long long c = frame_hex(data + 22 + 2 * i, 2);
+        if (c < 0) {
+            return -1;
+        }
+        frame->payload[i] = c;
+    }
+    frame->payload[len] = '\0';
+
+    return 0;
+}
+
+
+// returns monotonic time in ms
+static int64_t
+get_monotonic_ms (void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// builds record timestamp string of now
+static void
+get_timestr (char * dt)
+{
+    struct tm tm = {0};
+    time_t t = time(NULL);
+
+    gmtime_r(&t, &tm); // UTC
+
+    strftime(dt, MAX_TIME_STR_LEN, TIME_STR_FORMAT, &tm);
+}
+
+
+void
+pipechat_config_load (int fd_chatdir, pipechat_config_t * settings)
+{
+    char config[MAX_CONFIG_LEN] = {0};
+    char * line = NULL, * saveptr = NULL;
+    int fd = -1, len = -1;
+
+    if ((fd = openat(fd_chatdir, "config", O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+        return;
+    }
+
+    do {
+        len = read(fd, config, sizeof(config) - 1);
+    } while (len < 0 && errno == EINTR);
+    close(fd);
+
+    if (len <= 0) {
+        return;
+    }
+    config[len] = '\0';
+
+    for (line = strtok_r(config, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        char key[32] = {0};
+        long value = 0;
+
+        if (line[0] == '#' || sscanf(line, " %31[a-z_] = %ld", key, &value) != 2 || value < 0) {
+            continue;
+        }
+
+        if (strcmp(key, "rate_burst") == 0) {
+            settings->rate_burst = value;
+        } else if (strcmp(key, "rate_sustained") == 0) {
+            settings->rate_sustained = value;
+        } else if (strcmp(key, "latency_stamps") == 0) {
+            settings->latency_stamps = value;
+        } else if (strcmp(key, "record_crc") == 0) {
+            settings->record_crc = value;
+        } else if (strcmp(key, "split_log") == 0) {
+            settings->split_log = value;
+        }
+    }
+}
+
+
+int
+pipechat_rate_take (pipechat_rate_t * bucket, int64_t now, long burst, long sustained)
+{
+    long capacity = burst * 1000;
+
+    if (burst <= 0 || sustained <= 0) {
+        return 1;
+    }
+
+    // clock went backwards, better let member be
+    if (now < bucket->last || now - bucket->last >= capacity / sustained) {
+        bucket->tokens = capacity;
+    } else {
+        bucket->tokens += (now - bucket->last) * sustained;
+        if (bucket->tokens > capacity) {
+            bucket->tokens = capacity;
+        }
+    }
+    bucket->last = now;
+
+    if (bucket->tokens < 1000) {
+        return 0;
+    }
+
+    bucket->tokens -= 1000;
+
+    return 1;
+}
+
+
+long
+pipechat_rate_wait (const pipechat_rate_t * bucket, int64_t now, long sustained)
+{
+    long missing = 1000 - bucket->tokens - (long) (now - bucket->last) * sustained;
+
+    if (missing <= 0 || sustained <= 0) {
+        return 0;
+    }
+
+    return (missing + sustained - 1) / sustained;
+}
+
+
+int
+pipechat_notify_pipe (int dirfd, const char * name, char event)
+{
+    int fd = -1, pending = 0, saved = 0;
+    ssize_t res = -1;
+
+    do {
+        fd = openat(dirfd, name, O_WRONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+    } while (fd < 0 && errno == EINTR);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (event == '\n' && ioctl(fd, FIONREAD, &pending) == 0 && pending > 0) {
+        close(fd);
+        return 0;
+    }
+
+    do {
+        res = write(fd, &event, 1);
+    } while (res < 0 && errno == EINTR);
+
+    saved = errno;
+    close(fd);
+    errno = saved;
+
+    return res == 1 ? 1 : -1;
+}
+
+
+/* writes single event byte into every listener pipe in fifodir but ours
+ * - newline is just dropped when listener's pipe is full, it has unread
+ *   events and rereads chatlog anyway
+ * - dotted pipes belong to broker clients, they get chatlog from broker
+ */
+static void
+notify_fifodir (pipechat_t * room, char event)
+{
+    struct dirent * dentry = NULL;
+    int dfd = dirfd(room->eventdir);
+
+    rewinddir(room->eventdir);
+
+    while ((dentry = readdir(room->eventdir)) != NULL) {
+        if (dentry->d_type != DT_FIFO || strcmp(dentry->d_name, room->pid) == 0 || (event == '\n' && dentry->d_name[0] == '.')) {
+            continue;
+        }
+        pipechat_notify_pipe(dfd, dentry->d_name, event);
+    }
+}
+
+
+int
+pipechat_append (int fd, const char * data, size_t len, int seal)
+{
+    char local[MAX_SEAL_STACK_LEN];
+    char * sealed = (char *) data;
+    size_t lines = 0;
+    ssize_t res = -1;
+    int saved = 0;
+
+    if (seal) {
+        for (size_t i = 0; i < len; i++) {
+            lines += data[i] == '\n';
+        }
+        sealed = len + lines * PIPECHAT_CRC_FIELD_LEN <= sizeof(local) ? local : malloc(len + lines * PIPECHAT_CRC_FIELD_LEN);
+        if (sealed == NULL) {
+            return -1;
+        }
+        len = pipechat_seal(data, len, sealed);
+    }
+
+    do {
+        res = write(fd, sealed, len);
+    } while (res < 0 && errno == EINTR);
+
+    saved = errno;
+    if (sealed != data && sealed != local) {
+        free(sealed);
+    }
+    errno = saved;
+
+    return res == (ssize_t) len ? 0 : -1;
+}
+
+
+// appends complete lines to chatlog, sealed when chatroom wants it, and wakes up the others
+static int
+chatlog_append (pipechat_t * room, const char * data, size_t len)
+{
+    if (pipechat_append(room->fd_chatlog, data, len, room->config.record_crc) < 0) {
+        return -1;
+    }
+
+    fsync(room->fd_chatlog);
+    notify_fifodir(room, '\n');
+
+    return 0;
+}
+
+
+// appends "*** <nick> status ***" line to chatlog
+static int
+chatlog_status (pipechat_t * room, const char * status)
+{
+    char time[MAX_TIME_STR_LEN] = {0};
+    char line[MAX_INFO_LINE_LEN] = {0};
+    int len = -1;
+
+    get_timestr(time);
+    len = snprintf(line, sizeof(line), "[%s][%s] *** <%s> %s ***\n", room->pid, time, room->nick, status);
+
+    return chatlog_append(room, line, len);
+}
+
+
+/* returns whether members of chatroom append to 'log.d', or will
+ * - chatdir is looked into only when it changed since last time
+ */
+static int
+split_present (pipechat_t * room)
+{
+    struct stat st;
+
+    if (room->config.split_log) {
+        return 1;
+    }
+    if (fstat(room->fd_chatdir, &st) < 0
+     || (st.st_mtim.tv_sec == room->chatdir_mtime.tv_sec && st.st_mtim.tv_nsec == room->chatdir_mtime.tv_nsec && st.st_mtime < time(NULL))) {
+        return 0;
+    }
+    room->chatdir_mtime = st.st_mtim;
+
+    return faccessat(room->fd_chatdir, PIPECHAT_SPLIT_DIR, F_OK, 0) == 0;
+}
+
+
+pipechat_t *
+pipechat_join (const char * chatdir, const char * nick)
+{
+    pipechat_t * room = NULL;
+    int event_dfd = -1, saved = 0;
+
+    if ((room = calloc(1, sizeof(pipechat_t))) == NULL) {
+        return NULL;
+    }
+
+    room->fd_chatlog = room->fd_event = -1;
+    room->config.rate_burst = RATE_BURST;
+    room->config.rate_sustained = RATE_SUSTAINED;
+    snprintf(room->pid, sizeof(room->pid), "%d", getpid());
+    snprintf(room->nick, sizeof(room->nick), "%s", nick);
+
+    if ((room->fd_chatdir = open(chatdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0
+     || (room->fd_chatlog = openat(room->fd_chatdir, "log", O_RDWR | O_APPEND | O_NOFOLLOW | O_CLOEXEC)) < 0
+     || (event_dfd = openat(room->fd_chatdir, "event", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0
+     || (room->eventdir = fdopendir(event_dfd)) == NULL) {
+        goto fail;
+    }
+
+    pipechat_config_load(room->fd_chatdir, &room->config);
+
+    if (split_present(room)) {
+        errno = ENOTSUP;
+        goto fail;
+    }
+
+    pipechat_seal_tail(room->fd_chatlog, CHATLOG_TORN_GRACE);
+
+    // by default, we don't want to see messages from the past, as they could be loooooong
+    room->read_pos = lseek(room->fd_chatlog, 0, SEEK_END);
+
+    // eventdir is setgid, so our pipe gets chatroom's group
+    if (mkfifoat(event_dfd, room->pid, S_IRUSR|S_IWUSR|S_IWGRP) < 0) {
+        goto fail;
+    }
+    if ((room->fd_event = openat(event_dfd, room->pid, O_RDWR | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC)) < 0
+     || fchmod(room->fd_event, S_IRUSR|S_IWUSR|S_IWGRP) < 0) {
+        saved = errno;
+        unlinkat(event_dfd, room->pid, 0);
+        errno = saved;
+        goto fail;
+    }
+
+    chatlog_status(room, "joined");
+
+    return room;
+
+fail:
+    saved = errno;
+    if (room->eventdir) {
+        closedir(room->eventdir);
+    } else if (event_dfd >= 0) {
+        close(event_dfd);
+    }
+    if (room->fd_event >= 0) close(room->fd_event);
+    if (room->fd_chatlog >= 0) close(room->fd_chatlog);
+    if (room->fd_chatdir >= 0) close(room->fd_chatdir);
+    free(room);
+    errno = saved;
+
+    return NULL;
+}
+
+
+int
+pipechat_fd (pipechat_t * room)
+{
+    return room->fd_event;
+}
+
+
+int
+pipechat_send (pipechat_t * room, const char * text)
+{
+    char time[MAX_TIME_STR_LEN] = {0};
+    char * record = NULL;
+    size_t lines = 1, size = 0, len = 0;
+    int res = -1;
+
+    if (room->destroyed) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    for (const char * p = text; *p; p++) {
+        lines += (*p == '\n' || (*p == '\r' && p[1] != '\n'));
+    }
+    if (! pipechat_rate_take(&room->rate, get_monotonic_ms(), room->config.rate_burst, room->config.rate_sustained)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // every line gets its own prefix, continuation lines are marked with "<nick>| "
+    get_timestr(time);
+    size = strlen(text) + lines * snprintf(NULL, 0, "[%s][%s] <%s>: \n", room->pid, time, room->nick) + 1;
+    if ((record = malloc(size)) == NULL) {
+        return -1;
+    }
+
+    for (const char * line = text; line; ) {
+        size_t line_len = strcspn(line, "\r\n");
+
+        len += snprintf(record + len, size - len, "[%s][%s] <%s>%c %.*s\n", room->pid, time, room->nick, line == text ? ':' : '|', (int) line_len, line);
+
+        line += line_len;
+        if (*line == '\0') {
+            break;
+        }
+        line += (line[0] == '\r' && line[1] == '\n') ? 2 : 1;
+    }
+
+    res = chatlog_append(room, record, len);
+    free(record);
+
+    return res;
+}
+
+
+/* writes control frame into pipe of member with given pid, at once
+ * - member may be getting chatlog from broker, then its pipe is dotted
+ */
+static void
+frame_send (pipechat_t * room, pid_t pid, const pipechat_frame_t * frame)
+{
+    char raw[PIPECHAT_FRAME_LEN];
+    char name[MAX_NOTIFY_NAME_LEN];
+    int fd = -1;
+
+    pipechat_frame_encode(frame, raw);
+
+    snprintf(name, sizeof(name), "%d", pid);
+    if ((fd = openat(dirfd(room->eventdir), name, O_WRONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC)) < 0 && errno == ENOENT) {
+        snprintf(name, sizeof(name), ".%d", pid);
+        fd = openat(dirfd(room->eventdir), name, O_WRONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if (fd >= 0) {
+        if (write(fd, raw, sizeof(raw)) < 0 && errno != EAGAIN) {
+            ;
+        }
+        close(fd);
+    }
+}
+
+
+/* takes control frame, of which avail bytes at data were read already,
+ * and answers queries in it with who we are, to asker only
+ * - frame was written at once, so rest of it is in our pipe already
+ * - returns number of bytes at data it took
+ */
+static size_t
+frame_process (pipechat_t * room, const char * data, size_t avail)
+{
+    char raw[PIPECHAT_FRAME_LEN];
+    pipechat_frame_t frame = {0};
+    size_t have = avail < sizeof(raw) ? avail : sizeof(raw);
+
+    memcpy(raw, data, have);
+    if (have < sizeof(raw) && read(room->fd_event, raw + have, sizeof(raw) - have) != (ssize_t) (sizeof(raw) - have)) {
+        return have;
+    }
+
+    if (pipechat_frame_decode(raw, &frame) == 0 && (frame.type == PIPECHAT_FRAME_LIST || frame.type == PIPECHAT_FRAME_WHOIS || frame.type == PIPECHAT_FRAME_PTY)) {
+        pipechat_frame_t ident = { .type = PIPECHAT_FRAME_IDENT, .pid = atol(room->pid), .request = frame.request };
+        ident.len = snprintf(ident.payload, sizeof(ident.payload), "<%s>", room->nick);
+        frame_send(room, frame.pid, &ident);
+    }
+
+    return have;
+}
+
+
+/* handles events from our pipe
+ * - newlines just tell there's something new in chatlog
+ * - control frames carry queries of other members, see frame_process()
+ * - 'L', 'w' and 'p' are queries of members which don't know control
+ *   frames yet, we answer them with who we are in chatlog
+ * - 'D' tells chatroom was destroyed
+ */
+static void
+process_events (pipechat_t * room)
+{
+    char event[MAX_EVENT_READ_LEN];
+    ssize_t len = -1;
+
+    while ((len = read(room->fd_event, event, sizeof(event))) > 0) {
+        for (ssize_t i = 0; i < len; i++) {
+            if (event[i] == PIPECHAT_FRAME_START) {
+                i += frame_process(room, event + i, len - i) - 1;
+            } else if (event[i] == 'L' || event[i] == 'w' || event[i] == 'p') {
+                char ident[MAX_INFO_LINE_LEN] = {0};
+                int ident_len = snprintf(ident, sizeof(ident), "[%s] is <%s>\n", room->pid, room->nick);
+                chatlog_append(room, ident, ident_len);
+            } else if (event[i] == 'D') {
+                room->destroyed = 1;
+            }
+        }
+    }
+}
+
+
+ssize_t
+pipechat_read (pipechat_t * room, char * buffer, size_t size)
+{
+    ssize_t len = -1;
+    char * eol = NULL;
+
+    process_events(room);
+
+    // whatever members appending to 'log.d' send would be lost on us
+    if (split_present(room)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    for (;;) {
+        if ((len = pread(room->fd_chatlog, buffer, size, room->read_pos)) <= 0) {
+            return len;
+        }
+
+        // fell behind into range punched out by --retain of some member
+        if (buffer[0] == '\0') {
+            off_t data = lseek(room->fd_chatlog, room->read_pos, SEEK_DATA);
+            char * start = NULL;
+            int64_t time = 0;
+            pid_t pid = 0;
+
+            if (data <= room->read_pos || (len = pread(room->fd_chatlog, buffer, size, data)) <= 0) {
+                break;
+            }
+            if (pipechat_parse_prefix(buffer, buffer + len, &pid, &time)) {
+                room->read_pos = data;
+            } else {
+                start = memchr(buffer, '\n', len);
+                room->read_pos = start ? data + (start + 1 - buffer) : data + len;
+            }
+            continue;
+        }
+        break;
+    }
+
+    // record being written stays for next time, unless it doesn't fit at all
+    if ((eol = memrchr(buffer, '\n', len)) != NULL) {
+        len = eol + 1 - buffer;
+    } else if ((size_t) len < size) {
+        return 0;
+    }
+
+    room->read_pos += len;
+
+    return len;
+}
+
+
+int
+pipechat_destroyed (pipechat_t * room)
+{
+    return room->destroyed;
+}
+
+
+void
+pipechat_leave (pipechat_t * room)
+{
+    int event_dfd = dirfd(room->eventdir);
+
+    if (! room->destroyed) {
+        chatlog_status(room, "left");
+    }
+
+    unlinkat(event_dfd, room->pid, 0);
+
+    closedir(room->eventdir);
+    close(room->fd_event);
+    close(room->fd_chatlog);
+    close(room->fd_chatdir);
+    free(room);
+}
@@ -179,6 +179,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <time.h>
 
 #include <errno.h>
@@ -189,14 +191,34 @@
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/un.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <dirent.h>
 #include <pwd.h>
 #include <grp.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#endif
+
+#ifdef PIPECHAT_LITE
+#include <termios.h>
+#else
 #include <readline/readline.h>
 #include <readline/history.h>
+#endif
+
+#include "pipechat.h"
 
 
 // maximum length of a nick/username string (will be truncated)
@@ -215,10 +237,196 @@
 // maximum supported chatlog read buffer size, including timestamps/usernames
 #define MAX_CHAT_READ_BUFFER_LEN 1024
 
+// maximum of chatlog data printed at once, so multi-line messages stay in one block
+#define MAX_CHATLOG_PRINT_LEN 65536
+
+// maximum number of event bytes consumed from notify pipe per wakeup
+#define MAX_EVENT_READ_LEN 512
+
+// maximum number of input bytes read from terminal per wakeup
+#define MAX_INPUT_READ_LEN 4096
+
+// maximum length of line edited by built-in line editor of lite build
+#define MAX_INPUT_LINE_LEN 1024
+
+// lines recalled by built-in line editor with up/down arrows
+#define LINEEDIT_HISTORY_LEN 16
+
+// capacity requested for notify pipe, so control events have headroom
+#define NOTIFY_PIPE_SIZE 65536
+
+// initial capacity of retry queue, it grows as needed
+#define NOTIFY_RETRY_INITIAL_LEN 64
+
+// redelivery interval of undelivered control events in ms
+#define NOTIFY_RETRY_INTERVAL 20
+
+// time in ms we keep redelivering control events we owe on quit
+#define NOTIFY_RETRY_DRAIN_DEADLINE 5000
+
+// time in ms we wait for broker to greet us
+#define BROKER_CONNECT_DEADLINE 5000
+
+// default time in ms destroyer waits for members to acknowledge /destroy
+#define DESTROY_ACK_DEADLINE 5000
+
+// maximum lenght of terminal line name kept in presence table
+#define MAX_TTY_NAME_LEN 32
+
+// presence table identification and capacity
+#define PRESENCE_MAGIC 0x72706371
+#define MAX_PRESENCE_SLOTS 4096
+
+// window in seconds, in which join/leave status lines are coalesced
+#define STATUS_COALESCE_WINDOW 10
+
+// name of broker socket in chatdir
+#define BROKER_SOCKET_NAME "broker"
+
+// name of directory holding direct message inboxes of members in chatdir
+#define DM_DIR_NAME "dm"
+
+// chatlog data broker reads at once and maximum of such chunks queued per client
+#define MAX_BROKER_CHUNK_LEN 65536
+#define MAX_BROKER_QUEUE_LEN 256
+
+// maximum of queued chunks broker hands to single writev()
+#define MAX_BROKER_IOV_LEN 64
+
+// default token bucket limits of chat lines per member, see chatdir 'config',
+// unlimited, so existing scripts and bots don't lose lines until creator opts in
+#define RATE_BURST 0
+#define RATE_SUSTAINED 0
+
+// maximum of members, whose line rate listeners keep track of
+#define MAX_RATE_TRACKED 64
+
+/* latency histograms have LATENCY_SUB_BUCKETS buckets per power of two
+ * up to 2^LATENCY_MAX_EXP ns, which keeps relative error around 6%
+ */
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_MAX_EXP 40
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXP - 3) * LATENCY_SUB_BUCKETS)
+
+// maximum of stamped lines printed at once, which rendering latency is taken of
+#define MAX_LATENCY_PENDING 256
+
+// chatlog line field separator, fields after it are not shown
+#define CHATLOG_FIELD_SEP PIPECHAT_FIELD_SEP
+
+// maximum length of send time field
+#define MAX_LATENCY_FIELD_LEN 24
+
+// length of record checksum field, i.e. separator, 'C' and 8 hex digits
+#define CRC_FIELD_LEN PIPECHAT_CRC_FIELD_LEN
+
+// maximum of message lines whose record is gathered on stack, more take malloc()
+#define MAX_RECORD_STACK_LINES 128
+
+// maximum of pieces per record line, i.e. prefix, mark, text, send time, order and end
+#define RECORD_LINE_IOV 6
+
+// chatdir directory of per-member chatlogs, see split_log in chatdir config
+#define SPLIT_DIR_NAME PIPECHAT_SPLIT_DIR
+
+// initial number of per-member chatlogs reader makes room for, it doubles as they come
+#define SPLIT_WRITERS_INITIAL_LEN 16
+
+// maximum length of record order field, i.e. separator, 'O', time and sequence number
+#define MAX_ORDER_FIELD_LEN 48
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+// time in ms a torn chatlog tail must stay unchanged before join seals it
+#define CHATLOG_TORN_GRACE 100
+
+// maximum of damaged records --fsck lists one by one
+#define MAX_FSCK_REPORTED 20
+
+// default size of scrollback arena in MB, see --scrollback, lite build keeps none unless asked
+#ifdef PIPECHAT_LITE
+#define SCROLLBACK_DEFAULT_MB 0
+#else
+#define SCROLLBACK_DEFAULT_MB 1
+#endif
+
+// average rendered line length scrollback offset table is sized for
+#define SCROLLBACK_AVG_LINE_LEN 64
+
+// longest rendered line kept in scrollback, longer ones are cut
+#define MAX_SCROLLBACK_LINE_LEN 4096
+
+// default chatlog backlog past which wakeup skips to its last screen, see --lag-skip
+#define LAG_SKIP_DEFAULT (4L << 20)
+
+// distinct senders counted in skipped backlog, more are shown as N+
+#define MAX_LAG_SENDERS 256
+
+// maximum of pids and nicks /ignore can take
+#define MAX_FILTERS 32
+
+// time in ms between applications of --retain policy
+#define RETAIN_INTERVAL 60000
+
+/* chatlog data --archive copies at once, when there's this much of it,
+ * otherwise it waits at most this many ms for more since last copy
+ */
+#define ARCHIVE_BATCH_LEN (1024 * 1024)
+
+// maximum length of archive checkpoint line, one for 'log' and one for each per-member chatlog
+#define MAX_ARCHIVE_CHECKPOINT_LINE_LEN 64
+#define ARCHIVE_SYNC_WINDOW 5000
+
+// identification of --record traces
+#define TRACE_MAGIC 0x72746370
+#define TRACE_VERSION 1
+
+// capacity of pid to trace client map, must be power of two
+#define MAX_TRACE_CLIENTS 65536
+
+// trace records written to stdout at once
+#define MAX_TRACE_BATCH 256
+
+// synthetic load of --bench traffic
+#define BENCH_TRAFFIC_MESSAGES 20000
+#define BENCH_TRAFFIC_SENDERS 10
+#define BENCH_TRAFFIC_MESSAGE_LEN 120
+
+// backlog past which catch-up member of --bench traffic skips to last screen
+#define BENCH_TRAFFIC_LAG_SKIP (1L << 20)
+
+// time in ms members of --bench rss get to quit, before they are killed
+#define BENCH_RSS_QUIT_DEADLINE 5000
+
+// maximum size of chatdir 'config' file
+#define MAX_CONFIG_LEN 4096
+
 // points to global var
 #define PROMPT promptstr
 
 
+typedef enum run_mode_e {
+    MODE_CHAT,        // interactive chat client
+    MODE_BENCH,       // benchmark, see --bench
+    MODE_FOLLOW,      // raw chatlog stream to stdout, see --follow
+    MODE_OBSERVE,     // read-only rendered chat to stdout, see --observe
+    MODE_BROKER,      // chatlog fan-out over UNIX socket, see --broker
+    MODE_RECORD,      // traffic trace to stdout, see --record
+    MODE_REPLAY,      // traffic trace replay, see --replay
+    MODE_FSCK,        // offline chatlog validation, see --fsck
+    MODE_ARCHIVE,     // chatlog copy into durable file, see --archive
+    MODE_COMPACT,     // per-member chatlogs fold into file, see --compact
+} run_mode;
+
+typedef enum copy_method_e {
+    COPY_SPLICE,      // splice() from chatlog into pipe
+    COPY_FILE_RANGE,  // copy_file_range() from chatlog into file
+    COPY_SENDFILE,    // sendfile() from chatlog into anything else
+    COPY_READWRITE,   // plain pread() + write() when kernel can't do either
+} copy_method;
+
 typedef enum check_result_e {
     CHECK_ERROR = -1,
     CHECK_NOTHING,
@@ -226,15 +434,223 @@ typedef enum check_result_e {
     CHECK_SIGNAL,
     CHECK_INPUT,
     CHECK_MESSAGE,
+    CHECK_BROKER,
 } check_result;
 
+typedef enum line_state_e {
+    LINE_TORN = -2,   // sealed by join recovery, its writer died mid-append
+    LINE_CORRUPT,     // checksum does not match
+    LINE_PLAIN,       // no checksum to check
+    LINE_SEALED,      // checksum matches
+} line_state;
+
 typedef struct fds_s {
     int fd_selfpipe;  // "selfpipe"  for reliable signals
     int fd_chatdir;   // "channel"   dirfd holding dir to the chat channel data
     int fd_chatlog;   // "chatlog"   fd holding regular chat log data file
     int fd_event;     // "eventpipe" fd holding pipe, where notifications about new messages are sent
+    int fd_broker;    // "broker"    fd holding socket, where broker pushes new chatlog data, if any
+    int fd_inbox;     // "inbox"     fd holding our direct message inbox in 'dm' directory, if any
+    int fd_append;    // "appendlog" fd our records are appended to, chatlog or our own file in 'log.d'
+    int fd_split;     // "splitdir"  dirfd holding 'log.d' directory, if room has split_log on
 } fds_t;
 
+typedef struct notify_stats_s {
+    unsigned long sent;       // event bytes written into listener pipes
+    unsigned long coalesced;  // '\n' skipped, as listener had unread events already
+    unsigned long deferred;   // control events put aside into retry queue
+    unsigned long redelivered;// deferred control events delivered later on
+    unsigned long dropped;    // control events lost for good
+    unsigned long stale;      // listener pipes without reader (crashed clients)
+} notify_stats_t;
+
+typedef struct presence_slot_s {
+    pid_t pid;                   // member pid, 0 when free, negative while being claimed
+    char nick[MAX_NICK_LEN + 1]; // member nick
+    char tty[MAX_TTY_NAME_LEN];  // member terminal line
+    int64_t joined;              // UTC time member joined
+    int64_t active;              // UTC time member last sent message
+    uid_t uid;                   // member uid, owner of its direct message inbox
+} presence_slot_t;
+
+/* presence table shared by all members through mmap()ed
+ * chatdir file 'presence'
+ * - members claim slots on join and release them on exit
+ * - status fields are used to coalesce join/leave lines
+ */
+typedef struct presence_table_s {
+    uint32_t magic;
+    uint32_t slots;
+    int64_t status_time;         // UTC time last coalesced status line was emitted
+    uint32_t status_joined;      // joins not reported in chatlog yet
+    uint32_t status_left;        // leaves not reported in chatlog yet
+    pid_t status_owner;          // member whose timer reports them once window is over
+    presence_slot_t slot[MAX_PRESENCE_SLOTS];
+} presence_table_t;
+
+typedef struct notify_retry_s {
+    char name[MAX_NOTIFY_NAME_LEN]; // listener pipe name in fifodir
+    char event[PIPECHAT_FRAME_LEN]; // undelivered control event or frame
+} notify_retry_t;
+
+// token bucket of chat lines of single member, see pipechat_rate_take()
+typedef struct rate_bucket_s {
+    pid_t pid;                // member the bucket belongs to
+    pipechat_rate_t rate;     // its lines and time of last refill
+    unsigned long suppressed; // lines suppressed since last report
+} rate_bucket_t;
+
+// rendered line in scrollback arena
+typedef struct scrollback_line_s {
+    uint32_t offset;
+    uint32_t len;
+} scrollback_line_t;
+
+/* ring of recently rendered chatlog lines, paged by /scroll, /top and /bottom
+ * - lines are stored back to back in single arena, offset table keeps
+ *   their order, both are allocated at once at join
+ */
+typedef struct scrollback_s {
+    char * arena;
+    size_t size;                              // arena size
+    size_t head;                              // arena offset next line goes to
+    scrollback_line_t * lines;                // offset table, ring of lines in arena
+    size_t lines_size;                        // offset table capacity
+    size_t first;                             // oldest line in offset table
+    size_t count;                             // lines in offset table
+    size_t view;                              // lines below page shown, 0 = live
+    char pending[MAX_SCROLLBACK_LINE_LEN];    // line being rendered
+    size_t pending_len;
+} scrollback_t;
+
+/* chatlog range skipped by wakeup which found us too far behind
+ * - it is summarized when skipped, and paged by /gap on demand
+ */
+typedef struct lag_gap_s {
+    long start;           // skipped range of chatlog
+    long end;
+    long cursor;          // where next /gap page starts
+    size_t cursor_line;   // lines of range paged so far
+    size_t lines;         // chatlog lines in range
+    size_t messages;      // chat messages among them
+    size_t senders;       // their distinct pids, MAX_LAG_SENDERS at most
+    int64_t first;        // times of oldest and newest record in ms
+    int64_t last;
+} lag_gap_t;
+
+// how far behind chatlog wakeups found us, see /stats
+typedef struct lag_stats_s {
+    long bytes;           // backlog at last wakeup
+    size_t lines;         // lines rendered by last wakeup
+    long max_bytes;
+    size_t max_lines;
+    unsigned long skips;  // wakeups which skipped to tail
+} lag_stats_t;
+
+/* per-member chatlog in 'log.d', as merged by readers
+ * - file is mapped, so records are merged straight out of page cache
+ */
+typedef struct split_writer_s {
+    pid_t pid;            // member file is named after
+    ino_t ino;
+    int fd;
+    char * map;           // mapping of file, NULL = none yet
+    size_t mapped;        // its length
+    size_t pos;           // how far we merged
+    size_t end;           // end of its complete records
+    size_t next;          // end of record at pos, while merged
+    int64_t time;         // order of record at pos
+    uint64_t seq;
+} split_writer_t;
+
+// what /ignore, /only and /mute-status keep off the screen
+typedef struct filter_s {
+    pid_t pids[MAX_FILTERS];                    // ignored pids
+    size_t pids_len;
+    char nicks[MAX_FILTERS][MAX_NICK_LEN + 1];  // ignored nicks
+    size_t nicks_len;
+    char only[MAX_NICK_LEN + 1];                // the only nick shown, if set
+    int mute_status;                            // hide "*** ... ***" status lines
+    unsigned long hidden;                       // lines filtered out so far
+} filter_t;
+
+#ifdef PIPECHAT_LITE
+// state of built-in line editor, which stands in for readline in lite build
+typedef struct lineedit_s {
+    char line[MAX_INPUT_LINE_LEN + 1];                          // line being edited
+    size_t len;
+    size_t point;                                               // cursor offset in line
+    char history[LINEEDIT_HISTORY_LEN][MAX_INPUT_LINE_LEN + 1]; // ring of entered lines
+    size_t history_len;
+    size_t history_next;                                        // ring slot taken next
+    size_t history_pos;                                         // lines back recalled, 0 = none
+    int escape;                                                 // 1 after ESC, 2 in CSI sequence
+    char csi[8];                                                // CSI parameters seen so far
+    size_t csi_len;
+    int hidden;                                                 // prompt is off the screen for good
+    int raw;                                                    // terminal was switched to raw mode
+    struct termios saved;                                       // terminal mode to restore
+} lineedit_t;
+#endif
+
+// HDR-style histogram of latencies in ns
+typedef struct latency_hist_s {
+    uint64_t count;
+    int64_t min;
+    int64_t max;
+    uint64_t bucket[LATENCY_BUCKETS];
+} latency_hist_t;
+
+// header of --record trace
+typedef struct trace_header_s {
+    uint32_t magic;
+    uint32_t version;
+    int64_t started;   // UTC time recording started
+} trace_header_t;
+
+typedef enum trace_type_e {
+    TRACE_JOIN = 'J',     // member registered in eventdir
+    TRACE_LEAVE = 'L',    // member unregistered from eventdir
+    TRACE_MESSAGE = 'M',  // chat message (all of its lines) appended to chatlog
+    TRACE_APPEND = 'A',   // anything else appended to chatlog
+} trace_type;
+
+// single --record trace record
+typedef struct trace_record_s {
+    uint32_t delta_us;    // time since previous record
+    uint32_t client;      // member number within trace, 0 = unknown
+    uint32_t len;         // bytes appended to chatlog
+    uint8_t type;         // see trace_type
+    uint8_t pad[3];
+} trace_record_t;
+
+// chat message --record is collecting lines of
+typedef struct trace_message_s {
+    pid_t pid;            // its sender
+    uint32_t client;      // and their number within trace
+    uint32_t len;         // bytes of it so far, 0 = none
+} trace_message_t;
+
+// outcome of --replay
+typedef struct replay_result_s {
+    size_t messages;      // messages replayed
+    size_t appends;       // other appends replayed
+    size_t members;       // synthetic members started
+    int64_t elapsed;      // how long replay took in ns
+    int64_t traced;       // how long recorded traffic took in ns
+    int64_t * lag;        // dispatch lag of each record in ns
+    size_t lagged;        // number of lag samples
+} replay_result_t;
+
+// "[pid][time] <nick>" prefix of our records, see record_prefix_get()
+typedef struct record_prefix_s {
+    char * text;          // prefix itself, malloc()ed, static in lite build
+    size_t len;           // its length, 0 = to be built
+    size_t time_at;       // offset of time string within text
+    time_t time;          // second time string is of
+    const char * nick;    // nickstr text was built for
+} record_prefix_t;
+
 
 // GLOBALS
 
@@ -255,6 +671,17 @@ char * pipechat_commands[] = {
     "/list",
     "/whois",
     "/ptyof",
+    "/msg",
+    "/ignore",
+    "/unignore",
+    "/only",
+    "/mute-status",
+    "/scroll",
+    "/top",
+    "/bottom",
+    "/gap",
+    "/stats",
+    "/latency",
 //    "/save",
     "/destroy",
 
@@ -279,11 +706,161 @@ static char * chatdirstr = NULL;
 static char * nickstr = NULL;
 static char * groupstr = NULL;
 static char * pidstr = &pidstr_buf[0];
+
+/* name of our pipe in eventdir
+ * - same as pidstr, or pidstr prefixed with dot, when we get chatlog
+ *   from broker and only need control events through our pipe
+ */
+static char notify_namestr[MAX_NOTIFY_NAME_LEN] = {0};
 static char * promptstr = &promptstr_buf[0];
 
+// prefix of records we send, rebuilt when pid or nick change
+static record_prefix_t record_prefix = {0};
+
 // track of the last position we read from chatlog.
 static long last_chatlog_read_pos = 0;
 
+// how far we read our direct message inbox
+static long last_inbox_read_pos = 0;
+
+// fifodir notification accounting, see /stats
+static notify_stats_t notify_stats = {0};
+
+// control events which did not fit into listener pipes yet
+static notify_retry_t * notify_retry_queue = NULL;
+static size_t notify_retry_len = 0;
+static size_t notify_retry_cap = 0;
+
+// what this process is about, see run_mode
+static run_mode mode = MODE_CHAT;
+
+// how --follow moves chatlog data to stdout, downgraded on first failure
+static copy_method follow_copy_method = COPY_SPLICE;
+
+// --archive destination file and how chatlog data gets into it, downgraded on first failure
+static char * archive_dest = NULL;
+static copy_method archive_copy_method = COPY_FILE_RANGE;
+
+// where merged records of per-member chatlogs go, and whether writing there failed
+static int split_out_fd = -1;
+static int split_out_failed = 0;
+
+// benchmark to run and its parameters
+static char * bench_name = NULL;
+static char * bench_joiners = "1,100,1000";
+static char * bench_members = "10,100";
+
+// shared presence table and our own slot in it
+static presence_table_t * presence = NULL;
+static presence_slot_t * presence_self = NULL;
+
+// time in ms destroyer waits for members to acknowledge /destroy
+static long destroy_ack_deadline = DESTROY_ACK_DEADLINE;
+
+/* whether we stamp messages with monotonic time of sending, see
+ * chatdir 'config', and latencies measured from stamps of others
+ * - append to wakeup, i.e. notification and scheduling delay
+ * - append to rendered, i.e. including chatlog read and printing
+ */
+static long latency_stamps = 0;
+static int64_t latency_wakeup_ns = 0;
+static latency_hist_t latency_wakeup = {0};
+static latency_hist_t latency_rendered = {0};
+
+/* whether we seal chatlog lines with CRC32C, see chatdir 'config',
+ * and damaged records skipped while reading, see /stats
+ */
+static long record_crc = 0;
+static unsigned long chatlog_corrupt = 0;
+static unsigned long chatlog_torn = 0;
+
+/* --retain policy, chatlog older than retain_ms or before its last
+ * retain_bytes is punched out, 0 = keep everything
+ */
+static long long retain_bytes = 0;
+static int64_t retain_ms = 0;
+static int64_t retain_last_ns = 0;
+
+// --record pid to trace client map and records waiting to be written
+static pid_t trace_pids[MAX_TRACE_CLIENTS];
+static uint32_t trace_clients[MAX_TRACE_CLIENTS];
+static uint32_t trace_clients_len = 0;
+static trace_record_t trace_batch[MAX_TRACE_BATCH];
+static size_t trace_batch_len = 0;
+static int64_t trace_last_ns = 0;
+static trace_message_t record_message = {0};
+
+// --replay trace and pace multiplier, 0 = as fast as possible
+static char * replay_trace = NULL;
+static long replay_speed = 1;
+
+// synthetic members of --bench traffic send and render like real ones
+static int replay_render = 0;
+
+// terminal input read ahead, readline is fed from it, see input_getc()
+static char input_buffer[MAX_INPUT_READ_LEN];
+#ifdef PIPECHAT_LITE
+// built-in line editor of lite build, see lineedit_key()
+static lineedit_t lineedit = {0};
+#else
+static size_t input_len = 0;
+static size_t input_pos = 0;
+#endif
+
+// room size above which join/leave status lines are coalesced, 0 = never
+static int status_coalesce_threshold = 0;
+
+// scrollback arena size in MB, 0 = no scrollback
+static long scrollback_mb = SCROLLBACK_DEFAULT_MB;
+static scrollback_t scrollback = {0};
+
+/* members append to their own chatlogs in 'log.d' when set, see chatdir config
+ * - our records are numbered, so readers can merge them in order
+ */
+static long split_log = 0;
+static uint64_t split_seq = 0;
+
+/* per-member chatlogs we merge and when we looked for new ones
+ * - table grows as members join, as chatlogs of those who left stay in
+ *   'log.d' until --compact folds them, and split_heap grows with it
+ */
+static split_writer_t * split_writers = NULL;
+static size_t * split_heap = NULL;
+static size_t split_writers_len = 0;
+static size_t split_writers_cap = 0;
+static struct timespec split_dir_mtime = {0};
+static time_t split_dir_scanned = 0;
+
+// when we looked for 'log.d' created after we joined
+static struct timespec chatdir_mtime = {0};
+static time_t chatdir_scanned = 0;
+
+// realtime minus monotonic clock in ns, puts 'log' records on merge clock
+static int64_t split_clock_offset = 0;
+
+// chatlog backlog wakeup skips to its last screen past, 0 = never
+static long lag_skip_bytes = LAG_SKIP_DEFAULT;
+static lag_stats_t lag_stats = {0};
+static lag_gap_t lag_gap = {0};
+
+// id of our last /list, /whois or /ptyof query, answers to it are shown
+static uint32_t control_request = 0;
+
+// client side chatlog filters, see filter_chatlog()
+static filter_t filters = {0};
+
+// chat lines members may send at once and per second, 0 = unlimited
+static long rate_burst = RATE_BURST;
+static long rate_sustained = RATE_SUSTAINED;
+
+/* our own line limit and line rates of other members as seen
+ * in chatlog, with lines suppressed by us in total
+ */
+static rate_bucket_t rate_self = {0};
+static rate_bucket_t rate_tracked[MAX_RATE_TRACKED];
+static unsigned long rate_suppressed_sent = 0;
+static unsigned long rate_suppressed_seen = 0;
+
 // boolean magic
 typedef enum { NO, YES } BOOL;
 
@@ -291,9 +868,20 @@ typedef enum { NO, YES } BOOL;
 BOOL run = YES;
 BOOL log_leaving_message = YES;
 
+// chat is printed without prompt to keep, see replay_render_start()
+static BOOL print_bare = NO;
+
 
 // few forward declarations
 static void send_message (const char *message);
+static int dm_send (pid_t pid, const char * text);
+static void dm_process (void);
+static void filter_command (char * line);
+static void scrollback_command (char * line);
+static void lag_gap_command (char * line);
+static void split_scan (BOOL from_end, BOOL finished_only);
+static BOOL split_room (void);
+static int notify_spitpid (const int dirfd, pid_t pid, char event);
 int notify_new_message(DIR * eventdirptr);
 
 
@@ -587,533 +1175,6770 @@ rmr_chatdir(const char * dir)
 }
 
 
-// builds time string for message timestamping.
+// builds time string of given time.
 static void
-get_timestr (char *dt)
+format_timestr (char *dt, time_t t)
 {
     struct tm tm = {0};
-    time_t t = 0;
 
-    t = time(NULL);
     gmtime_r(&t, &tm); // UTC
 
     strftime(dt, MAX_TIME_STR_LEN, TIME_STR_FORMAT, &tm);
 }
 
 
-// prints buffer to the screen while playing nice with readline
-static void
-print_buffer (char *buffer)
+// returns time string of given time, formatted once per second only
+static const char *
+cached_timestr (time_t t)
 {
+    static char dt[MAX_TIME_STR_LEN] = {0};
+    static time_t dt_time = -1;
 
-    char *saved_line = NULL;
-    int saved_point = 0;
-
-    /* this is readline stuff.
-     *  - save the cursor position
-     *  - save the current line contents
-     *  - set the line to blank
-     *  - tell readline we're done mucking
-     *  - print the message
-     *  - restore the standard prompt
-     *  - restore the line contents
-     *  - restore the cursor position
-     *  - tell readline we're done mucking (again)
-     */
-    saved_point = rl_point;
-    saved_line = rl_copy_text(0, rl_end);
-    rl_set_prompt("");
-    rl_clear_message();
-    rl_replace_line("", 0);
-    rl_redisplay();
-    dprintf(1, "%s", buffer);
-    rl_set_prompt(PROMPT);
-    rl_replace_line(saved_line, 0);
-    rl_point = saved_point;
-    rl_redisplay();
-    free(saved_line);
+    if (t != dt_time) {
+        format_timestr(dt, t);
+        dt_time = t;
+    }
+    return dt;
 }
 
 
-// prints raw string into the chatlog
+// builds time string for message timestamping.
 static void
-writechat_raw (const char *string)
+get_timestr (char *dt)
 {
-    fd_write(fds.fd_chatlog, (void *) string, strlen(string));
-    fsync(fds.fd_chatlog);
+    memcpy(dt, cached_timestr(time(NULL)), MAX_TIME_STR_LEN);
 }
 
 
-// emits "status" into the chatlog, i.e. user joined/left
-static void
-writechat_status (const char *status, size_t notify, size_t echo)
+// returns monotonic clock reading in nanoseconds
+static int64_t
+get_monotonic_ns (void)
 {
-    char time[MAX_TIME_STR_LEN] = {0};
-    char status_info[MAX_INFO_LINE_LEN] = {0};
-
-    if (fds.fd_chatlog > -1) {
-        get_timestr(time);
-        snprintf(status_info, sizeof(status_info), "[%s][%s] *** <%s> %s ***\n", pidstr, time, nickstr, status);
-        fd_write(fds.fd_chatlog, status_info, strlen(status_info));
-        fsync(fds.fd_chatlog);
+    struct timespec ts = {0};
 
-        if (notify) {
-            notify_new_message(event_fifodir);
-        }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-        if (echo) {
-            print_buffer(status_info);
-        }
-    }
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 
-/* "unregisters" from notifications
- * - by closing notify pipe
- */
-void
-notify_unregister_pipe(void)
+// returns monotonic clock reading in milliseconds
+static long
+get_monotonic_ms (void)
 {
-    char notify_name[MAX_NOTIFY_NAME_LEN] = {0};
-    int ret = -1;
+    struct timespec ts = {0};
 
-    if ((ret = snprintf(notify_name, sizeof(notify_name), "event/%s", pidstr)) < 0 || ret > sizeof(notify_name)) {
-        dprintf(2, "warning: Notify event listener name too long for '%s/event' or error occured: %s", chatdirstr, strerror(errno));
-    } else if (fds.fd_chatdir != -1 && unlinkat(fds.fd_chatdir, notify_name, 0) < 0 && errno != ENOENT) {
-        dprintf(2, "warning: Unable to unregister notify event listener '%d:%s' at '%s': %s", fds.fd_chatdir, notify_name, chatdirstr, strerror(errno));
-    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 
-/* sends "event" to listeners in fifodir
- * - "event" is single byte message
+#ifdef PIPECHAT_LITE
+
+/* redraws prompt and line being edited
+ * - line longer than terminal is scrolled horizontally, so it stays
+ *   on single row, which is all "\r" can take us back to
+ * - whole row is assembled first and written at once
  */
-int
-notify_fifodir (DIR * eventdirptr, char * event, size_t notify_self)
+static void
+lineedit_redraw (void)
 {
-    struct dirent * dentry = NULL;
-    int dfd = -1;
+    static char row[MAX_INFO_LINE_LEN + MAX_INPUT_LINE_LEN + 16];
+    struct winsize ws = {0};
+    size_t prompt_len = strlen(PROMPT), width = 80, start = 0, shown = 0;
+    int len = 0;
 
-    rewinddir(eventdirptr);
-    dfd = dirfd(eventdirptr);
+    if (lineedit.hidden) {
+        return;
+    }
 
-    if (dfd < 0) return -1;
+    if (ioctl(1, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        width = ws.ws_col;
+    }
+    width = width > prompt_len + 8 ? width - prompt_len - 1 : 8;
 
-    while ((dentry = readdir(eventdirptr)) != NULL)	{
-        if (dentry->d_type == DT_FIFO) {
-            if (strstr(dentry->d_name, pidstr) && notify_self) {
-                fd_spitat(dfd, dentry->d_name, event, 1);
-            } else {
-                fd_spitat(dfd, dentry->d_name, event, 1);
-            }
+    // keep cursor in sight, without starting in the middle of UTF-8 sequence
+    if (lineedit.point > width) {
+        start = lineedit.point - width;
+    }
+    while (start < lineedit.point && (lineedit.line[start] & 0xc0) == 0x80) {
+        start++;
+    }
+    shown = lineedit.len - start < width ? lineedit.len - start : width;
+
+    len = snprintf(row, sizeof(row), "\r%s%.*s\033[K", PROMPT, (int) shown, lineedit.line + start);
+    if (lineedit.point < start + shown) {
+        size_t back = 0;
+        for (size_t i = lineedit.point; i < start + shown; i++) {
+            back += (lineedit.line[i] & 0xc0) != 0x80;
         }
+        len += snprintf(row + len, sizeof(row) - len, "\033[%zuD", back);
     }
 
-    return 0;
+    fd_write(1, row, len);
 }
 
 
-/* writes newline to other listeners in fifodir
- * - to indicate to them they should reread chatlog
- */
-int
-notify_new_message (DIR * eventdirptr)
+// keeps entered line in history ring, for up arrow to recall it
+static void
+lineedit_remember (const char * line)
 {
-    return notify_fifodir(eventdirptr, "\n", 1);
+    if (*line == '\0') {
+        return;
+    }
+
+    snprintf(lineedit.history[lineedit.history_next], sizeof(lineedit.history[0]), "%s", line);
+    lineedit.history_next = (lineedit.history_next + 1) % LINEEDIT_HISTORY_LEN;
+    if (lineedit.history_len < LINEEDIT_HISTORY_LEN) {
+        lineedit.history_len++;
+    }
+    lineedit.history_pos = 0;
 }
 
 
-/* writes 'W' to other listeners in fifodir
- * - to indicate to them they should emit their nick/pid pairs
- */
-int
-notify_list (DIR * eventdirptr)
+// takes prompt and line being edited off the row cursor is on
+static void
+lineedit_erase (void)
 {
-    int ret = -1;
-
-    char list_query[MAX_INFO_LINE_LEN] = {0};
-    char time[MAX_TIME_STR_LEN] = {0};
-    get_timestr(time);
-
-    if ((ret = snprintf(list_query, sizeof(list_query), "[%s][%s] <%s> /list\n", pidstr, time, nickstr)) > 0 && ret <= sizeof(list_query)) {
-        writechat_raw(list_query);
+    if (! lineedit.hidden) {
+        fd_write(1, "\r\033[K", 4);
     }
-
-    return notify_fifodir(eventdirptr, "L", 1);
 }
 
 
-/* writes 'w' to specific listener in fifodir
- * - to indicate to it it should emit it's username
- */
-int
-notify_whois (DIR * eventdirptr, pid_t pid)
+// prints buffer to the screen above prompt and line being edited
+static void
+print_buffer (char *buffer)
 {
-    char userpid[MAX_NOTIFY_NAME_LEN] = {0};
-    int dfd = -1, ret = -1;
-
-    dfd = dirfd(eventdirptr);
-
-    if (dfd < 0) return -1;
-
-    if ((ret = snprintf(userpid, sizeof(userpid), "%d", pid)) < 0 || ret > sizeof(userpid)) {
-        return -1;
-    }
-
-    {
-        char whois_query[MAX_INFO_LINE_LEN] = {0};
-        char time[MAX_TIME_STR_LEN] = {0};
-        get_timestr(time);
-        if ((ret = snprintf(whois_query, sizeof(whois_query), "[%s][%s] <%s> /whois %s ?\n", pidstr, time, nickstr, userpid)) > 0 && ret <= sizeof(whois_query)) {
-            writechat_raw(whois_query);
-            ret = fd_spitat(dfd, userpid, "w", 1);
-        }
+    if (mode == MODE_OBSERVE || print_bare) {
+        dprintf(1, "%s", buffer);
+        return;
     }
 
-    return ret;
+    lineedit_erase();
+    dprintf(1, "%s", buffer);
+    lineedit_redraw();
 }
 
 
-/* writes 'p' to specific listener in fifodir
- * - to indicate to it it should emit it's pid
- */
-int
-notify_pty (DIR * eventdirptr, pid_t pid)
+// takes prompt off the screen for good, when there's no more input to take
+static void
+prompt_clear (void)
 {
-    char userpid[MAX_NOTIFY_NAME_LEN] = {0};
-    int dfd = -1, ret = -1;
+    lineedit_erase();
+    lineedit.hidden = YES;
+}
 
-    dfd = dirfd(eventdirptr);
 
-    if (dfd < 0) return -1;
+// returns number of terminal rows
+static int
+terminal_rows (void)
+{
+    struct winsize ws = {0};
 
-    if ((ret = snprintf(userpid, sizeof(userpid), "%d", pid)) < 0 || ret > sizeof(userpid)) {
-        return -1;
-    }
+    return ioctl(1, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 ? ws.ws_row : 24;
+}
 
-    {
-        char whois_query[MAX_INFO_LINE_LEN] = {0};
-        char time[MAX_TIME_STR_LEN] = {0};
-        get_timestr(time);
-        if ((ret = snprintf(whois_query, sizeof(whois_query), "[%s][%s] <%s> /ptyof %s\n", pidstr, time, nickstr, userpid)) > 0 && ret <= sizeof(whois_query)) {
-            writechat_raw(whois_query);
-            ret = fd_spitat(dfd, userpid, "p", 1);
-        }
-    }
+#else
 
-    return ret;
-}
+// whether batch of input is being processed, see input_process()
+static BOOL input_batch = NO;
 
+// whether line was taken off the screen during batch of input
+static BOOL input_hidden = NO;
 
-/* writes 'D' to other listeners in fifodir
- * - to indicate to them that chatroom was "destroyed"
+
+/* takes prompt and line off the screen, once readline has blanked them
+ * - during batch of input they stay off until batch is over
  */
-int
-notify_destroy (DIR * eventdirptr)
+static void
+input_hide (void)
 {
-    char destroy_info[MAX_INFO_LINE_LEN] = {0};
-    char time[MAX_TIME_STR_LEN] = {0};
+    if (! input_hidden) {
+        rl_redisplay();
+        input_hidden = input_batch;
+    }
+}
 
-    get_timestr(time);
 
-    if (snprintf(destroy_info, sizeof(destroy_info), "[%s][%s] <%s> /destroy %s\n", pidstr, time, nickstr, chatdirstr) > 0) {
-        writechat_raw(destroy_info);
-        notify_fifodir(eventdirptr, "\n", 0);
+// puts prompt and line back on the screen, unless batch of input does it once it's over
+static void
+input_show (void)
+{
+    if (! input_batch) {
+        rl_redisplay();
     }
-    return notify_fifodir(eventdirptr, "D", 1);
 }
 
 
-// dispatches input line obtained from readline
+// prints buffer to the screen while playing nice with readline
+static void
+print_buffer (char *buffer)
+{
+
+    char *saved_line = NULL;
+    int saved_point = 0;
+
+    // there's no prompt to play nice with, when just observing or benchmarking
+    if (mode == MODE_OBSERVE || print_bare) {
+        dprintf(1, "%s", buffer);
+        return;
+    }
+
+    /* this is readline stuff.
+     *  - save the cursor position
+     *  - save the current line contents
+     *  - set the line to blank
+     *  - tell readline we're done mucking
+     *  - print the message
+     *  - restore the standard prompt
+     *  - restore the line contents
+     *  - restore the cursor position
+     *  - tell readline we're done mucking (again)
+     */
+    saved_point = rl_point;
+    saved_line = rl_copy_text(0, rl_end);
+    rl_set_prompt("");
+    rl_clear_message();
+    rl_replace_line("", 0);
+    input_hide();
+    dprintf(1, "%s", buffer);
+    rl_set_prompt(PROMPT);
+    rl_replace_line(saved_line, 0);
+    rl_point = saved_point;
+    input_show();
+    free(saved_line);
+}
+
+
+// takes prompt off the screen for good, when there's no more input to take
+static void
+prompt_clear (void)
+{
+    rl_set_prompt("");
+    rl_clear_message();
+    rl_redisplay();
+}
+
+
+// returns number of terminal rows, as readline keeps track of them
+static int
+terminal_rows (void)
+{
+    int rows = 0, cols = 0;
+
+    rl_get_screen_size(&rows, &cols);
+
+    return rows > 0 ? rows : 24;
+}
+
+#endif
+
+
+// checks whether presence slot owner is still running
+static size_t
+presence_pid_alive (pid_t pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+
+/* maps presence table shared by all members of chatdir
+ * - table file is created on demand with chatlog permissions
+ */
+static int
+presence_open (int chatdir_fd)
+{
+    int fd = -1;
+    uint32_t magic = 0;
+    struct stat sb = {0};
+    presence_table_t * table = NULL;
+
+    do {
+        fd = openat(chatdir_fd, "presence", O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+    } while ((fd == -1) && errno == EINTR);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &sb) < 0
+     || (groupstr && sb.st_uid == geteuid() && fchown(fd, geteuid(), egid) < 0)
+     || (groupstr && sb.st_uid == geteuid() && fchmod(fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP) < 0)
+     || (sb.st_size < sizeof(presence_table_t) && ftruncate(fd, sizeof(presence_table_t)) < 0)) {
+        fd_close(fd);
+        return -1;
+    }
+
+    table = mmap(NULL, sizeof(presence_table_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    fd_close(fd);
+
+    if (table == MAP_FAILED) {
+        return -1;
+    }
+
+    // first one to get here stamps the table
+    if (! __atomic_compare_exchange_n(&table->magic, &magic, PRESENCE_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && magic != PRESENCE_MAGIC) {
+        munmap(table, sizeof(presence_table_t));
+        errno = EPROTO;
+        return -1;
+    }
+    __atomic_store_n(&table->slots, MAX_PRESENCE_SLOTS, __ATOMIC_RELEASE);
+
+    presence = table;
+    return 0;
+}
+
+
+/* claims free (or stale) slot in presence table for us
+ * - slot is marked with negative pid while it's being filled in
+ */
+static int
+presence_register (void)
+{
+    pid_t self = getpid();
+    time_t now = time(NULL);
+    const char * tty = ttyname(0);
+
+    if (presence == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    for (size_t i = 0; i < MAX_PRESENCE_SLOTS; i++) {
+        presence_slot_t * slot = &presence->slot[i];
+        pid_t owner = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+
+        if (presence_pid_alive(owner < 0 ? -owner : owner)) {
+            continue;
+        }
+        if (! __atomic_compare_exchange_n(&slot->pid, &owner, -self, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        snprintf(slot->nick, sizeof(slot->nick), "%s", nickstr);
+        snprintf(slot->tty, sizeof(slot->tty), "%s", tty ? tty : "?");
+        slot->joined = now;
+        slot->active = now;
+        slot->uid = geteuid();
+        __atomic_store_n(&slot->pid, self, __ATOMIC_RELEASE);
+
+        presence_self = slot;
+        return 0;
+    }
+
+    errno = ENOSPC;
+    return -1;
+}
+
+
+// unmaps presence table
+static void
+presence_close (void)
+{
+    if (presence) {
+        munmap(presence, sizeof(presence_table_t));
+        presence = NULL;
+        presence_self = NULL;
+    }
+}
+
+
+// releases our presence table slot
+void
+presence_unregister (void)
+{
+    if (presence_self) {
+        __atomic_store_n(&presence_self->pid, 0, __ATOMIC_RELEASE);
+        presence_self = NULL;
+    }
+}
+
+
+// marks our last activity in presence table
+static void
+presence_touch (void)
+{
+    if (presence_self) {
+        presence_self->active = time(NULL);
+    }
+}
+
+
+// finds live member by pid, copying its slot out of shared table
+static size_t
+presence_lookup (pid_t pid, presence_slot_t * member)
+{
+    if (presence == NULL || pid <= 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < MAX_PRESENCE_SLOTS; i++) {
+        if (__atomic_load_n(&presence->slot[i].pid, __ATOMIC_ACQUIRE) == pid) {
+            *member = presence->slot[i];
+            return presence_pid_alive(pid);
+        }
+    }
+
+    return 0;
+}
+
+
+// counts live members in presence table
+static size_t
+presence_count (void)
+{
+    size_t count = 0;
+
+    if (presence == NULL) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < MAX_PRESENCE_SLOTS; i++) {
+        if (presence_pid_alive(__atomic_load_n(&presence->slot[i].pid, __ATOMIC_ACQUIRE))) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+// prints live members from presence table, no chatlog or fifodir traffic involved
+static void
+presence_list (void)
+{
+    char lmsg[MAX_INFO_LINE_LEN] = {0};
+    char joined[MAX_TIME_STR_LEN] = {0};
+    time_t now = time(NULL);
+    size_t count = 0;
+
+    for (size_t i = 0; i < MAX_PRESENCE_SLOTS; i++) {
+        presence_slot_t member = presence->slot[i];
+
+        if (! presence_pid_alive(member.pid)) {
+            continue;
+        }
+
+        format_timestr(joined, member.joined);
+        snprintf(lmsg, sizeof(lmsg), "[%d] <%s> on %s, joined %s, idle %llds\n",
+            member.pid, member.nick, member.tty, joined, (long long) (now - member.active));
+        print_buffer(lmsg);
+        count++;
+    }
+
+    snprintf(lmsg, sizeof(lmsg), "%zu member(s) connected\n", count);
+    print_buffer(lmsg);
+}
+
+
+/* builds "O<ns>.<seq>" hidden field of our next record, returning its length
+ * - with split_log on, first line of each record gets it, so readers
+ *   can merge records of all members in order they were sent
+ * - monotonic clock is shared by all processes of the host, sequence
+ *   number keeps our own records in order, should they get the same time
+ */
+static int
+split_order_field (char * field, size_t size)
+{
+    return snprintf(field, size, "%cO%lld.%llu", CHATLOG_FIELD_SEP, (long long) get_monotonic_ns(), (unsigned long long) ++split_seq);
+}
+
+
+/* appends complete lines to the chatlog with single write(), see pipechat_append()
+ * - with record_crc on, each line gets "C<crc32c>" hidden field
+ *   covering the line up to it, so readers can tell torn records
+ * - with split_log on, they go to our own chatlog in 'log.d', first
+ *   of them with order field, lite build refuses data that does not
+ *   fit into buffer on stack then
+ */
+static int
+chatlog_append (const char * data, size_t len)
+{
+    char ordered_local[MAX_CHAT_READ_BUFFER_LEN];
+    char * ordered = ordered_local;
+    int res = -1;
+
+    if (split_log) {
+        const char * eol = memchr(data, '\n', len);
+        size_t first = eol ? (size_t) (eol - data) : len;
+        char field[MAX_ORDER_FIELD_LEN];
+        int field_len = split_order_field(field, sizeof(field));
+
+        if (len + field_len > sizeof(ordered_local)) {
+#ifdef PIPECHAT_LITE
+            errno = E2BIG;
+            return -1;
+#else
+            if ((ordered = malloc(len + field_len)) == NULL) {
+                return -1;
+            }
+#endif
+        }
+        memcpy(ordered, data, first);
+        memcpy(ordered + first, field, field_len);
+        memcpy(ordered + first + field_len, data + first, len - first);
+        data = ordered;
+        len += field_len;
+    }
+
+    res = pipechat_append(fds.fd_append, data, len, record_crc);
+#ifndef PIPECHAT_LITE
+    if (ordered != ordered_local) {
+        free(ordered);
+    }
+#endif
+
+    return res;
+}
+
+
+// prints raw string into the chatlog
+static void
+writechat_raw (const char *string)
+{
+    chatlog_append(string, strlen(string));
+    fsync(fds.fd_append);
+}
+
+
+// emits "status" into the chatlog, i.e. user joined/left
+static void
+writechat_status (const char *status, size_t notify, size_t echo)
+{
+    char time[MAX_TIME_STR_LEN] = {0};
+    char status_info[MAX_INFO_LINE_LEN] = {0};
+
+    if (fds.fd_chatlog > -1) {
+        get_timestr(time);
+        snprintf(status_info, sizeof(status_info), "[%s][%s] *** <%s> %s ***\n", pidstr, time, nickstr, status);
+        chatlog_append(status_info, strlen(status_info));
+        fsync(fds.fd_append);
+
+        if (notify) {
+            notify_new_message(event_fifodir);
+        }
+
+        if (echo) {
+            print_buffer(status_info);
+        }
+    }
+}
+
+
+/* returns ms until joins and leaves counted in presence table are due
+ * to be reported, or -1 when there's nothing to report or it's not
+ * up to us, see presence_status_own()
+ */
+static long
+presence_status_wait (void)
+{
+    int64_t last = 0, now = 0;
+
+    if (presence == NULL
+     || __atomic_load_n(&presence->status_owner, __ATOMIC_ACQUIRE) != getpid()
+     || (__atomic_load_n(&presence->status_joined, __ATOMIC_ACQUIRE) == 0
+      && __atomic_load_n(&presence->status_left, __ATOMIC_ACQUIRE) == 0)) {
+        return -1;
+    }
+
+    now = time(NULL);
+    last = __atomic_load_n(&presence->status_time, __ATOMIC_ACQUIRE);
+
+    return now - last < STATUS_COALESCE_WINDOW ? (last + STATUS_COALESCE_WINDOW - now) * 1000 : 0;
+}
+
+
+/* makes timer of single member report counts left over when window
+ * is over, instead of having whole room wake up to race for it
+ * - joiner that counted takes it over
+ * - leaver gives up its slot and, unless owner is somebody else still
+ *   registered, hands it over to first member left, waking it up so
+ *   it sets its timer
+ */
+static void
+presence_status_own (size_t joined)
+{
+    presence_slot_t member = {0};
+    pid_t self = getpid();
+    pid_t owner = __atomic_load_n(&presence->status_owner, __ATOMIC_ACQUIRE);
+
+    if (joined) {
+        __atomic_store_n(&presence->status_owner, self, __ATOMIC_RELEASE);
+        return;
+    }
+
+    presence_unregister();
+    if (owner != self && presence_lookup(owner, &member)) {
+        return;
+    }
+
+    for (size_t i = 0; i < MAX_PRESENCE_SLOTS; i++) {
+        pid_t pid = __atomic_load_n(&presence->slot[i].pid, __ATOMIC_ACQUIRE);
+
+        if (pid > 0 && presence_pid_alive(pid)) {
+            if (__atomic_compare_exchange_n(&presence->status_owner, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                notify_spitpid(dirfd(event_fifodir), pid, '\n');
+            }
+            return;
+        }
+    }
+}
+
+
+/* reports joins and leaves counted in presence table as single status line
+ * - only one member per window gets to report what happened, whoever
+ *   is first, be it joining or leaving member or timer of status owner
+ */
+static void
+presence_status_flush (void)
+{
+    char time_str[MAX_TIME_STR_LEN] = {0};
+    char status_info[MAX_INFO_LINE_LEN] = {0};
+    int64_t last = 0, now = 0;
+    uint32_t joins = 0, leaves = 0;
+
+    now = time(NULL);
+    last = __atomic_load_n(&presence->status_time, __ATOMIC_ACQUIRE);
+    if (now - last < STATUS_COALESCE_WINDOW || ! __atomic_compare_exchange_n(&presence->status_time, &last, now, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    joins = __atomic_exchange_n(&presence->status_joined, 0, __ATOMIC_ACQ_REL);
+    leaves = __atomic_exchange_n(&presence->status_left, 0, __ATOMIC_ACQ_REL);
+
+    // somebody else reported them right before window got ours
+    if (joins == 0 && leaves == 0) {
+        return;
+    }
+
+    get_timestr(time_str);
+    snprintf(status_info, sizeof(status_info), "[%s][%s] *** %u joined, %u left, %zu connected ***\n", pidstr, time_str, joins, leaves, presence_count());
+    writechat_raw(status_info);
+    notify_new_message(event_fifodir);
+}
+
+
+/* emits join/leave status into the chatlog
+ * - in rooms larger than status_coalesce_threshold joins and leaves
+ *   are only counted in presence table and reported as single
+ *   status line at most once per STATUS_COALESCE_WINDOW
+ * - counts left over when window ends are reported by timer of
+ *   single member, see presence_status_own()
+ */
+static void
+writechat_presence (size_t joined, size_t echo)
+{
+    char time_str[MAX_TIME_STR_LEN] = {0};
+    char status_info[MAX_INFO_LINE_LEN] = {0};
+
+    if (status_coalesce_threshold <= 0 || presence == NULL || presence_count() <= status_coalesce_threshold) {
+        writechat_status(joined ? "joined" : "left", 1, echo);
+        return;
+    }
+
+    __atomic_add_fetch(joined ? &presence->status_joined : &presence->status_left, 1, __ATOMIC_ACQ_REL);
+
+    if (echo) {
+        get_timestr(time_str);
+        snprintf(status_info, sizeof(status_info), "[%s][%s] *** <%s> %s ***\n", pidstr, time_str, nickstr, joined ? "joined" : "left");
+        print_buffer(status_info);
+    }
+
+    presence_status_flush();
+    presence_status_own(joined);
+}
+
+
+/* "unregisters" from notifications
+ * - by closing notify pipe
+ */
+void
+notify_unregister_pipe(void)
+{
+    char notify_name[MAX_NOTIFY_NAME_LEN] = {0};
+    int ret = -1;
+
+    if ((ret = snprintf(notify_name, sizeof(notify_name), "event/%s", notify_namestr)) < 0 || ret > sizeof(notify_name)) {
+        dprintf(2, "warning: Notify event listener name too long for '%s/event' or error occured: %s", chatdirstr, strerror(errno));
+    } else if (fds.fd_chatdir != -1 && unlinkat(fds.fd_chatdir, notify_name, 0) < 0 && errno != ENOENT) {
+        dprintf(2, "warning: Unable to unregister notify event listener '%d:%s' at '%s': %s", fds.fd_chatdir, notify_name, chatdirstr, strerror(errno));
+    }
+}
+
+
+// returns length of control event at event, single byte or whole frame
+static size_t
+notify_event_len (const char * event)
+{
+    return event[0] == PIPECHAT_FRAME_START ? PIPECHAT_FRAME_LEN : 1;
+}
+
+
+/* puts undelivered control event or frame aside for later redelivery
+ * - event of the same kind already waiting for the same listener is
+ *   not queued twice, frame of the same type replaces the queued one,
+ *   whatever its request id, so queue stays bounded by listeners times
+ *   kinds of events even when listener is stuck
+ * - queue grows as needed, event is lost only when we are out of memory
+ */
+static void
+notify_retry_push (const char * name, const char * event)
+{
+    notify_retry_t * entry = NULL;
+    size_t len = notify_event_len(event);
+
+    for (size_t i = 0; i < notify_retry_len; i++) {
+        entry = &notify_retry_queue[i];
+        if (entry->event[0] == event[0] && (len == 1 || entry->event[1] == event[1]) && strcmp(entry->name, name) == 0) {
+            memcpy(entry->event, event, len);
+            notify_stats.coalesced++;
+            return;
+        }
+    }
+
+    if (notify_retry_len >= notify_retry_cap) {
+        size_t cap = notify_retry_cap ? notify_retry_cap * 2 : NOTIFY_RETRY_INITIAL_LEN;
+        notify_retry_t * queue = realloc(notify_retry_queue, cap * sizeof(notify_retry_t));
+        if (queue == NULL) {
+            notify_stats.dropped++;
+            return;
+        }
+        notify_retry_queue = queue;
+        notify_retry_cap = cap;
+    }
+
+    entry = &notify_retry_queue[notify_retry_len++];
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    memcpy(entry->event, event, len);
+    notify_stats.deferred++;
+}
+
+
+// checks whether listener still has control events waiting in retry queue
+static size_t
+notify_retry_pending (const char * name)
+{
+    for (size_t i = 0; i < notify_retry_len; i++) {
+        if (strcmp(notify_retry_queue[i].name, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* delivers single event byte into listener pipe named name at dirfd
+ * - '\n' is level-triggered: listener rereads chatlog up to its end
+ *   on any read from its pipe, whatever it read, so it's skipped when
+ *   listener has unread events already and it's safe to lose it when
+ *   pipe is full
+ * - control events that don't fit into pipe (EAGAIN) or are queued
+ *   behind other undelivered control events go into retry queue
+ */
+static int
+notify_spitat (const int dirfd, const char * name, char event)
+{
+    int res = -1;
+
+    if (event != '\n' && notify_retry_pending(name)) {
+        notify_retry_push(name, &event);
+        return 0;
+    }
+
+    res = pipechat_notify_pipe(dirfd, name, event);
+
+    if (res == 1) {
+        notify_stats.sent++;
+    } else if (res == 0) {
+        notify_stats.coalesced++;
+    } else if (errno == ENXIO) {
+        notify_stats.stale++;
+    } else if (errno == EAGAIN) {
+        if (event == '\n') {
+            notify_stats.coalesced++;
+        } else {
+            notify_retry_push(name, &event);
+        }
+        res = 0;
+    }
+
+    return res;
+}
+
+
+/* tries to redeliver control events and frames from retry queue
+ * - events are kept in order per listener
+ * - events wait as long as their listener is there, 'D' included,
+ *   listeners that went away are forgotten
+ */
+static void
+notify_retry_flush (DIR * eventdirptr)
+{
+    size_t pending_len = notify_retry_len;
+    int dfd = dirfd(eventdirptr);
+
+    if (pending_len == 0 || dfd < 0) return;
+
+    // queue is compacted in place, kept entries never overtake read ones
+    notify_retry_len = 0;
+
+    for (size_t i = 0; i < pending_len; i++) {
+        notify_retry_t pending = notify_retry_queue[i];
+        size_t len = notify_event_len(pending.event);
+        int fd = -1, res = -1;
+
+        if (notify_retry_pending(pending.name)) {
+            notify_retry_queue[notify_retry_len++] = pending;
+            continue;
+        }
+
+        do {
+            fd = openat(dfd, pending.name, O_WRONLY | O_NONBLOCK);
+        } while ((fd == -1) && errno == EINTR);
+
+        if (fd == -1) {
+            if (errno == ENXIO) {
+                notify_stats.stale++;
+            }
+            continue;
+        }
+
+        // frame fits in PIPE_BUF, so it's written whole or not at all
+        res = fd_write(fd, pending.event, len);
+        fd_close(fd);
+
+        if (res == (int) len) {
+            notify_stats.sent++;
+            notify_stats.redelivered++;
+        } else if (errno == EAGAIN) {
+            notify_retry_queue[notify_retry_len++] = pending;
+        } else {
+            notify_stats.dropped++;
+        }
+    }
+}
+
+
+/* keeps redelivering control events until retry queue is empty
+ * - used when we are about to go away (quit, destroy)
+ * - gives up after deadline ms, as listener that stopped reading its
+ *   pipe would keep us here forever, what is left is reported
+ */
+static void
+notify_retry_drain (DIR * eventdirptr, long deadline)
+{
+    long until = get_monotonic_ms() + deadline;
+
+    while (notify_retry_len > 0 && get_monotonic_ms() < until) {
+        usleep(NOTIFY_RETRY_INTERVAL * 1000);
+        notify_retry_flush(eventdirptr);
+    }
+
+    if (notify_retry_len > 0) {
+        dprintf(2, "warning: %zu control events not delivered, first to '%s'\n", notify_retry_len, notify_retry_queue[0].name);
+        notify_stats.dropped += notify_retry_len;
+        notify_retry_len = 0;
+    }
+}
+
+
+/* delivers single event byte to listener with given pid
+ * - listener may be getting chatlog from broker, then its pipe is dotted
+ */
+static int
+notify_spitpid (const int dirfd, pid_t pid, char event)
+{
+    char name[MAX_NOTIFY_NAME_LEN] = {0};
+    int res = -1;
+
+    snprintf(name, sizeof(name), "%d", pid);
+    if ((res = notify_spitat(dirfd, name, event)) < 0 && errno == ENOENT) {
+        snprintf(name, sizeof(name), ".%d", pid);
+        res = notify_spitat(dirfd, name, event);
+    }
+
+    return res;
+}
+
+
+/* sends "event" to listeners in fifodir
+ * - "event" is single byte message
+ */
+int
+notify_fifodir (DIR * eventdirptr, char * event, size_t notify_self)
+{
+    struct dirent * dentry = NULL;
+    int dfd = -1;
+
+    rewinddir(eventdirptr);
+    dfd = dirfd(eventdirptr);
+
+    if (dfd < 0) return -1;
+
+    while ((dentry = readdir(eventdirptr)) != NULL)	{
+        // dotted pipes belong to broker clients, they get chatlog from broker
+        if (dentry->d_type == DT_FIFO && (event[0] != '\n' || dentry->d_name[0] != '.')) {
+            if (strstr(dentry->d_name, pidstr) && notify_self) {
+                notify_spitat(dfd, dentry->d_name, event[0]);
+            } else {
+                notify_spitat(dfd, dentry->d_name, event[0]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/* writes newline to other listeners in fifodir
+ * - to indicate to them they should reread chatlog
+ */
+int
+notify_new_message (DIR * eventdirptr)
+{
+    return notify_fifodir(eventdirptr, "\n", 1);
+}
+
+
+/* writes control frame into listener pipe named name at dirfd, at once
+ * - frame that does not fit into pipe right now, or is queued behind
+ *   other undelivered control events, goes into retry queue
+ */
+static int
+notify_frame_at (const int dirfd, const char * name, const char * raw)
+{
+    int fd = -1, res = -1;
+
+    if (notify_retry_pending(name)) {
+        notify_retry_push(name, raw);
+        return 0;
+    }
+
+    do {
+        fd = openat(dirfd, name, O_WRONLY | O_NONBLOCK);
+    } while ((fd == -1) && errno == EINTR);
+
+    if (fd == -1) {
+        if (errno == ENXIO) {
+            notify_stats.stale++;
+        }
+        return -1;
+    }
+
+    res = fd_write(fd, (void *) raw, PIPECHAT_FRAME_LEN);
+    fd_close(fd);
+
+    if (res == PIPECHAT_FRAME_LEN) {
+        notify_stats.sent++;
+        return 0;
+    } else if (errno == EAGAIN) {
+        notify_retry_push(name, raw);
+        return 0;
+    }
+    notify_stats.dropped++;
+
+    return -1;
+}
+
+
+// writes control frame to listener with given pid, dotted or not
+static int
+notify_frame (const int dirfd, pid_t pid, const pipechat_frame_t * frame)
+{
+    char raw[PIPECHAT_FRAME_LEN];
+    char name[MAX_NOTIFY_NAME_LEN] = {0};
+    int res = -1;
+
+    pipechat_frame_encode(frame, raw);
+
+    snprintf(name, sizeof(name), "%d", pid);
+    if ((res = notify_frame_at(dirfd, name, raw)) < 0 && errno == ENOENT) {
+        snprintf(name, sizeof(name), ".%d", pid);
+        res = notify_frame_at(dirfd, name, raw);
+    }
+
+    return res;
+}
+
+
+/* asks other listeners in fifodir who they are with list control frame
+ * - they answer to us only, nothing is written into chatlog
+ */
+int
+notify_list (DIR * eventdirptr)
+{
+    struct dirent * dentry = NULL;
+    pipechat_frame_t frame = { .type = PIPECHAT_FRAME_LIST, .pid = getpid(), .request = ++control_request };
+    char raw[PIPECHAT_FRAME_LEN];
+    char lmsg[MAX_INFO_LINE_LEN] = {0};
+    int dfd = dirfd(eventdirptr);
+
+    if (dfd < 0) return -1;
+
+    snprintf(lmsg, sizeof(lmsg), "[%s] is <%s>\n", pidstr, nickstr);
+    print_buffer(lmsg);
+
+    pipechat_frame_encode(&frame, raw);
+    rewinddir(eventdirptr);
+
+    while ((dentry = readdir(eventdirptr)) != NULL) {
+        const char * name = dentry->d_name[0] == '.' ? dentry->d_name + 1 : dentry->d_name;
+        if (dentry->d_type == DT_FIFO && strcmp(name, pidstr) != 0) {
+            notify_frame_at(dfd, dentry->d_name, raw);
+        }
+    }
+
+    return 0;
+}
+
+
+/* asks specific listener in fifodir who it is, with whois control frame
+ * - it answers to us only
+ */
+int
+notify_whois (DIR * eventdirptr, pid_t pid)
+{
+    pipechat_frame_t frame = { .type = PIPECHAT_FRAME_WHOIS, .pid = getpid(), .request = ++control_request };
+    int dfd = dirfd(eventdirptr);
+
+    if (dfd < 0) return -1;
+
+    return notify_frame(dfd, pid, &frame);
+}
+
+
+/* asks specific listener in fifodir which terminal it is on, with pty
+ * control frame
+ * - it answers to us only
+ */
+int
+notify_pty (DIR * eventdirptr, pid_t pid)
+{
+    pipechat_frame_t frame = { .type = PIPECHAT_FRAME_PTY, .pid = getpid(), .request = ++control_request };
+    int dfd = dirfd(eventdirptr);
+
+    if (dfd < 0) return -1;
+
+    return notify_frame(dfd, pid, &frame);
+}
+
+
+/* writes 'D' to other listeners in fifodir
+ * - to indicate to them that chatroom was "destroyed"
+ */
+int
+notify_destroy (DIR * eventdirptr)
+{
+    char destroy_info[MAX_INFO_LINE_LEN] = {0};
+    char time[MAX_TIME_STR_LEN] = {0};
+
+    get_timestr(time);
+
+    if (snprintf(destroy_info, sizeof(destroy_info), "[%s][%s] <%s> /destroy %s\n", pidstr, time, nickstr, chatdirstr) > 0) {
+        writechat_raw(destroy_info);
+        notify_fifodir(eventdirptr, "\n", 0);
+    }
+    return notify_fifodir(eventdirptr, "D", 1);
+}
+
+
+/* counts listeners in fifodir which did not acknowledge /destroy yet
+ * - listener acknowledges by removing its pipe
+ * - pipes without reader (crashed clients) can't acknowledge,
+ *   so they are not waited for
+ * - if report is set, pids of remaining listeners are printed
+ */
+static size_t
+destroy_count_pending (DIR * eventdirptr, size_t report)
+{
+    struct dirent * dentry = NULL;
+    char lmsg[MAX_CHAT_READ_BUFFER_LEN] = {0};
+    size_t pending = 0;
+    int dfd = dirfd(eventdirptr);
+
+    rewinddir(eventdirptr);
+
+    while ((dentry = readdir(eventdirptr)) != NULL) {
+        int fd = -1;
+
+        if (dentry->d_type != DT_FIFO || strcmp(dentry->d_name, notify_namestr) == 0) {
+            continue;
+        }
+
+        if ((fd = openat(dfd, dentry->d_name, O_WRONLY | O_NONBLOCK)) < 0) {
+            continue;
+        }
+        fd_close(fd);
+
+        if (report) {
+            snprintf(lmsg, sizeof(lmsg), "warning: [%s] did not acknowledge /destroy\n", dentry->d_name);
+            print_buffer(lmsg);
+        }
+        pending++;
+    }
+
+    return pending;
+}
+
+
+/* waits until all listeners in fifodir acknowledge /destroy by
+ * unregistering, or until monotonic ms deadline passes
+ * - eventdir is watched with inotify where available,
+ *   otherwise it's rescanned periodically
+ * - watch must be set up before 'D' is sent, so we don't miss
+ *   any of acknowledgements, thus it's passed in as watchfd
+ * - returns number of listeners that did not acknowledge in time
+ */
+static size_t
+destroy_await_acks (DIR * eventdirptr, int watchfd, long deadline)
+{
+    long now = 0;
+
+    while (destroy_count_pending(eventdirptr, 0) > 0 && (now = get_monotonic_ms()) < deadline) {
+        if (watchfd >= 0) {
+            struct pollfd pfd = { .fd = watchfd, .events = POLLIN };
+            char drain[4096];
+
+            if (poll(&pfd, 1, deadline - now) > 0) {
+                while (read(watchfd, drain, sizeof(drain)) > 0);
+            }
+        } else {
+            usleep(NOTIFY_RETRY_INTERVAL * 1000);
+        }
+    }
+
+    return destroy_count_pending(eventdirptr, 1);
+}
+
+
+// starts watching eventdir for unregistering listeners, if we can
+static int
+destroy_watch_eventdir (DIR * eventdirptr)
+{
+    int watchfd = -1;
+
+#ifdef __linux__
+    char watchpath[MAX_NOTIFY_NAME_LEN] = {0};
+
+    snprintf(watchpath, sizeof(watchpath), "/proc/self/fd/%d", dirfd(eventdirptr));
+
+    if ((watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0) {
+        if (inotify_add_watch(watchfd, watchpath, IN_DELETE | IN_ONLYDIR) < 0) {
+            fd_close(watchfd);
+            watchfd = -1;
+        }
+    }
+#endif
+
+    return watchfd;
+}
+
+
+// prints event notification statistics
+static void
+print_stats (void)
+{
+    char lmsg[MAX_CHAT_READ_BUFFER_LEN] = {0};
+    int pipe_size = -1, pipe_pending = -1;
+
+#ifdef F_GETPIPE_SZ
+    pipe_size = fcntl(fds.fd_event, F_GETPIPE_SZ);
+#endif
+    if (ioctl(fds.fd_event, FIONREAD, &pipe_pending) < 0) {
+        pipe_pending = -1;
+    }
+
+    snprintf(lmsg, sizeof(lmsg),
+        "chatlog via: %s\n"
+        "notify pipe: size=%d%s pending=%d\n"
+        "notify sent=%lu coalesced=%lu deferred=%lu redelivered=%lu dropped=%lu stale=%lu queued=%zu\n"
+        "rate limit: burst=%ld sustained=%ld/s suppressed sent=%lu seen=%lu\n"
+        "records: crc=%s corrupt=%lu torn=%lu\n"
+        "filters: hidden=%lu\n"
+        "scrollback: lines=%zu size=%zuK\n"
+        "lag: last=%ldK/%zu lines max=%ldK/%zu lines skipped=%lu\n",
+        fds.fd_broker < 0 ? "fifodir" : "broker",
+        pipe_size, pipe_size >= 0 && pipe_size < NOTIFY_PIPE_SIZE ? " (short, see pipe-user-pages-soft)" : "", pipe_pending,
+        notify_stats.sent, notify_stats.coalesced, notify_stats.deferred,
+        notify_stats.redelivered, notify_stats.dropped, notify_stats.stale, notify_retry_len,
+        rate_burst, rate_sustained, rate_suppressed_sent, rate_suppressed_seen,
+        record_crc ? "on" : "off", chatlog_corrupt, chatlog_torn,
+        filters.hidden,
+        scrollback.count, scrollback.size >> 10,
+        lag_stats.bytes >> 10, lag_stats.lines, lag_stats.max_bytes >> 10, lag_stats.max_lines, lag_stats.skips);
+    print_buffer(lmsg);
+}
+
+
+// records latency sample into histogram
+static void
+latency_record (latency_hist_t * hist, int64_t ns)
+{
+    size_t index = 0;
+
+    if (ns < 0) {
+        ns = 0;
+    }
+
+    if (ns < LATENCY_SUB_BUCKETS) {
+        index = ns;
+    } else {
+        int exp = 63 - __builtin_clzll(ns);
+        if (exp >= LATENCY_MAX_EXP) {
+            index = LATENCY_BUCKETS - 1;
+        } else {
+            index = (exp - 3) * LATENCY_SUB_BUCKETS + ((ns >> (exp - 4)) & (LATENCY_SUB_BUCKETS - 1));
+        }
+    }
+
+    if (hist->count == 0 || ns < hist->min) {
+        hist->min = ns;
+    }
+    if (ns > hist->max) {
+        hist->max = ns;
+    }
+    hist->bucket[index]++;
+    hist->count++;
+}
+
+
+// returns latency below which given permille of samples are
+static int64_t
+latency_percentile (latency_hist_t * hist, int permille)
+{
+    uint64_t rank = (hist->count * permille + 999) / 1000, seen = 0;
+
+    for (size_t index = 0; index < LATENCY_BUCKETS; index++) {
+        if ((seen += hist->bucket[index]) >= rank && seen > 0) {
+            int64_t low = 0, width = 1;
+            if (index >= LATENCY_SUB_BUCKETS) {
+                int exp = index / LATENCY_SUB_BUCKETS + 3;
+                width = (int64_t) 1 << (exp - 4);
+                low = (LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS) * width;
+            } else {
+                low = index;
+            }
+            // middle of bucket, but never outside of what was seen
+            low += width / 2;
+            return low < hist->min ? hist->min : low > hist->max ? hist->max : low;
+        }
+    }
+
+    return hist->max;
+}
+
+
+// builds human readable duration string
+static void
+format_duration (char * str, size_t size, int64_t ns)
+{
+    if (ns < 1000) {
+        snprintf(str, size, "%lldns", (long long) ns);
+    } else if (ns < 1000000) {
+        snprintf(str, size, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(str, size, "%.1fms", ns / 1e6);
+    } else {
+        snprintf(str, size, "%.2fs", ns / 1e9);
+    }
+}
+
+
+// prints to stdout, when readline is gone already
+static void
+print_stdout (char * buffer)
+{
+    dprintf(1, "%s", buffer);
+}
+
+
+/* prints latency histograms summary with given printer
+ * - prints nothing, if we've seen no stamped messages
+ */
+static void
+latency_print (void (*printer)(char *))
+{
+    latency_hist_t * hists[] = { &latency_wakeup, &latency_rendered };
+    const char * names[] = { "append->wakeup", "append->rendered" };
+    const int permilles[] = { 500, 900, 990, 999 };
+    char lmsg[MAX_CHAT_READ_BUFFER_LEN] = {0};
+
+    for (size_t i = 0; i < sizeof(hists) / sizeof(hists[0]); i++) {
+        char values[6][16] = {{0}};
+        latency_hist_t * hist = hists[i];
+
+        if (hist->count == 0) {
+            continue;
+        }
+
+        format_duration(values[0], sizeof(values[0]), hist->min);
+        for (size_t j = 0; j < 4; j++) {
+            format_duration(values[j + 1], sizeof(values[j + 1]), latency_percentile(hist, permilles[j]));
+        }
+        format_duration(values[5], sizeof(values[5]), hist->max);
+
+        snprintf(lmsg, sizeof(lmsg), "latency %-16s n=%llu min=%s p50=%s p90=%s p99=%s p99.9=%s max=%s\n",
+            names[i], (unsigned long long) hist->count, values[0], values[1], values[2], values[3], values[4], values[5]);
+        printer(lmsg);
+    }
+}
+
+
+// dispatches input line obtained from readline
 static void
 dispatch_input_line (char *line)
 {
-    char lmsg[MAX_CHAT_READ_BUFFER_LEN] = {0};
+    char lmsg[MAX_CHAT_READ_BUFFER_LEN] = {0};
+
+    // we care only if we're called on a real input
+    if (line) {
+        size_t len = strlen(line);
+
+        // pasted text often ends with newline, which would make it message
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+
+        // readline keeps history, let's make use of it
+#ifdef PIPECHAT_LITE
+        lineedit_remember(line);
+#else
+        add_history(line);
+#endif
+
+        /* process commands:
+         *  - quit if we are told to quit
+         *  - list participants if we are told to list them
+         *  - ... etc
+         *  - or write the message, if there's something to say
+         *  - pasted lines are always message, even if they look like command
+         */
+        if(strpbrk(line, "\r\n")) {
+            send_message(line);
+        } else if(strncmp(line, "/help", 5) == 0 || strncmp(line, "/h", 2) == 0 || strncmp(line, "/?", 2) == 0 )  {
+            print_buffer("commands:\n");
+            print_buffer("  /help, /h, /?        - print this help\n");
+            print_buffer("  /quit, /q            - quit\n");
+            print_buffer("  /list, /l            - list active connected users\n");
+            print_buffer("  /whois $pid, /w $pid - try to identify connection by $pid\n");
+            print_buffer("  /ptyof $pid, /p $pid - try to identify terminal line by $pid\n");
+            print_buffer("  /msg $pid text       - send text to $pid only\n");
+            print_buffer("  /ignore $pid|$nick   - hide lines of $pid or $nick, list ignored without it\n");
+            print_buffer("  /unignore $pid|$nick - show lines of $pid or $nick again\n");
+            print_buffer("  /only $nick          - show lines of $nick only, everybody without it\n");
+            print_buffer("  /mute-status         - hide or show join/leave status lines\n");
+            print_buffer("  /scroll [$lines]     - page scrollback up, or $lines up (down if negative)\n");
+            print_buffer("  /top, /bottom        - show oldest scrollback page, or return to newest\n");
+            print_buffer("  /gap                 - page through chat skipped after falling far behind\n");
+            print_buffer("  /stats               - show event notification statistics\n");
+            print_buffer("  /latency             - show message delivery latency\n");
+            print_buffer("  /destroy             - disconnect all users and destroy chatroom\n");
+            //print_buffer("  /save $logfile       - save copy of chatlog as file named $logfile\n");
+        } else if(strncmp(line, "/quit", 5) == 0 || strncmp(line, "/q", 2) == 0)  {
+            run = NO;
+        } else if(strncmp(line, "/latency", 8) == 0)  {
+            if (latency_wakeup.count == 0) {
+                print_buffer("no stamped messages seen yet, see latency_stamps in chatdir config\n");
+            }
+            latency_print(print_buffer);
+        } else if(strncmp(line, "/list", 7) == 0 || strncmp(line, "/l", 2) == 0)  {
+            if (presence) {
+                presence_list();
+            } else {
+                notify_list(event_fifodir);
+            }
+        } else if(strncmp(line, "/whois", 4) == 0 || strncmp(line, "/w", 2) == 0)  {
+            if ((line = strstr(line, " "))) {
+                pid_t pid = atoi(line);
+                presence_slot_t member = {0};
+                if (presence_lookup(pid, &member)) {
+                    snprintf(lmsg, MAX_CHAT_READ_BUFFER_LEN, "[%d] is <%s>\n", member.pid, member.nick);
+                    print_buffer(lmsg);
+                } else if (pid) {
+                    notify_whois(event_fifodir, pid);
+                } else {
+                    snprintf(lmsg, MAX_CHAT_READ_BUFFER_LEN, "Invalid pid!\n");
+                    print_buffer(lmsg);
+                }
+            } else {
+                snprintf(lmsg, MAX_CHAT_READ_BUFFER_LEN, "Invalid pid!\n");
+                print_buffer(lmsg);
+            }
+        } else if(strncmp(line, "/pty", 4) == 0 || strncmp(line, "/p", 2) == 0)  {
+            if ((line = strstr(line, " "))) {
+                pid_t pid = atoi(line);
+                presence_slot_t member = {0};
+                if (presence_lookup(pid, &member)) {
+                    snprintf(lmsg, MAX_CHAT_READ_BUFFER_LEN, "[%d] is <%s> on '%s'\n", member.pid, member.nick, member.tty);
+                    print_buffer(lmsg);
+                } else if (pid) {
+                    notify_pty(event_fifodir, pid);
+                } else {
+                    snprintf(lmsg, MAX_CHAT_READ_BUFFER_LEN, "Invalid pid!\n");
+                    print_buffer(lmsg);
+                }
+            } else {
+                snprintf(lmsg, MAX_CHAT_READ_BUFFER_LEN, "Invalid pid!\n");
+                print_buffer(lmsg);
+            }
+        } else if(strncmp(line, "/msg ", 5) == 0)  {
+            char * text = NULL;
+            pid_t pid = strtol(line + 5, &text, 10);
+            if (pid <= 0 || *text != ' ') {
+                print_buffer("Usage: /msg $pid text\n");
+            } else if (dm_send(pid, text + 1) < 0) {
+                snprintf(lmsg, MAX_CHAT_READ_BUFFER_LEN, "Unable to send direct message to [%d]: %s\n", pid, strerror(errno));
+                print_buffer(lmsg);
+            }
+        } else if(strncmp(line, "/ignore", 7) == 0 || strncmp(line, "/unignore", 9) == 0
+               || strncmp(line, "/only", 5) == 0 || strncmp(line, "/mute-status", 12) == 0)  {
+            filter_command(line);
+        } else if(strncmp(line, "/scroll", 7) == 0 || strncmp(line, "/top", 4) == 0 || strncmp(line, "/bottom", 7) == 0)  {
+            scrollback_command(line);
+        } else if(strncmp(line, "/gap", 4) == 0)  {
+            lag_gap_command(line);
+        } else if(strncmp(line, "/stats", 6) == 0)  {
+            print_stats();
+        } else if(strncmp(line, "/destroy", 8) == 0)  {
+            // redelivery and acknowledgements share one -t budget
+            long deadline = get_monotonic_ms() + destroy_ack_deadline;
+            int watchfd = destroy_watch_eventdir(event_fifodir);
+            notify_destroy(event_fifodir);
+            notify_retry_drain(event_fifodir, deadline - get_monotonic_ms());
+            destroy_await_acks(event_fifodir, watchfd, deadline);
+            if (watchfd >= 0) fd_close(watchfd);
+            rmr_chatdir(chatdirstr);
+        } else if(strncmp(line, "/save", 5) == 0)  {
+
+        } else if(strncmp(line, "/", 1) == 0) {
+            snprintf(lmsg, MAX_CHAT_READ_BUFFER_LEN, "Unknown command: %s\n", line + 1);
+            print_buffer(lmsg);
+        } else if(len > 0) {
+            send_message(line);
+        }
+    }
+}
+
+
+#ifdef PIPECHAT_LITE
+
+// moves cursor of line editor one character left, UTF-8 wise
+static void
+lineedit_left (void)
+{
+    while (lineedit.point > 0 && (lineedit.line[--lineedit.point] & 0xc0) == 0x80);
+}
+
+
+// moves cursor of line editor one character right, UTF-8 wise
+static void
+lineedit_right (void)
+{
+    while (lineedit.point < lineedit.len && (lineedit.line[++lineedit.point] & 0xc0) == 0x80);
+}
+
+
+// removes line editor's line from offset from up to cursor, or the other way round
+static void
+lineedit_cut (size_t from)
+{
+    size_t lo = from < lineedit.point ? from : lineedit.point;
+    size_t hi = from < lineedit.point ? lineedit.point : from;
+
+    memmove(lineedit.line + lo, lineedit.line + hi, lineedit.len - hi);
+    lineedit.len -= hi - lo;
+    lineedit.point = lo;
+}
+
+
+// replaces line editor's line with history entry lines back, 0 = empty line
+static void
+lineedit_recall (size_t back)
+{
+    lineedit.len = 0;
+    if (back > 0) {
+        char * line = lineedit.history[(lineedit.history_next + LINEEDIT_HISTORY_LEN - back) % LINEEDIT_HISTORY_LEN];
+        lineedit.len = strlen(line);
+        memcpy(lineedit.line, line, lineedit.len);
+    }
+    lineedit.point = lineedit.len;
+    lineedit.history_pos = back;
+}
+
+
+/* completes command at the end of line editor's line
+ * - single match is completed with space after it
+ * - many matches are completed up to their common prefix,
+ *   and listed when that does not get us any further
+ */
+static void
+lineedit_complete (void)
+{
+    char matches[MAX_CHAT_READ_BUFFER_LEN] = {0};
+    const char * first = NULL;
+    size_t prefix = 0, count = 0;
+    int len = 0;
+
+    if (lineedit.len == 0 || lineedit.line[0] != '/' || lineedit.point != lineedit.len || memchr(lineedit.line, ' ', lineedit.len)) {
+        return;
+    }
+
+    for (char ** name = pipechat_commands; *name; name++) {
+        if (strncmp(*name, lineedit.line, lineedit.len) != 0) {
+            continue;
+        }
+        if (count++ == 0) {
+            first = *name;
+            prefix = strlen(first);
+        }
+        while (strncmp(first, *name, prefix) != 0) {
+            prefix--;
+        }
+        if (len < sizeof(matches)) {
+            len += snprintf(matches + len, sizeof(matches) - len, "%s ", *name);
+        }
+    }
+
+    if (count == 0) {
+        return;
+    }
+    if (prefix > lineedit.len) {
+        memcpy(lineedit.line + lineedit.len, first + lineedit.len, prefix - lineedit.len);
+        lineedit.len = lineedit.point = prefix;
+        if (count == 1 && lineedit.len < MAX_INPUT_LINE_LEN) {
+            lineedit.line[lineedit.len++] = ' ';
+            lineedit.point = lineedit.len;
+        }
+    } else if (count > 1) {
+        matches[len < sizeof(matches) ? len - 1 : sizeof(matches) - 2] = '\n';
+        print_buffer(matches);
+    }
+}
+
+
+// handles ESC [ ... or ESC O ... key sequence, once its final byte comes
+static void
+lineedit_sequence (unsigned char final)
+{
+    lineedit.csi[lineedit.csi_len] = '\0';
+
+    if (final == 'A' && lineedit.history_pos < lineedit.history_len) {
+        lineedit_recall(lineedit.history_pos + 1);
+    } else if (final == 'B' && lineedit.history_pos > 0) {
+        lineedit_recall(lineedit.history_pos - 1);
+    } else if (final == 'C') {
+        lineedit_right();
+    } else if (final == 'D') {
+        lineedit_left();
+    } else if (final == 'H' || (final == '~' && (strcmp(lineedit.csi, "1") == 0 || strcmp(lineedit.csi, "7") == 0))) {
+        lineedit.point = 0;
+    } else if (final == 'F' || (final == '~' && (strcmp(lineedit.csi, "4") == 0 || strcmp(lineedit.csi, "8") == 0))) {
+        lineedit.point = lineedit.len;
+    } else if (final == '~' && strcmp(lineedit.csi, "3") == 0 && lineedit.point < lineedit.len) {
+        size_t from = lineedit.point;
+        lineedit_right();
+        lineedit_cut(from);
+    }
+}
+
+
+/* hands line editor's line over to dispatch_input_line()
+ * - it's copied out first, as commands may print and so redraw
+ */
+static void
+lineedit_enter (void)
+{
+    char line[MAX_INPUT_LINE_LEN + 1] = {0};
+
+    memcpy(line, lineedit.line, lineedit.len);
+    lineedit.len = lineedit.point = lineedit.history_pos = 0;
+    lineedit_erase();
+
+    dispatch_input_line(line);
+}
+
+
+/* feeds single byte of terminal input to built-in line editor
+ * - emacs-like keys readline users are used to are understood:
+ *   ^A ^E ^B ^F ^P ^N ^D ^K ^U ^W ^L, arrows, Home, End, Delete
+ * - anything else below space is ignored, ^C and ^Z are left to
+ *   terminal, as it stays in charge of signals
+ */
+static void
+lineedit_key (unsigned char c)
+{
+    if (lineedit.escape == 1) {
+        lineedit.escape = (c == '[' || c == 'O') ? 2 : 0;
+        lineedit.csi_len = 0;
+        return;
+    }
+    if (lineedit.escape == 2) {
+        if (c >= 0x40 && c <= 0x7e) {
+            lineedit.escape = 0;
+            lineedit_sequence(c);
+        } else if (lineedit.csi_len < sizeof(lineedit.csi) - 1) {
+            lineedit.csi[lineedit.csi_len++] = c;
+        }
+        return;
+    }
+
+    switch (c) {
+        case '\r' :
+        case '\n' : {
+            lineedit_enter();
+        } break;
+
+        case 0x7f :
+        case 0x08 : {
+            size_t from = lineedit.point;
+            lineedit_left();
+            lineedit_cut(from);
+        } break;
+
+        case 0x04 : {
+            // ^D on empty line is EOF, as with readline
+            if (lineedit.len == 0) {
+                run = NO;
+            } else if (lineedit.point < lineedit.len) {
+                size_t from = lineedit.point;
+                lineedit_right();
+                lineedit_cut(from);
+            }
+        } break;
+
+        case 0x01 : lineedit.point = 0; break;
+        case 0x05 : lineedit.point = lineedit.len; break;
+        case 0x02 : lineedit_left(); break;
+        case 0x06 : lineedit_right(); break;
+        case 0x10 : lineedit_sequence('A'); break;
+        case 0x0e : lineedit_sequence('B'); break;
+        case 0x0b : lineedit_cut(lineedit.len); break;
+        case 0x15 : lineedit_cut(0); break;
+        case '\t' : lineedit_complete(); break;
+        case 0x1b : lineedit.escape = 1; break;
+
+        case 0x17 : {
+            size_t from = lineedit.point;
+            while (lineedit.point > 0 && lineedit.line[lineedit.point - 1] == ' ') {
+                lineedit.point--;
+            }
+            while (lineedit.point > 0 && lineedit.line[lineedit.point - 1] != ' ') {
+                lineedit.point--;
+            }
+            lineedit_cut(from);
+        } break;
+
+        case 0x0c : {
+            fd_write(1, "\033[H\033[2J", 7);
+        } break;
+
+        default : {
+            if (c >= ' ' && lineedit.len < MAX_INPUT_LINE_LEN) {
+                memmove(lineedit.line + lineedit.point + 1, lineedit.line + lineedit.point, lineedit.len - lineedit.point);
+                lineedit.line[lineedit.point++] = c;
+                lineedit.len++;
+            }
+        } break;
+    }
+}
+
+
+/* hands all of the input read at once to built-in line editor
+ * - line is redrawn once, after whole batch is processed
+ * - EOF on terminal quits, as with readline
+ */
+static void
+input_process (void)
+{
+    ssize_t len = 0;
+
+    do {
+        len = read(0, input_buffer, sizeof(input_buffer));
+    } while (len < 0 && errno == EINTR);
+
+    if (len <= 0) {
+        run = NO;
+        return;
+    }
+
+    for (ssize_t i = 0; i < len && run; i++) {
+        lineedit_key(input_buffer[i]);
+    }
+
+    if (run) {
+        lineedit_redraw();
+    }
+}
+
+
+// restores terminal mode line editor found
+static void
+lineedit_stop (void)
+{
+    if (lineedit.raw) {
+        tcsetattr(0, TCSANOW, &lineedit.saved);
+        lineedit.raw = NO;
+    }
+}
+
+
+/* switches terminal to mode where line editor gets each key as it's
+ * pressed, and shows prompt
+ * - terminal keeps generating signals, so ^C and ^Z work as usual
+ * - input that is not terminal is taken as it is
+ */
+static void
+lineedit_start (void)
+{
+    struct termios raw = {0};
+
+    if (tcgetattr(0, &lineedit.saved) == 0) {
+        raw = lineedit.saved;
+        raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+
+        if (tcsetattr(0, TCSANOW, &raw) == 0) {
+            lineedit.raw = YES;
+            atexit(lineedit_stop);
+        }
+    }
+
+    lineedit_redraw();
+}
+
+#else
+
+// returns list of possible completions to readline
+char *
+rlcb_commands_generator(const char *text, int state)
+{
+    static int list_index, len;
+    char *name;
+
+    if (!state) {
+        list_index = 0;
+        len = strlen(text);
+    }
+
+    while ((name = pipechat_commands[list_index++])) {
+        if (strncmp(name, text, len) == 0) {
+            return strdup(name);
+        }
+    }
+
+    return NULL;
+}
+
+
+// handles readline completion
+char * *
+rlcb_commands_completion(const char *text, int start, int end)
+{
+    rl_attempted_completion_over = 1;
+    return rl_completion_matches(text, rlcb_commands_generator);
+}
+
+
+// handles readline input line
+static void
+rlcb_handle_line (char *line)
+{
+    /* we want to ignore when readline says it has the end of a message,
+     * as we'll only care if the user presses ENTER.
+     * if line buffer is empty, it means user sent EOF,
+     * and wants to quit.
+     */
+    if (line != NULL) {
+        rl_set_prompt(PROMPT);
+        rl_already_prompted = 1;
+    } else {
+        run = NO;
+    }
+}
+
+
+// handles readline enter keypress
+static int
+rlcb_handle_enter (int x, int y)
+{
+    char *line = NULL;
+
+    /* handle when a user presses enter.
+     *  - save the contents of the line.
+     *  - set the prompt to nothing.
+     *  - blank the line.
+     *  - pass the message to the message handler
+     *  - rl_copy_text returns malloc'd mem, so free it
+     *  - restore the prompt
+     *  - tell readline we're done mucking
+     */
+    line = rl_copy_text(0, rl_end);
+    rl_set_prompt("");
+    rl_replace_line("", 1);
+    input_hide();
+
+    dispatch_input_line(line);
+
+    free(line);
+
+    rl_set_prompt(PROMPT);
+    input_show();
+
+    rl_done = 1;
+    return 0;
+}
+
+
+/* feeds readline with terminal input
+ * - everything readable is read at once, so pasted or typed-ahead
+ *   input does not cost poll round trip per byte
+ */
+static int
+input_getc (FILE * stream)
+{
+    int len = -1;
+
+    if (input_pos == input_len) {
+        input_pos = input_len = 0;
+
+        do {
+            len = read(fileno(stream), input_buffer, sizeof(input_buffer));
+        } while (len < 0 && errno == EINTR);
+
+        if (len <= 0) {
+            return EOF;
+        }
+        input_len = len;
+    }
+
+    return (unsigned char) input_buffer[input_pos++];
+}
+
+
+#if RL_READLINE_VERSION >= 0x0603
+/* tells readline whether there's more input, i.e. to complete key sequence
+ * - readline passes how long to wait in keyboard input timeout (in us)
+ */
+static int
+input_available (void)
+{
+    struct pollfd pfd = { .fd = 0, .events = POLLIN };
+
+    return input_pos < input_len || poll(&pfd, 1, rl_set_keyboard_input_timeout(-1) / 1000) > 0;
+}
+#endif
+
+
+// stands in for readline redisplay while batch of input is processed
+static void
+input_redisplay_noop (void)
+{
+}
+
+
+/* hands all of the input read at once to readline
+ * - line is redisplayed once, after whole batch is processed, lines
+ *   entered and messages printed meanwhile only take it off the screen
+ *   once, see input_hide()
+ */
+static void
+input_process (void)
+{
+    rl_redisplay_function = input_redisplay_noop;
+    input_batch = YES;
+
+    do {
+        rl_callback_read_char();
+    } while (run && input_pos < input_len);
+
+    rl_redisplay_function = rl_redisplay;
+    input_batch = input_hidden = NO;
+    if (run) {
+        rl_redisplay();
+    }
+}
+
+#endif
+
+
+/* refills token bucket up to given time and takes one line from it
+ * - returns 1 when line fits into limit, 0 otherwise
+ * - capacity is burst plus slack lines on top of it
+ */
+static int
+rate_bucket_take (rate_bucket_t * bucket, int64_t now, long slack)
+{
+    if (rate_burst <= 0 || rate_sustained <= 0) {
+        return 1;
+    }
+
+    return pipechat_rate_take(&bucket->rate, now, rate_burst + slack, rate_sustained);
+}
+
+
+// returns ms until token bucket holds at least one line
+static long
+rate_bucket_wait (rate_bucket_t * bucket, int64_t now)
+{
+    return pipechat_rate_wait(&bucket->rate, now, rate_sustained);
+}
+
+
+/* parses "[pid][YYYY.MM.DD HH:MM:SS] <nick>" chat line prefix
+ * - returns 1 for first line of message, "<nick>: ", and 2 for its
+ *   continuation lines, "<nick>| ", and fills pid and UTC time in ms
+ * - returns 0 on anything else, like status lines or truncated prefix
+ */
+static int
+rate_parse_line (const char * p, const char * end, pid_t * pid, int64_t * time)
+{
+    if ((p = pipechat_parse_prefix(p, end, pid, time)) == NULL) {
+        return 0;
+    }
+    if (end - p < 2 || p[0] != ' ' || p[1] != '<') {
+        return 0;
+    }
+    for (p += 2; p < end && *p != '>'; p++);
+    if (end - p < 2 || (p[1] != ':' && p[1] != '|')) {
+        return 0;
+    }
+
+    return p[1] == ':' ? 1 : 2;
+}
+
+
+/* decides whether chat line seen in chatlog stays within its sender's limit
+ * - listeners cross-check senders, so scripts ignoring the limit
+ *   don't flood everybody's screen anyway
+ * - record times have second resolution, so listeners allow one
+ *   extra second worth of lines
+ * - when member calms down, number of lines we hid is handed over
+ *   in reported, so it can be told locally
+ */
+static int
+rate_check_line (pid_t pid, int64_t time, unsigned long * reported)
+{
+    rate_bucket_t * bucket = &rate_tracked[0];
+
+    for (size_t i = 0; i < MAX_RATE_TRACKED; i++) {
+        if (rate_tracked[i].pid == pid) {
+            bucket = &rate_tracked[i];
+            break;
+        } else if (rate_tracked[i].rate.last < bucket->rate.last) {
+            bucket = &rate_tracked[i];
+        }
+    }
+
+    // least recently seen member is forgotten
+    if (bucket->pid != pid) {
+        bucket->pid = pid;
+        bucket->rate.tokens = (rate_burst + rate_sustained) * 1000;
+        bucket->rate.last = time;
+        bucket->suppressed = 0;
+    }
+
+    if (! rate_bucket_take(bucket, time, rate_sustained)) {
+        bucket->suppressed++;
+        rate_suppressed_seen++;
+        return 0;
+    }
+
+    *reported = bucket->suppressed;
+    bucket->suppressed = 0;
+
+    return 1;
+}
+
+
+/* allocates scrollback arena of scrollback_mb and its offset table
+ * - offset table follows arena in the same allocation
+ */
+static void
+scrollback_init (void)
+{
+    size_t size = (size_t) scrollback_mb << 20;
+    size_t lines_size = size / SCROLLBACK_AVG_LINE_LEN;
+
+    if (scrollback_mb <= 0) {
+        return;
+    }
+
+    if ((scrollback.arena = malloc(size + lines_size * sizeof(scrollback_line_t))) == NULL) {
+        dprintf(2, "warning: Unable to allocate %ld MB of scrollback: %s\n", scrollback_mb, strerror(errno));
+        return;
+    }
+    scrollback.size = size;
+    scrollback.lines = (scrollback_line_t *) (scrollback.arena + size);
+    scrollback.lines_size = lines_size;
+}
+
+
+// drops oldest line from scrollback
+static void
+scrollback_evict (void)
+{
+    scrollback.first = (scrollback.first + 1) % scrollback.lines_size;
+    scrollback.count--;
+    if (scrollback.view > scrollback.count) {
+        scrollback.view = scrollback.count;
+    }
+}
+
+
+/* stores pending line into scrollback arena at head
+ * - line never wraps around the end of arena, it starts at its
+ *   beginning instead, so it can be printed as it is
+ * - oldest lines in the way are evicted, and so are those at the
+ *   end of arena, when we wrap around, as they are older still
+ */
+static void
+scrollback_commit (void)
+{
+    size_t len = scrollback.pending_len;
+    scrollback_line_t * line = NULL;
+
+    if (scrollback.head + len > scrollback.size) {
+        while (scrollback.count > 0 && scrollback.lines[scrollback.first].offset >= scrollback.head) {
+            scrollback_evict();
+        }
+        scrollback.head = 0;
+    }
+    while (scrollback.count > 0 && (scrollback.count == scrollback.lines_size
+           || scrollback.lines[scrollback.first].offset - scrollback.head < len)) {
+        scrollback_evict();
+    }
+
+    memcpy(scrollback.arena + scrollback.head, scrollback.pending, len);
+    line = &scrollback.lines[(scrollback.first + scrollback.count) % scrollback.lines_size];
+    line->offset = scrollback.head;
+    line->len = len;
+    scrollback.count++;
+    scrollback.head += len;
+    scrollback.pending_len = 0;
+
+    // page being looked at stays put
+    if (scrollback.view > 0) {
+        scrollback.view++;
+    }
+}
+
+
+/* keeps rendered chatlog data in scrollback
+ * - data does not need to end with newline, rest of line may come
+ *   with next call
+ */
+static void
+scrollback_append (const char * data, size_t len)
+{
+    if (scrollback.arena == NULL) {
+        return;
+    }
+
+    while (len > 0) {
+        const char * eol = memchr(data, '\n', len);
+        size_t part = eol ? eol + 1 - data : len;
+        size_t room = sizeof(scrollback.pending) - scrollback.pending_len;
+
+        memcpy(scrollback.pending + scrollback.pending_len, data, part < room ? part : room);
+        scrollback.pending_len += part < room ? part : room;
+
+        if (eol) {
+            // line cut short still ends with newline
+            scrollback.pending[scrollback.pending_len - 1] = '\n';
+            scrollback_commit();
+        }
+        data += part;
+        len -= part;
+    }
+}
+
+
+/* prints page of scrollback with given number of lines below it
+ * - lines are copied straight from arena, chatlog is not read again
+ */
+static void
+scrollback_show (size_t back, size_t page)
+{
+    static char out[MAX_CHATLOG_PRINT_LEN + 1];
+    size_t start = 0, len = 0;
+
+    if (back + page > scrollback.count) {
+        back = scrollback.count > page ? scrollback.count - page : 0;
+    }
+    page = page < scrollback.count - back ? page : scrollback.count - back;
+    start = scrollback.count - back - page;
+    scrollback.view = back;
+
+    len = snprintf(out, sizeof(out), "*** scrollback %zu-%zu of %zu%s ***\n",
+        page ? start + 1 : 0, start + page, scrollback.count, back ? ", /bottom to return" : "");
+
+    for (size_t i = start; i < start + page; i++) {
+        scrollback_line_t * line = &scrollback.lines[(scrollback.first + i) % scrollback.lines_size];
+
+        if (len + line->len >= sizeof(out)) {
+            break;
+        }
+        memcpy(out + len, scrollback.arena + line->offset, line->len);
+        len += line->len;
+    }
+    out[len] = '\0';
+
+    print_buffer(out);
+}
+
+
+/* handles /scroll, /top and /bottom commands
+ * - /scroll pages one screen up, /scroll N goes N lines up,
+ *   or down when N is negative
+ */
+static void
+scrollback_command (char * line)
+{
+    size_t page = terminal_rows() > 3 ? terminal_rows() - 2 : 1;
+    char * arg = strchr(line, ' ');
+    long lines = arg ? atol(arg) : 0;
+
+    if (scrollback.arena == NULL) {
+        print_buffer("Scrollback is off, see --scrollback\n");
+        return;
+    }
+
+    if (strncmp(line, "/top", 4) == 0) {
+        scrollback_show(scrollback.count, page);
+    } else if (strncmp(line, "/bottom", 7) == 0) {
+        scrollback_show(0, page);
+    } else if (lines < 0) {
+        scrollback_show(scrollback.view > (size_t) -lines ? scrollback.view + lines : 0, page);
+    } else {
+        scrollback_show(scrollback.view + (lines > 0 ? lines : page), page);
+    }
+}
+
+
+// prints chatlog data in [from, to) of writable buffer
+static void
+print_chatlog_span (char * from, char * to)
+{
+    char saved = *to;
+
+    if (from < to) {
+        *to = '\0';
+        print_buffer(from);
+        *to = saved;
+        scrollback_append(from, to - from);
+    }
+}
+
+
+/* parses hidden fields of chatlog line in [field, eol), each one
+ * following CHATLOG_FIELD_SEP, and returns line_state of the line
+ * starting at line
+ * - "T<ns>" is sender's monotonic time at append, stored in stamp
+ * - "C<crc32c>" is checksum of the line up to this field
+ * - "X" marks torn record sealed by join recovery
+ * - unknown fields are skipped
+ */
+static int
+chatlog_parse_fields (const char * line, const char * field, const char * eol, int64_t * stamp)
+{
+    int state = LINE_PLAIN;
+
+    *stamp = 0;
+    while (field < eol) {
+        const char * next = memchr(field + 1, CHATLOG_FIELD_SEP, eol - field - 1);
+
+        if (next == NULL) {
+            next = eol;
+        }
+        if (field[1] == 'T') {
+            for (const char * p = field + 2; p < next && *p >= '0' && *p <= '9'; p++) {
+                *stamp = *stamp * 10 + (*p - '0');
+            }
+        } else if (field[1] == 'C' && state == LINE_PLAIN) {
+            char hex[9] = {0};
+            char * hex_end = NULL;
+            uint32_t crc = 0;
+
+            memcpy(hex, field + 2, next - field - 2 < 8 ? next - field - 2 : 8);
+            crc = strtoul(hex, &hex_end, 16);
+            state = (hex_end == hex + 8 && crc == pipechat_crc32c(line, field - line)) ? LINE_SEALED : LINE_CORRUPT;
+        } else if (field[1] == 'X') {
+            return LINE_TORN;
+        }
+        field = next;
+    }
+
+    return state;
+}
+
+
+/* looks for intact record glued to the end of torn one in line [line, eol),
+ * returning its start, or NULL if there is none
+ * - writer died mid-append leaves line without newline behind, so next
+ *   record is appended to it and the checksum covers only that record
+ * - only last [pid][time] prefix is checked, so line is checksummed once
+ */
+static char *
+chatlog_resync (char * line, char * eol)
+{
+    char * field = eol;
+    char hex[9] = {0};
+    uint32_t crc = 0;
+    int64_t time = 0;
+    pid_t pid = 0;
+
+    // checksum is always the last field
+    while (--field > line && ! (field[0] == CHATLOG_FIELD_SEP && field[1] == 'C'));
+    if (field == line || eol - field != CRC_FIELD_LEN) {
+        return NULL;
+    }
+    memcpy(hex, field + 2, 8);
+    crc = strtoul(hex, NULL, 16);
+
+    for (char * start = field; --start > line; ) {
+        if (start[0] == '[' && pipechat_parse_prefix(start, field, &pid, &time)) {
+            return pipechat_crc32c(start, field - start) == crc ? start : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* prints chatlog data, leaving out lines of members over rate limit
+ * - data may end in the middle of line, so whether line is shown
+ *   is remembered till next call
+ * - continuation lines of multi-line message share fate of its first line
+ * - hidden fields of lines are left out, send time stamps among them
+ *   are turned into latencies
+ * - whatever is shown in one go is printed as single block
+ * - byte after len bytes of buffer must be writable, as it is
+ *   used for terminating NUL temporarily
+ */
+static void
+print_chatlog (char * buffer, size_t len)
+{
+    static BOOL line_start = YES, line_hidden = NO;
+    static pid_t line_pid = 0;
+    char * shown = buffer, * p = buffer, * end = buffer + len;
+    int64_t pending[MAX_LATENCY_PENDING];
+    size_t pending_len = 0;
+
+    while (p < end) {
+        char * eol = memchr(p, '\n', end - p);
+        char * next = eol ? eol + 1 : end;
+        char * field = NULL;
+
+        if (line_start) {
+            pid_t pid = 0;
+            int64_t time = 0;
+            unsigned long reported = 0;
+
+            switch (rate_parse_line(p, end, &pid, &time)) {
+                case 1 :
+                    line_hidden = ! rate_check_line(pid, time, &reported);
+                    break;
+                case 2 :
+                    line_hidden = line_hidden && pid == line_pid;
+                    break;
+                default :
+                    line_hidden = NO;
+            }
+            line_pid = pid;
+
+            // print lines before this one first
+            if (line_hidden || reported > 0) {
+                print_chatlog_span(shown, p);
+                shown = p;
+            }
+
+            if (reported > 0) {
+                char lmsg[MAX_INFO_LINE_LEN] = {0};
+                snprintf(lmsg, sizeof(lmsg), "*** %lu lines from [%d] suppressed, over rate limit ***\n", reported, pid);
+                print_buffer(lmsg);
+            }
+        }
+
+        // hidden fields are not shown, but newline is
+        if (eol && (field = memchr(p, CHATLOG_FIELD_SEP, eol - p))) {
+            int64_t stamp = 0, time = 0;
+            int state = chatlog_parse_fields(p, field, eol, &stamp);
+            unsigned long reported = 0;
+            char * start = NULL;
+
+            // intact record glued to torn one loses just the torn part
+            if (state == LINE_CORRUPT && (start = chatlog_resync(p, eol))) {
+                field = memchr(start, CHATLOG_FIELD_SEP, eol - start);
+                state = chatlog_parse_fields(start, field, eol, &stamp);
+                line_hidden = NO;
+                if (rate_parse_line(start, end, &line_pid, &time) == 1) {
+                    line_hidden = ! rate_check_line(line_pid, time, &reported);
+                }
+            }
+
+            if (state < LINE_PLAIN || start) {
+                print_chatlog_span(shown, p);
+                if (state == LINE_CORRUPT) {
+                    chatlog_corrupt++;
+                    print_buffer("*** corrupt record skipped ***\n");
+                } else {
+                    chatlog_torn++;
+                    print_buffer("*** torn record skipped ***\n");
+                }
+                shown = start ? start : next;
+            }
+
+            if (state < LINE_PLAIN) {
+                line_hidden = YES;
+            } else if (stamp > 0 && ! line_hidden) {
+                latency_record(&latency_wakeup, latency_wakeup_ns - stamp);
+                if (pending_len < MAX_LATENCY_PENDING) {
+                    pending[pending_len++] = stamp;
+                }
+            }
+            if (! line_hidden) {
+                print_chatlog_span(shown, field);
+            }
+            shown = eol;
+        }
+
+        if (line_hidden) {
+            shown = next;
+        }
+
+        line_start = eol ? YES : NO;
+        p = next;
+    }
+
+    print_chatlog_span(shown, end);
+
+    if (pending_len > 0) {
+        int64_t now = get_monotonic_ns();
+        for (size_t i = 0; i < pending_len; i++) {
+            latency_record(&latency_rendered, now - pending[i]);
+        }
+    }
+}
+
+
+/* returns how much of chatlog data read into buffer of given size
+ * can be printed
+ * - line being written is left for later, as it would be wiped out
+ *   by prompt redisplay, unless it doesn't fit into buffer at all
+ */
+static size_t
+chatlog_printable (char * buffer, size_t len, size_t size)
+{
+    char * eol = memrchr(buffer, '\n', len);
+
+    if (eol) {
+        return eol + 1 - buffer;
+    }
+
+    return len < size ? 0 : len;
+}
+
+
+/* decides whether chatlog line [line, eol) is filtered out
+ * - looks only at "[pid][time]" prefix and "<nick>" right after it,
+ *   or after "***" of status lines
+ */
+static int
+filter_hides (const char * line, const char * eol)
+{
+    const char * p = line, * nick = NULL, * nick_end = NULL;
+    pid_t pid = 0;
+    size_t nick_len = 0;
+
+    if (p >= eol || *p++ != '[') {
+        return NO;
+    }
+    for (; p < eol && *p >= '0' && *p <= '9'; p++) {
+        pid = pid * 10 + (*p - '0');
+    }
+    if (p >= eol || *p++ != ']') {
+        return NO;
+    }
+    if (p < eol && *p == '[' && (p = memchr(p, ']', eol - p)) != NULL) {
+        p++;
+    }
+    if (p == NULL) {
+        return NO;
+    }
+
+    if (eol - p >= 4 && memcmp(p, " ***", 4) == 0 && filters.mute_status) {
+        return YES;
+    }
+    for (size_t i = 0; i < filters.pids_len; i++) {
+        if (filters.pids[i] == pid) {
+            return YES;
+        }
+    }
+
+    if ((nick = memchr(p, '<', eol - p < 8 ? eol - p : 8)) == NULL || (nick_end = memchr(nick, '>', eol - nick)) == NULL) {
+        return NO;
+    }
+    nick++;
+    nick_len = nick_end - nick;
+
+    for (size_t i = 0; i < filters.nicks_len; i++) {
+        if (strlen(filters.nicks[i]) == nick_len && memcmp(filters.nicks[i], nick, nick_len) == 0) {
+            return YES;
+        }
+    }
+    if (filters.only[0] && (strlen(filters.only) != nick_len || memcmp(filters.only, nick, nick_len) != 0)) {
+        return YES;
+    }
+
+    return NO;
+}
+
+
+/* drops lines filtered out by /ignore, /only and /mute-status from
+ * chatlog data in buffer, returning its new length
+ * - newlines are found with memchr(), which libc vectorises already,
+ *   then only prefixes of lines are looked at, so filtered out
+ *   traffic is never parsed further nor printed
+ * - prefix check looks at few bytes per line, so it's plain scalar code,
+ *   scanning for line ends is what costs
+ * - incomplete line at the end is kept as it is
+ */
+static size_t
+filter_chatlog (char * buffer, size_t len)
+{
+    size_t start = 0, kept = 0;
+    char * eol = NULL;
+
+    if (filters.pids_len == 0 && filters.nicks_len == 0 && ! filters.only[0] && ! filters.mute_status) {
+        return len;
+    }
+
+    while (start < len && (eol = memchr(buffer + start, '\n', len - start)) != NULL) {
+        size_t next = eol + 1 - buffer;
+
+        if (filter_hides(buffer + start, eol)) {
+            filters.hidden++;
+        } else {
+            if (kept != start) {
+                memmove(buffer + kept, buffer + start, next - start);
+            }
+            kept += next - start;
+        }
+        start = next;
+    }
+
+    if (kept != start) {
+        memmove(buffer + kept, buffer + start, len - start);
+    }
+
+    return kept + len - start;
+}
+
+
+/* handles /ignore, /unignore, /only and /mute-status commands
+ * - /ignore without argument lists what is ignored
+ * - argument made of digits is pid, anything else is nick
+ */
+static void
+filter_command (char * line)
+{
+    char lmsg[MAX_CHAT_READ_BUFFER_LEN] = {0};
+    char * arg = strchr(line, ' ');
+    int unignore = strncmp(line, "/unignore", 9) == 0;
+    pid_t pid = 0;
+
+    while (arg && *arg == ' ') {
+        arg++;
+    }
+    if (arg && *arg && strspn(arg, "0123456789") == strlen(arg)) {
+        pid = atoi(arg);
+    }
+
+    if (strncmp(line, "/mute-status", 12) == 0) {
+        filters.mute_status = ! filters.mute_status;
+        snprintf(lmsg, sizeof(lmsg), "status lines %s\n", filters.mute_status ? "muted" : "shown");
+    } else if (strncmp(line, "/only", 5) == 0) {
+        snprintf(filters.only, sizeof(filters.only), "%s", arg ? arg : "");
+        snprintf(lmsg, sizeof(lmsg), filters.only[0] ? "showing only <%s>\n" : "showing everybody%s\n", filters.only);
+    } else if (arg == NULL || *arg == '\0') {
+        int len = snprintf(lmsg, sizeof(lmsg), "ignored:");
+        for (size_t i = 0; i < filters.pids_len; i++) {
+            len += snprintf(lmsg + len, sizeof(lmsg) - len, " [%d]", filters.pids[i]);
+        }
+        for (size_t i = 0; i < filters.nicks_len; i++) {
+            len += snprintf(lmsg + len, sizeof(lmsg) - len, " <%s>", filters.nicks[i]);
+        }
+        snprintf(lmsg + len, sizeof(lmsg) - len, "%s\n", filters.pids_len + filters.nicks_len ? "" : " nobody");
+    } else if (unignore) {
+        for (size_t i = 0; i < filters.pids_len; i++) {
+            if (pid && filters.pids[i] == pid) {
+                filters.pids[i--] = filters.pids[--filters.pids_len];
+            }
+        }
+        for (size_t i = 0; i < filters.nicks_len; i++) {
+            if (! pid && strcmp(filters.nicks[i], arg) == 0) {
+                memcpy(filters.nicks[i--], filters.nicks[--filters.nicks_len], sizeof(filters.nicks[0]));
+            }
+        }
+        snprintf(lmsg, sizeof(lmsg), "no longer ignoring %s\n", arg);
+    } else if (pid ? filters.pids_len == MAX_FILTERS : filters.nicks_len == MAX_FILTERS) {
+        snprintf(lmsg, sizeof(lmsg), "Can't ignore more than %d %s\n", MAX_FILTERS, pid ? "pids" : "nicks");
+    } else {
+        if (pid) {
+            filters.pids[filters.pids_len++] = pid;
+        } else {
+            snprintf(filters.nicks[filters.nicks_len++], sizeof(filters.nicks[0]), "%s", arg);
+        }
+        snprintf(lmsg, sizeof(lmsg), "ignoring %s\n", arg);
+    }
+
+    print_buffer(lmsg);
+}
+
+
+/* returns offset of first chatlog record starting in window read at pos,
+ * or -1 when there is none, and fills its time
+ * - line at pos counts only when it follows newline or punched range
+ */
+static long
+chatlog_record_at (long pos, int64_t * time)
+{
+    char buffer[MAX_CHAT_READ_BUFFER_LEN];
+    long from = pos > 0 ? pos - 1 : 0;
+    ssize_t read = fd_pread(fds.fd_chatlog, buffer, sizeof(buffer), from);
+    pid_t pid = 0;
+
+    for (char * p = buffer + (pos - from), * end = buffer + (read > 0 ? read : 0); p < end; ) {
+        char * eol = memchr(p, '\n', end - p);
+
+        if ((p == buffer || p[-1] == '\n' || p[-1] == '\0') && pipechat_parse_prefix(p, end, &pid, time)) {
+            return from + (p - buffer);
+        }
+        if (eol == NULL) {
+            break;
+        }
+        p = eol + 1;
+    }
+
+    return -1;
+}
+
+
+/* returns chatlog read position moved past range punched out by
+ * --retain of some member, to first retained record
+ * - hole reads as zeros, so callers seeing '\0' at pos ask, others
+ *   where chatlog data is not read into userspace ask each time
+ */
+static long
+chatlog_skip_punched (long pos)
+{
+    off_t data = lseek(fds.fd_chatlog, pos, SEEK_DATA);
+    int64_t time = 0;
+    long record = -1;
+
+    if (data <= pos) {
+        return pos;
+    }
+
+    return (record = chatlog_record_at(data, &time)) < 0 ? data : record;
+}
+
+
+/* frees chatlog range beyond --retain policy, at most once per RETAIN_INTERVAL
+ * - range is punched out with fallocate(), so file size and offsets
+ *   of retained records stay the same for everybody reading chatlog
+ * - only whole filesystem blocks before the first retained record go,
+ *   for age based policy that one is binary searched for by record time
+ */
+static void
+retain_apply (void)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    int64_t now = get_monotonic_ns();
+    struct stat st;
+    long data = -1, cut = 0;
+
+    if ((retain_bytes == 0 && retain_ms == 0) || (retain_last_ns > 0 && now - retain_last_ns < RETAIN_INTERVAL * 1000000LL)) {
+        return;
+    }
+    retain_last_ns = now;
+
+    if (fstat(fds.fd_chatlog, &st) < 0 || (data = lseek(fds.fd_chatlog, 0, SEEK_DATA)) < 0) {
+        return;
+    }
+
+    if (retain_bytes > 0) {
+        cut = st.st_size - retain_bytes;
+    } else {
+        int64_t oldest = (int64_t) time(NULL) * 1000 - retain_ms;
+        long lo = data, hi = st.st_size;
+
+        while (hi - lo > MAX_CHAT_READ_BUFFER_LEN) {
+            long mid = lo + (hi - lo) / 2;
+            int64_t time = 0;
+
+            if (chatlog_record_at(mid, &time) >= 0 && time < oldest) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        cut = lo;
+    }
+    cut -= cut % st.st_blksize;
+
+    if (cut > data && fallocate(fds.fd_chatlog, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, data, cut - data) < 0) {
+        dprintf(2, "warning: Unable to apply retention to chatlog '%s/log', turning it off: %s\n", chatdirstr, strerror(errno));
+        retain_bytes = retain_ms = 0;
+    }
+#endif
+}
+
+
+/* parses --retain policy, either age like 24h (s, m, h and d units)
+ * or size like 512M (K, M and G units, bytes without one)
+ * - values that don't fit into ms or bytes are rejected
+ */
+static int
+retain_parse (const char * spec)
+{
+    char * unit = NULL;
+    long long value = 0, scale = 0;
+
+    errno = 0;
+    value = strtoll(spec, &unit, 10);
+    if (errno || value <= 0 || unit == spec || (unit[0] && unit[1])) {
+        return -1;
+    }
+
+    switch (*unit) {
+        case 's' : scale = 1000; break;
+        case 'm' : scale = 60 * 1000; break;
+        case 'h' : scale = 3600 * 1000; break;
+        case 'd' : scale = 86400 * 1000; break;
+        case 'K' : scale = 1LL << 10; break;
+        case 'M' : scale = 1LL << 20; break;
+        case 'G' : scale = 1LL << 30; break;
+        case '\0' : scale = 1; break;
+        default : return -1;
+    }
+
+    if (value > LLONG_MAX / scale) {
+        return -1;
+    }
+
+    if (*unit == 's' || *unit == 'm' || *unit == 'h' || *unit == 'd') {
+        retain_ms = value * scale;
+    } else {
+        retain_bytes = value * scale;
+    }
+
+    return 0;
+}
+
+
+/* finds "O<ns>.<seq>" order field among hidden fields of line [line, eol)
+ * - returns NO when line has none, i.e. it's continuation line
+ */
+static BOOL
+split_parse_order (const char * line, const char * eol, int64_t * time, uint64_t * seq)
+{
+    for (const char * field = memchr(line, CHATLOG_FIELD_SEP, eol - line); field; field = memchr(field + 1, CHATLOG_FIELD_SEP, eol - field - 1)) {
+        if (eol - field > 2 && field[1] == 'O') {
+            char * dot = NULL;
+
+            *time = strtoll(field + 2, &dot, 10);
+            *seq = *dot == '.' ? strtoull(dot + 1, NULL, 10) : 0;
+            return YES;
+        }
+    }
+
+    return NO;
+}
+
+
+// makes room for one more per-member chatlog in split_writers and split_heap
+static BOOL
+split_grow (void)
+{
+    size_t cap = split_writers_cap ? split_writers_cap * 2 : SPLIT_WRITERS_INITIAL_LEN;
+    split_writer_t * writers = NULL;
+    size_t * heap = NULL;
+
+    if (split_writers_len < split_writers_cap) {
+        return YES;
+    }
+    if ((writers = realloc(split_writers, cap * sizeof(split_writer_t))) == NULL) {
+        return NO;
+    }
+    split_writers = writers;
+    if ((heap = realloc(split_heap, cap * sizeof(size_t))) == NULL) {
+        return NO;
+    }
+    split_heap = heap;
+    split_writers_cap = cap;
+
+    return YES;
+}
+
+
+/* looks for per-member chatlogs in 'log.d' we don't merge yet
+ * - from_end starts them at their current end, as on join, otherwise
+ *   they are new and whole of them is merged
+ * - finished_only takes just those nobody holds lock on, for --compact,
+ *   and keeps them locked
+ */
+static void
+split_scan (BOOL from_end, BOOL finished_only)
+{
+    static BOOL warned = NO;
+    struct stat st;
+    struct dirent * entry = NULL;
+    DIR * dir = NULL;
+
+    if (fstat(fds.fd_split, &st) < 0 || (dir = dir_opendirat(fds.fd_split, ".")) == NULL) {
+        return;
+    }
+    split_dir_mtime = st.st_mtim;
+    split_dir_scanned = time(NULL);
+
+    while ((entry = readdir(dir))) {
+        split_writer_t * writer = NULL;
+        BOOL known = NO;
+        char * end = NULL;
+        pid_t pid = strtol(entry->d_name, &end, 10);
+        int fd = -1;
+
+        if (pid <= 0 || *end != '\0' || fstatat(fds.fd_split, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 || ! S_ISREG(st.st_mode)) {
+            continue;
+        }
+        for (size_t i = 0; i < split_writers_len && ! known; i++) {
+            known = split_writers[i].ino == st.st_ino;
+        }
+        if (known) {
+            continue;
+        }
+        if (! split_grow()) {
+            if (! warned) {
+                dprintf(2, "warning: Unable to track more per-member chatlogs in '%s/%s', rest is not read: %s\n", chatdirstr, SPLIT_DIR_NAME, strerror(errno));
+                warned = YES;
+            }
+            break;
+        }
+
+        if ((fd = openat(fds.fd_split, entry->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+            if (fd >= 0) {
+                fd_close(fd);
+            }
+            continue;
+        }
+        if (finished_only && flock(fd, LOCK_EX | LOCK_NB) < 0) {
+            fd_close(fd);
+            continue;
+        }
+
+        writer = &split_writers[split_writers_len];
+        *writer = (split_writer_t) { .pid = pid, .ino = st.st_ino, .fd = fd };
+        writer->pos = writer->end = from_end ? st.st_size : 0;
+        split_writers_len++;
+    }
+
+    closedir(dir);
+}
+
+
+/* maps whatever per-member chatlog grew by and finds end of its complete
+ * records in it
+ * - returns NO when its member is done with it and --compact folded it
+ *   away, after we merged all of it, 'log' itself is never done with
+ */
+static BOOL
+split_map (split_writer_t * writer)
+{
+    struct stat st;
+    char * eol = NULL;
+
+    if (fstat(writer->fd, &st) < 0) {
+        return NO;
+    }
+
+    if ((size_t) st.st_size > writer->mapped) {
+        if (writer->map) {
+            munmap(writer->map, writer->mapped);
+        }
+        if ((writer->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, writer->fd, 0)) == MAP_FAILED) {
+            writer->map = NULL;
+            writer->mapped = 0;
+            writer->end = writer->pos;
+            return YES;
+        }
+        writer->mapped = st.st_size;
+        if (writer->pos < writer->mapped && (eol = memrchr(writer->map + writer->pos, '\n', writer->mapped - writer->pos))) {
+            writer->end = eol + 1 - writer->map;
+        }
+    }
+
+    return writer->pid == 0 || st.st_nlink > 0 || writer->pos < (size_t) st.st_size;
+}
+
+
+/* sets order of per-member chatlog record at pos and finds where it ends
+ * - record is its first line, with order field, and continuation lines
+ *   of multi-line message after it
+ * - line without order field at pos, i.e. rest of record we merged
+ *   before it was complete, keeps order of preceding record
+ * - record of 'log' is single line ordered by its prefix time, which has
+ *   only second resolution, so it goes before records of per-member
+ *   chatlogs sent within the same second
+ */
+static size_t
+split_head (split_writer_t * writer)
+{
+    const char * p = writer->map + writer->pos, * end = writer->map + writer->end;
+    const char * eol = memchr(p, '\n', end - p);
+    int64_t time = 0;
+    uint64_t seq = 0;
+
+    if (writer->pid == 0) {
+        pid_t pid = 0;
+
+        if (pipechat_parse_prefix(p, eol, &pid, &time)) {
+            writer->time = time * 1000000 - split_clock_offset;
+        }
+        return eol + 1 - writer->map;
+    }
+
+    if (split_parse_order(p, eol, &time, &seq)) {
+        writer->time = time;
+        writer->seq = seq;
+    }
+    for (p = eol + 1; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        if (split_parse_order(p, eol, &time, &seq)) {
+            break;
+        }
+    }
+
+    return p - writer->map;
+}
+
+
+// returns whether head record of writer a goes before that of writer b
+static BOOL
+split_before (const split_writer_t * a, const split_writer_t * b)
+{
+    if (a->time != b->time) {
+        return a->time < b->time;
+    }
+    if (a->pid != b->pid) {
+        return a->pid < b->pid;
+    }
+    return a->seq < b->seq;
+}
+
+
+// moves heap entry at i down to its place
+static void
+split_sift_down (size_t * heap, size_t len, size_t i)
+{
+    for (;;) {
+        size_t least = i, left = 2 * i + 1, right = 2 * i + 2, swap = 0;
+
+        if (left < len && split_before(&split_writers[heap[left]], &split_writers[heap[least]])) {
+            least = left;
+        }
+        if (right < len && split_before(&split_writers[heap[right]], &split_writers[heap[least]])) {
+            least = right;
+        }
+        if (least == i) {
+            return;
+        }
+        swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+
+/* merges complete records of all per-member chatlogs, in order their
+ * members sent them, passing each to emit
+ * - k-way merge with binary heap of chatlogs keyed by their head record,
+ *   so each record costs O(log k), k being number of chatlogs with
+ *   something new
+ * - returns number of records merged
+ */
+static size_t
+split_merge (void (* emit) (const char * data, size_t len))
+{
+    size_t * heap = split_heap;
+    size_t len = 0, records = 0;
+
+    for (size_t i = 0; i < split_writers_len; i++) {
+        if (split_writers[i].pos < split_writers[i].end) {
+            split_writers[i].next = split_head(&split_writers[i]);
+            heap[len++] = i;
+        }
+    }
+    for (size_t i = len / 2; i-- > 0; ) {
+        split_sift_down(heap, len, i);
+    }
+
+    while (len > 0) {
+        split_writer_t * writer = &split_writers[heap[0]];
+
+        emit(writer->map + writer->pos, writer->next - writer->pos);
+        records++;
+        writer->pos = writer->next;
+
+        if (writer->pos < writer->end) {
+            writer->next = split_head(writer);
+        } else {
+            heap[0] = heap[--len];
+        }
+        split_sift_down(heap, len, 0);
+    }
+
+    return records;
+}
+
+
+// closes per-member chatlog at i, the last one takes its place
+static void
+split_drop (size_t i)
+{
+    if (split_writers[i].map) {
+        munmap(split_writers[i].map, split_writers[i].mapped);
+    }
+    fd_close(split_writers[i].fd);
+    split_writers[i] = split_writers[--split_writers_len];
+}
+
+
+/* collects merged records into print buffer, printing it when full
+ * - emit of split_merge() for chat client, NULL data prints what's left
+ */
+static void
+split_print (const char * data, size_t len)
+{
+    static char buffer[MAX_CHATLOG_PRINT_LEN];
+    static size_t used = 0;
+
+    if (data == NULL) {
+        if (used > 0) {
+            print_chatlog(buffer, filter_chatlog(buffer, used));
+        }
+        used = 0;
+        return;
+    }
+
+    while (len > 0) {
+        size_t part = len < sizeof(buffer) - 1 - used ? len : sizeof(buffer) - 1 - used;
+
+        memcpy(buffer + used, data, part);
+        used += part;
+        data += part;
+        len -= part;
+
+        if (used == sizeof(buffer) - 1) {
+            print_chatlog(buffer, filter_chatlog(buffer, used));
+            used = 0;
+        }
+    }
+}
+
+
+/* collects merged records into write buffer, writing it into split_out_fd
+ * when full
+ * - emit of split_merge() for --compact, --follow and --archive, NULL
+ *   data writes what's left
+ */
+static void
+split_write (const char * data, size_t len)
+{
+    static char buffer[ARCHIVE_BATCH_LEN];
+    static size_t used = 0;
+
+    if (data == NULL || used + len > sizeof(buffer)) {
+        if (used > 0 && fd_write(split_out_fd, buffer, used) != (int) used) {
+            split_out_failed = 1;
+        }
+        used = 0;
+    }
+    if (data == NULL) {
+        return;
+    }
+
+    if (len > sizeof(buffer)) {
+        if (fd_write(split_out_fd, (void *) data, len) != (int) len) {
+            split_out_failed = 1;
+        }
+        return;
+    }
+    memcpy(buffer + used, data, len);
+    used += len;
+}
+
+
+/* adds 'log' as one more chatlog to merge, from where we read it so far
+ * - members without split_log on, libpipechat and older clients append
+ *   there, so whatever they send is merged too
+ * - it has pid 0, as it's nobody's in particular
+ */
+static void
+split_add_chatlog (void)
+{
+    struct stat st;
+
+    if (! split_grow() || fstat(fds.fd_chatlog, &st) < 0) {
+        return;
+    }
+
+    split_writers[split_writers_len++] = (split_writer_t) {
+        .pid = 0, .ino = st.st_ino, .fd = fds.fd_chatlog,
+        .pos = last_chatlog_read_pos, .end = last_chatlog_read_pos
+    };
+}
+
+
+/* notices 'log.d' created after we joined, by member joining with split_log on
+ * - from then on we merge 'log' with per-member chatlogs, whole of them,
+ *   as they are all newer than us
+ * - chatdir is looked into only when it changed
+ */
+static void
+split_discover (void)
+{
+    struct stat st;
+
+    if (fstat(fds.fd_chatdir, &st) < 0
+     || (st.st_mtim.tv_sec == chatdir_mtime.tv_sec && st.st_mtim.tv_nsec == chatdir_mtime.tv_nsec && st.st_mtime < chatdir_scanned)) {
+        return;
+    }
+    chatdir_mtime = st.st_mtim;
+    chatdir_scanned = time(NULL);
+
+    if ((fds.fd_split = dfd_openat(fds.fd_chatdir, SPLIT_DIR_NAME)) < 0) {
+        return;
+    }
+
+    split_add_chatlog();
+    split_scan(NO, NO);
+}
+
+
+/* maps what's new in 'log' and chatlogs in 'log.d' of all members,
+ * returning how many bytes of complete records there are to merge
+ * - 'log.d' is listed again only when it changed, so wakeups of room
+ *   where nobody joined cost fstat() per member chatlog
+ * - we follow 'log' past ranges punched out by --retain
+ */
+static size_t
+split_refresh (void)
+{
+    struct timespec real = {0};
+    struct stat st;
+    size_t pending = 0;
+
+    if (fstat(fds.fd_split, &st) == 0
+     && (st.st_mtim.tv_sec != split_dir_mtime.tv_sec || st.st_mtim.tv_nsec != split_dir_mtime.tv_nsec || st.st_mtime >= split_dir_scanned)) {
+        split_scan(NO, NO);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &real);
+    split_clock_offset = (int64_t) real.tv_sec * 1000000000 + real.tv_nsec - get_monotonic_ns();
+
+    for (size_t i = 0; i < split_writers_len; i++) {
+        split_writer_t * writer = &split_writers[i];
+
+        if (! split_map(writer)) {
+            split_drop(i--);
+            continue;
+        }
+        if (writer->pid == 0 && writer->pos < writer->end && writer->map[writer->pos] == '\0') {
+            writer->pos = chatlog_skip_punched(writer->pos);
+        }
+        if (writer->pos < writer->end) {
+            pending += writer->end - writer->pos;
+        }
+    }
+
+    return pending;
+}
+
+
+/* merges new records of all members, from 'log' and their chatlogs
+ * in 'log.d', passing each to emit, see split_refresh()
+ * - 'log' offset we got to is kept as ever, in last_chatlog_read_pos
+ */
+static size_t
+split_collect (void (* emit) (const char * data, size_t len))
+{
+    size_t records = split_merge(emit);
+
+    for (size_t i = 0; i < split_writers_len; i++) {
+        if (split_writers[i].pid == 0) {
+            last_chatlog_read_pos = split_writers[i].pos;
+        }
+    }
+
+    return records;
+}
+
+
+// reads new records of all members, see split_collect()
+static void
+split_process (void)
+{
+    split_refresh();
+    split_collect(split_print);
+    split_print(NULL, 0);
+}
+
+
+/* finds end of last complete record in chatlog range [from, to)
+ * - scans backwards, so only the tail of the range is ever read
+ * - returns from, when there's no complete record in range
+ */
+static long
+chatlog_find_record_end (long from, long to)
+{
+    char buffer[MAX_CHAT_READ_BUFFER_LEN];
+
+    while (to > from) {
+        long chunk = (to - from) < (long) sizeof(buffer) ? (to - from) : (long) sizeof(buffer);
+
+        if (fd_pread(fds.fd_chatlog, buffer, chunk, to - chunk) != chunk) {
+            break;
+        }
+        for (long i = chunk - 1; i >= 0; i--) {
+            if (buffer[i] == '\n') {
+                return to - chunk + i + 1;
+            }
+        }
+        to -= chunk;
+    }
+
+    return from;
+}
+
+
+/* returns offset of last page of rows lines in chatlog range [from, end),
+ * which must end with newline
+ * - when lines are too long to find rows of them, fewer are taken
+ */
+static long
+lag_tail_start (long from, long end, size_t rows)
+{
+    static char buffer[MAX_CHATLOG_PRINT_LEN];
+    long start = end - from < (long) sizeof(buffer) ? from : end - (long) sizeof(buffer);
+    ssize_t read = fd_pread(fds.fd_chatlog, buffer, end - start, start);
+    char * eol = NULL;
+    size_t lines = 0;
+
+    if (read != end - start) {
+        return from;
+    }
+
+    for (ssize_t i = read - 1; i > 0; i--) {
+        if (buffer[i - 1] == '\n' && ++lines == rows) {
+            return start + i;
+        }
+    }
+    if (start == from || (eol = memchr(buffer, '\n', read)) == NULL) {
+        return from;
+    }
+
+    return start + (eol + 1 - buffer);
+}
+
+
+/* counts lines, messages, their senders and time span of chatlog range
+ * [from, to) into lag_gap
+ * - only record prefixes are parsed, nothing is rendered, so even
+ *   hundreds of MB take a moment
+ */
+static void
+lag_gap_scan (long from, long to)
+{
+    static char buffer[MAX_CHATLOG_PRINT_LEN];
+    pid_t senders[2 * MAX_LAG_SENDERS] = {0};
+    pid_t last_pid = 0;
+
+    lag_gap = (lag_gap_t) { .start = from, .end = to, .cursor = from };
+
+    while (from < to) {
+        long chunk = to - from < (long) sizeof(buffer) ? to - from : (long) sizeof(buffer);
+        ssize_t read = fd_pread(fds.fd_chatlog, buffer, chunk, from);
+        size_t printable = read > 0 ? chatlog_printable(buffer, read, chunk) : 0;
+
+        if (printable == 0) {
+            break;
+        }
+
+        for (char * p = buffer, * end = buffer + printable; p < end; ) {
+            char * eol = memchr(p, '\n', end - p);
+            const char * q = NULL, * gt = NULL;
+            pid_t pid = 0;
+            int64_t time = 0;
+
+            eol = eol ? eol : end;
+            lag_gap.lines++;
+
+            if ((q = pipechat_parse_prefix(p, eol, &pid, &time)) != NULL) {
+                lag_gap.first = lag_gap.first ? lag_gap.first : time;
+                lag_gap.last = time;
+
+                if (eol - q > 2 && q[0] == ' ' && q[1] == '<' && (gt = memchr(q, '>', eol - q)) && gt + 1 < eol && gt[1] == ':') {
+                    lag_gap.messages++;
+
+                    // senders are kept in small open addressing set
+                    for (size_t slot = ((uint32_t) pid * 2654435761U) % (2 * MAX_LAG_SENDERS);
+                         pid != last_pid && lag_gap.senders < MAX_LAG_SENDERS;
+                         slot = (slot + 1) % (2 * MAX_LAG_SENDERS)) {
+                        if (senders[slot] == pid) {
+                            break;
+                        } else if (senders[slot] == 0) {
+                            senders[slot] = pid;
+                            lag_gap.senders++;
+                            break;
+                        }
+                    }
+                    last_pid = pid;
+                }
+            }
+            p = eol + 1;
+        }
+        from += printable;
+    }
+}
+
+
+/* checks how far behind chatlog we are on wakeup
+ * - past lag_skip_bytes, backlog is not rendered, only its summary
+ *   and last screen of it are, rest can be paged by /gap
+ * - so reader coming back from suspend or frozen connection is
+ *   usable at once, instead of rendering everything it missed
+ */
+static void
+lag_check (void)
+{
+    char lmsg[MAX_INFO_LINE_LEN * 2] = {0};
+    char first[MAX_TIME_STR_LEN] = {0}, last[MAX_TIME_STR_LEN] = {0};
+    size_t rows = terminal_rows() > 5 ? terminal_rows() - 4 : 1;
+    struct stat st;
+    long end = 0, tail = 0;
+
+    if (fstat(fds.fd_chatlog, &st) < 0) {
+        return;
+    }
+    lag_stats.bytes = st.st_size - last_chatlog_read_pos;
+    if (lag_stats.bytes > lag_stats.max_bytes) {
+        lag_stats.max_bytes = lag_stats.bytes;
+    }
+
+    if (lag_skip_bytes <= 0 || lag_stats.bytes <= lag_skip_bytes) {
+        return;
+    }
+
+    last_chatlog_read_pos = chatlog_skip_punched(last_chatlog_read_pos);
+    end = chatlog_find_record_end(last_chatlog_read_pos, st.st_size);
+    if ((tail = lag_tail_start(last_chatlog_read_pos, end, rows)) <= last_chatlog_read_pos) {
+        return;
+    }
+
+    lag_gap_scan(last_chatlog_read_pos, tail);
+    lag_stats.skips++;
+    last_chatlog_read_pos = tail;
+
+    format_timestr(first, lag_gap.first / 1000);
+    format_timestr(last, lag_gap.last / 1000);
+    snprintf(lmsg, sizeof(lmsg), "*** fell %ldK behind, skipped %zu messages (%zu lines) from %zu%s senders, %s - %s, /gap pages through them ***\n",
+        (lag_gap.end - lag_gap.start) >> 10, lag_gap.messages, lag_gap.lines,
+        lag_gap.senders, lag_gap.senders == MAX_LAG_SENDERS ? "+" : "", first, last);
+    print_buffer(lmsg);
+}
+
+
+/* handles /gap command, which shows next page of chatlog range skipped
+ * by lag_check(), starting over after its end
+ * - page is rendered like any chatlog data, but it goes to screen only,
+ *   not to scrollback
+ */
+static void
+lag_gap_command (char * line)
+{
+    static char buffer[MAX_CHATLOG_PRINT_LEN];
+    static char out[MAX_CHATLOG_PRINT_LEN + MAX_INFO_LINE_LEN];
+    size_t page = terminal_rows() > 3 ? terminal_rows() - 2 : 1;
+    long chunk = lag_gap.end - lag_gap.cursor < (long) sizeof(buffer) - 1 ? lag_gap.end - lag_gap.cursor : (long) sizeof(buffer) - 1;
+    size_t len = 0, lines = 0, shown = 0, out_len = 0;
+    ssize_t read = -1;
+
+    (void) line;
+
+    if (lag_gap.end == 0) {
+        print_buffer("Nothing was skipped\n");
+        return;
+    }
+    if (lag_gap.cursor >= lag_gap.end) {
+        print_buffer("*** end of skipped chat, /gap starts over ***\n");
+        lag_gap.cursor = lag_gap.start;
+        lag_gap.cursor_line = 0;
+        return;
+    }
+
+    if ((read = fd_pread(fds.fd_chatlog, buffer, chunk, lag_gap.cursor)) <= 0) {
+        print_buffer("Skipped chat is not in chatlog anymore\n");
+        lag_gap.end = 0;
+        return;
+    }
+
+    // whole lines of page only
+    for (char * eol = buffer; lines < page && (eol = memchr(eol, '\n', read - (eol - buffer))); eol++) {
+        len = eol + 1 - buffer;
+        lines++;
+    }
+    if (lines == 0) {
+        len = read;
+        lines = 1;
+    }
+    lag_gap.cursor += len;
+
+    out_len = snprintf(out, sizeof(out), "*** skipped lines %zu-%zu of %zu ***\n",
+        lag_gap.cursor_line + 1, lag_gap.cursor_line + lines, lag_gap.lines);
+    lag_gap.cursor_line += lines;
+
+    // hidden fields are left out, as when rendered live
+    shown = filter_chatlog(buffer, len);
+    for (char * p = buffer, * end = buffer + shown; p < end; ) {
+        char * eol = memchr(p, '\n', end - p);
+        char * field = NULL;
+
+        eol = eol ? eol : end;
+        field = memchr(p, CHATLOG_FIELD_SEP, eol - p);
+        memcpy(out + out_len, p, (field ? field : eol) - p);
+        out_len += (field ? field : eol) - p;
+        out[out_len++] = '\n';
+        p = eol + 1;
+    }
+    out[out_len] = '\0';
+
+    print_buffer(out);
+}
+
+
+/* reads all of the messages from the chatlog since the last read
+ * and prints them
+ * - notifications are level-triggered, so we always read up to
+ *   the end of the chatlog, no matter how many of them we got
+ */
+static void
+process_messages (void)
+{
+    static char buffer[MAX_CHATLOG_PRINT_LEN];
+    ssize_t read = -1;
+    size_t printable = 0;
+    long skipped = 0;
+
+    // room where somebody appends to 'log.d' is read by merging
+    if (fds.fd_split < 0) {
+        split_discover();
+    }
+    if (fds.fd_split >= 0) {
+        split_process();
+        return;
+    }
+
+    lag_check();
+    lag_stats.lines = 0;
+
+    for (;;) {
+        read = fd_pread(fds.fd_chatlog, buffer, sizeof(buffer) - 1, last_chatlog_read_pos);
+
+        // if we failed to read from chatlog something went really wrong
+        if (read == -1) {
+            if (errno != EPIPE) {
+                run = NO;
+                dprintf(2, "chatlog read failed with errno %d: %s\n", errno, strerror(errno));
+            }
+            break;
+        }
+
+        // we fell behind into range punched out by --retain
+        if (read > 0 && buffer[0] == '\0' && (skipped = chatlog_skip_punched(last_chatlog_read_pos)) > last_chatlog_read_pos) {
+            last_chatlog_read_pos = skipped;
+            continue;
+        }
+
+        if ((printable = chatlog_printable(buffer, read, sizeof(buffer) - 1)) == 0) {
+            break;
+        }
+
+        for (char * p = buffer; (p = memchr(p, '\n', buffer + printable - p)); p++) {
+            lag_stats.lines++;
+        }
+        print_chatlog(buffer, filter_chatlog(buffer, printable));
+
+        // update the last read position
+        last_chatlog_read_pos += printable;
+    }
+
+    if (lag_stats.lines > lag_stats.max_lines) {
+        lag_stats.max_lines = lag_stats.lines;
+    }
+}
+
+
+/* connects to chatdir's broker, if there's any
+ * - broker first tells us offset in chatlog its stream starts at,
+ *   that's where we start reading too
+ */
+static int
+broker_connect (void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct pollfd pfd = { .events = POLLIN };
+    int64_t offset = -1;
+    int fd = -1;
+
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", chatdirstr, BROKER_SOCKET_NAME) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+
+    pfd.fd = fd;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+     || poll(&pfd, 1, BROKER_CONNECT_DEADLINE) != 1
+     || fd_read(fd, (char *) &offset, sizeof(offset)) != sizeof(offset)
+     || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+        fd_close(fd);
+        return -1;
+    }
+
+    fds.fd_broker = fd;
+    last_chatlog_read_pos = offset;
+
+    return 0;
+}
+
+
+/* switches from broker back to our own fifodir notifications
+ * - our control-only pipe is renamed to regular one, so we get
+ *   notified about new messages again, then we catch up with
+ *   chatlog from where broker left us
+ */
+static void
+broker_fallback (void)
+{
+    int dfd = dirfd(event_fifodir);
+
+    fd_close(fds.fd_broker);
+    fds.fd_broker = -1;
+
+    if (renameat(dfd, notify_namestr, dfd, pidstr) < 0) {
+        dprintf(2, "warning: Unable to switch from broker to notify event listener '%s' at '%s/event': %s\n", pidstr, chatdirstr, strerror(errno));
+    } else {
+        snprintf(notify_namestr, sizeof(notify_namestr), "%s", pidstr);
+    }
+
+    process_messages();
+}
+
+
+/* prints chatlog data pushed to us by broker
+ * - incomplete line is kept till rest of it arrives
+ * - when broker goes away, we fall back to fifodir notifications,
+ *   kept data is read again from chatlog then
+ */
+static void
+broker_process (void)
+{
+    static char buffer[MAX_CHATLOG_PRINT_LEN];
+    static size_t kept = 0;
+    ssize_t read = -1;
+    size_t printable = 0;
+
+    for (;;) {
+        read = fd_read(fds.fd_broker, buffer + kept, sizeof(buffer) - 1 - kept);
+
+        if (read > 0) {
+            kept += read;
+            if ((printable = chatlog_printable(buffer, kept, sizeof(buffer) - 1)) > 0) {
+                print_chatlog(buffer, filter_chatlog(buffer, printable));
+                last_chatlog_read_pos += printable;
+                kept -= printable;
+                memmove(buffer, buffer + printable, kept);
+            }
+        } else if (read < 0 && errno == EAGAIN) {
+            return;
+        } else {
+            kept = 0;
+            broker_fallback();
+            return;
+        }
+    }
+}
+
+
+/* takes control frame, of which avail bytes at data were read already
+ * from our pipe, and handles it
+ * - frame was written at once, so rest of it is in our pipe already
+ * - queries are answered to asker only, answers to our latest query
+ *   are shown, stale ones are not
+ * - returns number of bytes at data it took
+ */
+static size_t
+control_process (const char * data, size_t avail)
+{
+    char raw[PIPECHAT_FRAME_LEN];
+    pipechat_frame_t frame = {0}, ident = { .type = PIPECHAT_FRAME_IDENT, .pid = getpid() };
+    size_t have = avail < sizeof(raw) ? avail : sizeof(raw);
+    char lmsg[MAX_INFO_LINE_LEN] = {0};
+
+    memcpy(raw, data, have);
+    if (have < sizeof(raw) && fd_read(fds.fd_event, raw + have, sizeof(raw) - have) != (int) (sizeof(raw) - have)) {
+        return have;
+    }
+    if (pipechat_frame_decode(raw, &frame) < 0) {
+        return have;
+    }
+
+    ident.request = frame.request;
+
+    switch (frame.type) {
+        case PIPECHAT_FRAME_LIST :
+        case PIPECHAT_FRAME_WHOIS : {
+            ident.len = snprintf(ident.payload, sizeof(ident.payload), "<%s>", nickstr);
+            notify_frame(dirfd(event_fifodir), frame.pid, &ident);
+        } break;
+
+        case PIPECHAT_FRAME_PTY : {
+            ident.len = snprintf(ident.payload, sizeof(ident.payload), "<%s> on fds[ 0='%s', 1='%s' ]", nickstr, ttyname(0), ttyname(1));
+            notify_frame(dirfd(event_fifodir), frame.pid, &ident);
+        } break;
+
+        case PIPECHAT_FRAME_IDENT : {
+            if (frame.request == control_request) {
+                snprintf(lmsg, sizeof(lmsg), "[%d] is %s\n", frame.pid, frame.payload);
+                print_buffer(lmsg);
+            }
+        } break;
+    }
+
+    return have;
+}
+
+
+// handles specific event pipe notifcation events
+static check_result
+process_event (char * event)
+{
+    if (event[0] == '\n') {
+        return CHECK_MESSAGE;
+    } else if (event[0] == 'L' || event[0] == 'w') {
+        // queries of members which don't know control frames yet are answered in chatlog
+        int ret = -1;
+        char list_ident[MAX_INFO_LINE_LEN] = {0};
+        if ((ret = snprintf(list_ident, sizeof(list_ident), "[%s] is <%s>\n", pidstr, nickstr)) > 0 && ret <= sizeof(list_ident)) {
+            writechat_raw(list_ident);
+            notify_new_message(event_fifodir);
+        }
+    } else if (event[0] == 'p') {
+        int ret = -1;
+        char pty_ident[MAX_INFO_LINE_LEN] = {0};
+        if ((ret = snprintf(pty_ident, sizeof(pty_ident), "[%s] is <%s> on fds[ 0='%s', 1='%s' ]\n", pidstr, nickstr, ttyname(0), ttyname(1))) > 0 && ret <= sizeof(pty_ident)) {
+            writechat_raw(pty_ident);
+            notify_new_message(event_fifodir);
+        }
+    } else if (event[0] == 'm') {
+        dm_process();
+    } else if (event[0] == 'D') {
+        char time[MAX_TIME_STR_LEN] = {0};
+        get_timestr(time);
+        prompt_clear();
+        dprintf(1, "[%s] *** chatroom '%s' destroyed...\n", time, chatdirstr);
+        // acknowledge destruction to destroyer right away by unregistering
+        notify_unregister_pipe();
+        presence_unregister();
+        run = NO;
+        log_leaving_message = NO;
+    }
+    return CHECK_NOTHING;
+}
+
+
+/* writes single record about lines we suppressed into chatlog
+ * - instead of line per suppressed line, so listeners are woken up
+ *   once, together with next message or when limit allows it again
+ */
+static void
+rate_report_suppressed (void)
+{
+    char time[MAX_TIME_STR_LEN] = {0};
+    char info[MAX_INFO_LINE_LEN] = {0};
+
+    if (rate_self.suppressed == 0) {
+        return;
+    }
+
+    get_timestr(time);
+    snprintf(info, sizeof(info), "[%s][%s] *** <%s> %lu lines suppressed ***\n", pidstr, time, nickstr, rate_self.suppressed);
+    writechat_raw(info);
+    rate_self.suppressed = 0;
+}
+
+
+/* returns "[pid][time] <nick>" prefix of our records
+ * - pid and nick parts are formatted once, time part once per second
+ * - lite build keeps it in static buffer, nick that does not fit is refused
+ */
+static const record_prefix_t *
+record_prefix_get (void)
+{
+    time_t now = time(NULL);
+
+    if (record_prefix.len == 0 || record_prefix.nick != nickstr) {
+        int len = snprintf(NULL, 0, "[%s][%s] <%s>", pidstr, cached_timestr(now), nickstr);
+        char * text = NULL;
+#ifdef PIPECHAT_LITE
+        static char text_buf[MAX_INPUT_LINE_LEN];
+
+        if (len < 0 || len >= sizeof(text_buf)) {
+            errno = ENAMETOOLONG;
+            return NULL;
+        }
+        text = text_buf;
+#else
+
+        if (len < 0 || (text = realloc(record_prefix.text, len + 1)) == NULL) {
+            return NULL;
+        }
+#endif
+        snprintf(text, len + 1, "[%s][%s] <%s>", pidstr, cached_timestr(now), nickstr);
+        record_prefix.text = text;
+        record_prefix.len = len;
+        record_prefix.time_at = strlen(pidstr) + 3;
+        record_prefix.time = now;
+        record_prefix.nick = nickstr;
+    }
+    if (now != record_prefix.time) {
+        memcpy(record_prefix.text + record_prefix.time_at, cached_timestr(now), MAX_TIME_STR_LEN - 1);
+        record_prefix.time = now;
+    }
+
+    return &record_prefix;
+}
+
+
+/* appends record gathered in iov to the chatlog
+ * - with single writev() on O_APPEND fd, so it lands in one piece
+ *   however long it is
+ * - records of more than IOV_MAX pieces are joined into one buffer
+ *   and written with single write() instead, lite build never gets
+ *   them, see send_message()
+ */
+static ssize_t
+chatlog_appendv (struct iovec * iov, int count)
+{
+    ssize_t res = -1;
+    size_t size = 0;
+    char * record = NULL;
+
+    if (count <= IOV_MAX) {
+        do {
+            res = writev(fds.fd_append, iov, count);
+        } while ((res == -1) && errno == EINTR);
+        return res;
+    }
+
+#ifdef PIPECHAT_LITE
+    errno = E2BIG;
+    return -1;
+#endif
+
+    for (int i = 0; i < count; i++) {
+        size += iov[i].iov_len;
+    }
+    if ((record = malloc(size)) == NULL) {
+        return -1;
+    }
+    size = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(record + size, iov[i].iov_base, iov[i].iov_len);
+        size += iov[i].iov_len;
+    }
+
+    res = fd_write(fds.fd_append, record, size);
+    free(record);
+
+    return res;
+}
+
+
+/* this is a "message" emitter, i.e. it "sends" a chat message from one user to another.
+ *  - it first writes into chatlog file
+ *  - then it notifies other users registered through event fifodir
+ *    by writing newline into their "notify" pipes
+ *  - multi-line message (i.e. bracketed paste) is written as one record
+ *    with single writev(), its continuation lines are marked with "<nick>| ",
+ *    so it can't interleave with others and costs one fsync and broadcast
+ *  - record is gathered from cached prefix and message text in place,
+ *    nothing is formatted or copied per line but send time, order and checksum
+ */
+static void
+send_message (const char *message)
+{
+    struct iovec iov_local[MAX_RECORD_STACK_LINES * RECORD_LINE_IOV];
+    char ends_local[MAX_RECORD_STACK_LINES][CRC_FIELD_LEN + 2];
+    struct iovec * iov = iov_local;
+    char (* ends)[CRC_FIELD_LEN + 2] = ends_local;
+    char latency[MAX_LATENCY_FIELD_LEN] = {0};
+    char order[MAX_ORDER_FIELD_LEN] = {0};
+    const record_prefix_t * prefix = NULL;
+    size_t lines = 1, line_no = 0;
+    ssize_t res = -1;
+    int count = 0;
+
+    // lines over our limit are only counted, see rate_report_suppressed()
+    if (! rate_bucket_take(&rate_self, get_monotonic_ms(), 0)) {
+        if (rate_self.suppressed++ == 0) {
+            char lmsg[MAX_INFO_LINE_LEN] = {0};
+            snprintf(lmsg, sizeof(lmsg), "*** over rate limit of %ld lines per second, lines are suppressed ***\n", rate_sustained);
+            print_buffer(lmsg);
+        }
+        rate_suppressed_sent++;
+        return;
+    }
+
+    rate_report_suppressed();
+
+    if ((prefix = record_prefix_get()) == NULL) {
+        dprintf(2, "Unable to send message: %s\n", strerror(errno));
+        return;
+    }
+
+    // every line gets its own prefix
+    for (const char * p = message; *p; p++) {
+        lines += (*p == '\n' || (*p == '\r' && p[1] != '\n'));
+    }
+#ifdef PIPECHAT_LITE
+    // lite build gathers record on stack only, its line editor sends single lines anyway
+    if (lines > MAX_RECORD_STACK_LINES) {
+        dprintf(2, "Unable to send message: %s\n", strerror(E2BIG));
+        return;
+    }
+#else
+    if (lines > MAX_RECORD_STACK_LINES) {
+        iov = malloc(lines * RECORD_LINE_IOV * sizeof(*iov));
+        ends = malloc(lines * sizeof(*ends));
+        if (iov == NULL || ends == NULL) {
+            dprintf(2, "Unable to send message: %s\n", strerror(errno));
+            free(iov);
+            free(ends);
+            return;
+        }
+    }
+#endif
+
+    for (const char * line = message; line; line_no++) {
+        size_t line_len = strcspn(line, "\r\n");
+        int first = count;
+
+        iov[count++] = (struct iovec) { prefix->text, prefix->len };
+        iov[count++] = (struct iovec) { line == message ? ": " : "| ", 2 };
+        iov[count++] = (struct iovec) { (void *) line, line_len };
+
+        // send time goes to hidden field of first line
+        if (line == message && latency_stamps) {
+            int len = snprintf(latency, sizeof(latency), "%cT%lld", CHATLOG_FIELD_SEP, (long long) get_monotonic_ns());
+            iov[count++] = (struct iovec) { latency, len };
+        }
+        if (line == message && split_log) {
+            iov[count++] = (struct iovec) { order, split_order_field(order, sizeof(order)) };
+        }
+
+        // checksum covers the line up to its field, as pipechat_seal() does
+        if (record_crc) {
+            uint32_t crc = 0;
+            for (int i = first; i < count; i++) {
+                crc = pipechat_crc32c_extend(crc, iov[i].iov_base, iov[i].iov_len);
+            }
+            snprintf(ends[line_no], sizeof(ends[line_no]), "%cC%08x\n", CHATLOG_FIELD_SEP, crc);
+            iov[count++] = (struct iovec) { ends[line_no], CRC_FIELD_LEN + 1 };
+        } else {
+            iov[count++] = (struct iovec) { "\n", 1 };
+        }
+
+        line += line_len;
+        if (*line == '\0') {
+            break;
+        }
+        line += (line[0] == '\r' && line[1] == '\n') ? 2 : 1;
+    }
+
+    res = chatlog_appendv(iov, count);
+    if (res < 0) {
+        dprintf(2, "warning: Unable to send message into chatlog: %s\n", strerror(errno));
+    }
+#ifndef PIPECHAT_LITE
+    if (iov != iov_local) {
+        free(iov);
+        free(ends);
+    }
+#endif
+    // nothing new in chatlog for others to be woken up for
+    if (res < 0) {
+        return;
+    }
+    fsync(fds.fd_append);
+    presence_touch();
+    notify_new_message(event_fifodir);
+}
+
+
+/* sends direct message to member with given pid
+ * - it's appended to recipient's inbox and only recipient is woken up,
+ *   so the rest of the room pays nothing for it
+ * - inbox must be what dm_open_inbox() created, owned by recipient's uid
+ *   as presence table has it, so nobody else's file gets our message
+ */
+static int
+dm_send (pid_t pid, const char * text)
+{
+    char time[MAX_TIME_STR_LEN] = {0};
+    char name[MAX_NOTIFY_NAME_LEN] = {0};
+    char * record = NULL;
+    presence_slot_t member = {0};
+    struct stat sb = {0};
+    int fd = -1, len = -1, res = -1;
+
+    get_timestr(time);
+    snprintf(name, sizeof(name), "%s/%d", DM_DIR_NAME, pid);
+
+    if (! presence_lookup(pid, &member)) {
+        errno = ESRCH;
+        return -1;
+    }
+
+    if ((fd = openat(fds.fd_chatdir, name, O_WRONLY | O_APPEND | O_NOFOLLOW | O_NONBLOCK)) < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &sb) < 0 || ! S_ISREG(sb.st_mode) || (sb.st_mode & 07777) != (S_IRUSR|S_IWUSR|S_IWGRP) || sb.st_uid != member.uid) {
+        fd_close(fd);
+        errno = EPERM;
+        return -1;
+    }
+
+    len = snprintf(NULL, 0, "[%s][%s] <%s> -> [%d]: %s\n", pidstr, time, nickstr, pid, text);
+#ifdef PIPECHAT_LITE
+    // lite build formats it in static buffer, text comes from its line editor
+    static char record_buf[MAX_INFO_LINE_LEN + MAX_INPUT_LINE_LEN];
+
+    if (len < 0 || len >= sizeof(record_buf)) {
+        fd_close(fd);
+        errno = E2BIG;
+        return -1;
+    }
+    record = record_buf;
+#else
+    if ((record = malloc(len + 1)) == NULL) {
+        fd_close(fd);
+        return -1;
+    }
+#endif
+    snprintf(record, len + 1, "[%s][%s] <%s> -> [%d]: %s\n", pidstr, time, nickstr, pid, text);
+
+    if ((res = fd_write(fd, record, len)) == len) {
+        notify_spitpid(dirfd(event_fifodir), pid, 'm');
+        print_buffer(record);
+    }
+
+#ifndef PIPECHAT_LITE
+    free(record);
+#endif
+    fd_close(fd);
+
+    return res == len ? 0 : -1;
+}
+
+
+// prints direct messages appended to our inbox since the last read
+static void
+dm_process (void)
+{
+    static char buffer[MAX_CHATLOG_PRINT_LEN];
+    ssize_t read = -1;
+    size_t printable = 0;
+
+    while (fds.fd_inbox >= 0 && (read = fd_pread(fds.fd_inbox, buffer, sizeof(buffer) - 1, last_inbox_read_pos)) > 0) {
+        if ((printable = chatlog_printable(buffer, read, sizeof(buffer) - 1)) == 0) {
+            return;
+        }
+
+        buffer[printable] = '\0';
+        print_buffer(buffer);
+        scrollback_append(buffer, printable);
+        last_inbox_read_pos += printable;
+    }
+}
+
+
+/* tiny eventloop "core" based on (p)poll(), it either:
+ * - handles signals
+ * - notification events
+ * - messages
+ * - or nothing
+ */
+static check_result
+check_events ()
+{
+    struct pollfd pfd[4] = {0};
+    char event[MAX_EVENT_READ_LEN] = {0};
+    struct timespec retry_interval = { 0, NOTIFY_RETRY_INTERVAL * 1000000L };
+    struct timespec rate_interval = {0};
+    struct timespec status_interval = {0};
+    struct timespec * timeout = NULL;
+    long wait = -1;
+    int changed = 0;
+
+    pfd[0].fd = fds.fd_selfpipe; // selfpipe
+    pfd[0].events = POLLIN;
+    pfd[1].fd = fds.fd_event;    // event notifications
+    pfd[1].events = POLLIN;
+    pfd[2].fd = 0;               // user input
+    pfd[2].events = POLLIN;
+    pfd[3].fd = fds.fd_broker;   // chatlog data from broker, ignored when -1
+    pfd[3].events = POLLIN;
+
+    // undelivered control events need us to wake up periodically
+    if (notify_retry_len > 0) {
+        timeout = &retry_interval;
+    }
+
+    // so do lines we suppressed, which are reported once limit allows it
+    if (rate_self.suppressed > 0) {
+        wait = rate_bucket_wait(&rate_self, get_monotonic_ms());
+        if (timeout == NULL || wait < NOTIFY_RETRY_INTERVAL) {
+            rate_interval.tv_sec = wait / 1000;
+            rate_interval.tv_nsec = (wait % 1000) * 1000000L;
+            timeout = &rate_interval;
+        }
+    }
+
+    // and joins and leaves counted in presence table, once window is over
+    if ((wait = presence_status_wait()) >= 0
+     && (timeout == NULL || wait < timeout->tv_sec * 1000 + timeout->tv_nsec / 1000000)) {
+        status_interval.tv_sec = wait / 1000;
+        status_interval.tv_nsec = (wait % 1000) * 1000000L;
+        timeout = &status_interval;
+    }
+
+    do {
+        changed = ppoll(pfd, 4, timeout, NULL);
+        latency_wakeup_ns = get_monotonic_ns();
+
+        if (changed < 0 && errno != EINTR) {
+            return CHECK_ERROR;
+        } else if (changed == 0) {
+            return CHECK_TIMEOUT;
+        } else {
+            if ((pfd[0].revents & POLLIN) == POLLIN) {
+
+                return CHECK_SIGNAL;
+
+            } else if ((pfd[1].revents & POLLIN) == POLLIN) {
+
+                /* drain everything pending in our pipe at once
+                 * - control events are handled in order
+                 * - any number of '\n's collapse into single chatlog read
+                 * - chatlog is read on any wakeup, as '\n' is not sent
+                 *   to listener with anything pending, see notify_spitat()
+                 */
+                int len = fd_read(pfd[1].fd, event, sizeof(event));
+
+                for (int i = 0; i < len && run; i++) {
+                    if (event[i] == PIPECHAT_FRAME_START) {
+                        i += control_process(&event[i], len - i) - 1;
+                    } else {
+                        process_event(&event[i]);
+                    }
+                }
+                // broker clients get chatlog through broker only
+                return len > 0 && fds.fd_broker < 0 ? CHECK_MESSAGE : CHECK_NOTHING;
+
+            } else if (pfd[3].revents) {
+
+                return CHECK_BROKER;
+
+            } else if ((pfd[2].revents & POLLIN) == POLLIN) {
+
+                return CHECK_INPUT;
+            }
+        }
+    } while ((changed == -1) && errno == EINTR);
+
+    return CHECK_ERROR;
+}
+
+
+static void
+check_signal(void)
+{
+    // TODO: implement selfpipe signal handling
+}
+
+
+// caches PID string, PID of process should never change so it's okay to "cache" it
+static void
+init_pidstr (void)
+{
+    int ret = -1;
+
+    if ((ret = snprintf(pidstr, sizeof(pidstr_buf), "%d", getpid())) < 0 || ret > sizeof(pidstr_buf)) {
+        dprintf(2, "Can't convert pid to string %d %d %ld\n", ret, getpid(), sizeof(pidstr_buf));
+        exit(1);
+    }
+
+    snprintf(notify_namestr, sizeof(notify_namestr), "%s", pidstr);
+    record_prefix.len = 0;
+}
+
+
+// applies requested user group and permissions to chatdir, chatlog and eventdir
+static void
+chatdir_apply_group (int chatdir_fd, int chatlog_fd, int event_dfd)
+{
+    if (fchown(chatdir_fd, geteuid(), egid) < 0) {
+        dprintf(2, "Unable to change group ownership of chatdir '%s' to '%s': %s\n", chatdirstr, groupstr, strerror(errno));
+        exit(1);
+    }
+    if (fchmod(chatdir_fd, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP) < 0) {
+        dprintf(2, "Unable to change permissions on chatdir '%s': %s\n", chatdirstr, strerror(errno));
+        exit(1);
+    }
+    if (fchown(chatlog_fd, geteuid(), egid) < 0) {
+        dprintf(2, "Unable to change group ownership of chatlog file '%s/log': %s\n", chatdirstr, strerror(errno));
+        exit(1);
+    }
+    if (fchmod(chatlog_fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP) < 0) {
+        dprintf(2, "Unable to set permissions on chatlog file '%s/log': %s\n", chatdirstr, strerror(errno));
+        exit(1);
+    }
+    /* critical: we need to properly handle gorup permissions on eventdir
+     * - it's setgid, so listener pipes inherit its group
+     */
+    if (fchown(event_dfd, geteuid(), egid) < 0) {
+        dprintf(2, "Unable to change group ownership of eventdir '%s/event' to '%s': %s\n", chatdirstr, groupstr, strerror(errno));
+        exit(1);
+    }
+    if (fchmod(event_dfd, S_ISGID|S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP) < 0) {
+        dprintf(2, "Unable to change permissions on eventdir '%s/event': %s\n", chatdirstr, strerror(errno));
+        exit(1);
+    }
+}
+
+
+/* "binds" to existing chatdir
+ * - chatdir, chatlog and eventdir are opened directly, without
+ *   stat()ing anything first, as joining is the common case
+ * - parts missing from chatdirs made by hand are created in place
+ * - returns eventdir dirfd, or -1 with errno set to ENOENT,
+ *   when there's no chatdir yet
+ */
+static int
+chatdir_bind (void)
+{
+    int event_dfd = -1;
+
+    if ((fds.fd_chatdir = dfd_opendir(chatdirstr)) < 0) {
+        if (errno == ENOENT) {
+            return -1;
+        } else if (errno == ENOTDIR) {
+            dprintf(2, "Chatdir '%s' is not directory.\n", chatdirstr);
+        } else {
+            dprintf(2, "Unable to open chatdir '%s': %s\n", chatdirstr, strerror(errno));
+        }
+        exit(1);
+    }
+
+    if ((fds.fd_chatlog = openat(fds.fd_chatdir, "log", O_RDWR | O_APPEND | O_CREAT | O_NONBLOCK | O_NOFOLLOW, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP)) < 0) {
+        dprintf(2, "Unable to open chatlog file 'log' in '%s': %s\n", chatdirstr, strerror(errno));
+        exit(1);
+    }
+
+    if ((event_dfd = dfd_openat(fds.fd_chatdir, "event")) < 0 && errno == ENOENT) {
+        if (mkdirat(fds.fd_chatdir, "event", S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP) < 0 && errno != EEXIST) {
+            dprintf(2, "Unable to create eventdir 'event' at '%s': %s\n", chatdirstr, strerror(errno));
+            exit(1);
+        }
+        event_dfd = dfd_openat(fds.fd_chatdir, "event");
+    }
+    if (event_dfd < 0) {
+        if (errno == ENOTDIR) {
+            dprintf(2, "eventdir 'event' at '%s' is not directory.\n", chatdirstr);
+        } else {
+            dprintf(2, "Unable to open eventdir 'event' in '%s': %s\n", chatdirstr, strerror(errno));
+        }
+        exit(1);
+    }
+
+    if (groupstr) {
+        chatdir_apply_group(fds.fd_chatdir, fds.fd_chatlog, event_dfd);
+    }
+
+    return event_dfd;
+}
+
+
+/* writes default chatdir 'config'
+ * - only chatdir creator may change it, members just read it
+ */
+static int
+config_create (int chatdir_fd)
+{
+    char config[MAX_CONFIG_LEN] = {0};
+    int fd = -1, len = -1, res = -1;
+
+    len = snprintf(config, sizeof(config),
+        "# pipechat chatroom configuration\n"
+        "# chat lines member may send at once and per second, 0 = unlimited, e.g. 20 and 5\n"
+        "rate_burst = %d\n"
+        "rate_sustained = %d\n"
+        "# stamp messages with monotonic time, so members can see delivery latency\n"
+        "latency_stamps = 0\n"
+        "# seal each chatlog line with CRC32C, so torn records are detected\n"
+        "record_crc = 0\n"
+        "# members append to their own chatlogs in log.d, readers merge them, see --compact\n"
+        "split_log = 0\n",
+        RATE_BURST, RATE_SUSTAINED);
+
+    if ((fd = openat(chatdir_fd, "config", O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, S_IRUSR|S_IWUSR|S_IRGRP)) < 0) {
+        return -1;
+    }
+
+    if ((res = fd_write(fd, config, len)) == len && groupstr) {
+        res = fchown(fd, geteuid(), egid) < 0 ? -1 : len;
+    }
+
+    fd_close(fd);
+
+    return res == len ? 0 : -1;
+}
+
+
+/* reads chatdir 'config', see pipechat_config_load()
+ * - missing config or keys leave defaults in place
+ */
+static void
+config_load (int chatdir_fd)
+{
+    pipechat_config_t config = {
+        .rate_burst = rate_burst,
+        .rate_sustained = rate_sustained,
+        .latency_stamps = latency_stamps,
+        .record_crc = record_crc,
+        .split_log = split_log,
+    };
+
+    pipechat_config_load(chatdir_fd, &config);
+
+    rate_burst = config.rate_burst;
+    rate_sustained = config.rate_sustained;
+    latency_stamps = config.latency_stamps;
+    record_crc = config.record_crc;
+    split_log = config.split_log;
+}
+
+
+/* creates new chatdir atomically
+ * - room is fully built in temporary sibling directory first and
+ *   then rename()d into place, so concurrent joiners never see
+ *   half made room
+ * - if somebody else wins the race, our copy is thrown away and
+ *   -1 is returned with errno set to EEXIST, so caller can join
+ *   the winner's room instead
+ * - returns eventdir dirfd
+ */
+static int
+chatdir_create (void)
+{
+    char tmpdirstr[PATH_MAX] = {0};
+    int tmp_dfd = -1, chatlog_fd = -1, event_dfd = -1, ret = -1;
+    size_t len = strlen(chatdirstr);
+    struct stat sb = {0};
+
+    // temporary directory must live in the same parent directory
+    while (len > 1 && chatdirstr[len - 1] == '/') len--;
+    if ((ret = snprintf(tmpdirstr, sizeof(tmpdirstr), "%.*s.new-%s", (int) len, chatdirstr, pidstr)) < 0 || ret >= sizeof(tmpdirstr)) {
+        dprintf(2, "Chatdir name '%s' too long.\n", chatdirstr);
+        exit(1);
+    }
+
+    if (mkdir(tmpdirstr, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP) < 0 || (tmp_dfd = dfd_opendir(tmpdirstr)) < 0) {
+        dprintf(2, "Unable to create chatdir '%s': %s\n", tmpdirstr, strerror(errno));
+        exit(1);
+    }
+
+    if ((chatlog_fd = openat(tmp_dfd, "log", O_RDWR | O_APPEND | O_CREAT | O_EXCL | O_NONBLOCK | O_NOFOLLOW, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP)) < 0) {
+        dprintf(2, "Unable to create chatlog file 'log' in '%s': %s\n", tmpdirstr, strerror(errno));
+        exit(1);
+    }
+
+    if (mkdirat(tmp_dfd, "event", S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP) < 0
+     || (event_dfd = dfd_openat(tmp_dfd, "event")) < 0
+     || fstat(event_dfd, &sb) < 0) {
+        dprintf(2, "Unable to create eventdir 'event' at '%s': %s\n", tmpdirstr, strerror(errno));
+        exit(1);
+    }
+
+    if (groupstr) {
+        chatdir_apply_group(tmp_dfd, chatlog_fd, event_dfd);
+    } else if (fchmod(event_dfd, (sb.st_mode & 07777) | S_ISGID) < 0) {
+        dprintf(2, "Unable to change permissions on eventdir '%s/event': %s\n", tmpdirstr, strerror(errno));
+        exit(1);
+    }
+
+    if (presence_open(tmp_dfd) < 0) {
+        dprintf(2, "warning: Unable to create presence table '%s/presence': %s\n", tmpdirstr, strerror(errno));
+    }
+
+    if (config_create(tmp_dfd) < 0) {
+        dprintf(2, "warning: Unable to create chatdir config '%s/config': %s\n", tmpdirstr, strerror(errno));
+    }
+
+    // publish room
+#ifdef RENAME_NOREPLACE
+    if ((ret = renameat2(AT_FDCWD, tmpdirstr, AT_FDCWD, chatdirstr, RENAME_NOREPLACE)) < 0 && errno == EINVAL) {
+        ret = rename(tmpdirstr, chatdirstr);
+    }
+#else
+    ret = rename(tmpdirstr, chatdirstr);
+#endif
+
+    if (ret == 0) {
+        fds.fd_chatdir = tmp_dfd;
+        fds.fd_chatlog = chatlog_fd;
+        return event_dfd;
+    }
+
+    if (errno != EEXIST && errno != ENOTEMPTY) {
+        dprintf(2, "Unable to create chatdir '%s': %s\n", chatdirstr, strerror(errno));
+        rmr_chatdir(tmpdirstr);
+        exit(1);
+    }
+
+    // somebody was faster, throw our copy away
+    presence_close();
+    fd_close(chatlog_fd);
+    fd_close(event_dfd);
+    fd_close(tmp_dfd);
+    rmr_chatdir(tmpdirstr);
+
+    errno = EEXIST;
+    return -1;
+}
+
+
+/* registers our pipe in event fifodir for events notification
+ * - ensures proper perms
+ * - pipe inherits group of setgid eventdir, but eventdirs made
+ *   by older versions need explicit chown()
+ */
+static void
+notify_register_pipe (int event_dfd)
+{
+    struct stat sb = {0};
+
+    if (fstat(event_dfd, &sb) < 0) {
+        dprintf(2, "Unable to stat eventdir 'event' at '%s': %s\n", chatdirstr, strerror(errno));
+        exit(1);
+    }
+
+    if (! groupstr) {
+        egid = sb.st_gid;
+    }
+
+    if (mkfifoat(event_dfd, notify_namestr, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP) < 0) {
+        dprintf(2, "Unable to register notify event listener '%s' at '%s/event': %s\n", notify_namestr, chatdirstr, strerror(errno));
+        exit(1);
+    }
+
+    atexit(notify_unregister_pipe);
+
+    if ((fds.fd_event = openat(event_dfd, notify_namestr, O_RDWR | O_NONBLOCK | O_NOFOLLOW)) < 0) {
+        dprintf(2, "Unable to open notify event listener '%s' at '%s/event': %s\n", notify_namestr, chatdirstr, strerror(errno));
+        exit(1);
+    }
+
+#ifdef F_SETPIPE_SZ
+    /* size pipe explicitly, as kernel hands out smaller pipes
+     * to users having many of them (see pipe-user-pages-soft)
+     * - failure is not worth warning at every join, /stats shows it
+     */
+    fcntl(fds.fd_event, F_SETPIPE_SZ, NOTIFY_PIPE_SIZE);
+#endif
+
+    if (getegid() != 0 && egid == 0) {
+        if (groupstr) {
+            dprintf(2, "warning: user group '%s' is superuser group, this is potentially unsafe!\n", groupstr);
+        } else {
+            dprintf(2, "warning: user group '%d' is superuser group, this is potentially unsafe!\n", egid);
+        }
+    }
+
+    if (((sb.st_mode & S_ISGID) == 0 || sb.st_gid != egid) && fchown(fds.fd_event, geteuid(), egid) < 0) {
+        dprintf(2, "Unable to change group ownership of listener '%s' at '%s/event': %s %d\n", notify_namestr, chatdirstr, strerror(errno), egid);
+        exit(1);
+    }
+    if (fchmod(fds.fd_event, S_IRUSR|S_IWUSR|S_IWGRP) < 0) {
+        dprintf(2, "Unable to set permissions on event listener '%s' at '%s/event': %s\n", notify_namestr, chatdirstr, strerror(errno));
+        exit(1);
+    }
+    if ((event_fifodir = fdopendir(event_dfd)) == NULL) {
+        dprintf(2, "Unable to open notify event listener '%s' at '%s/event': %s\n", notify_namestr, chatdirstr, strerror(errno));
+        exit(1);
+    }
+}
+
+
+/* seals torn record left at the end of chatlog, see pipechat_seal_tail()
+ * - it is sealed with "X" field instead of being truncated, as others
+ *   may append to chatlog meanwhile, readers skip such records
+ */
+static void
+chatlog_seal_tail (void)
+{
+    if (pipechat_seal_tail(fds.fd_chatlog, CHATLOG_TORN_GRACE)) {
+        dprintf(2, "warning: torn record at the end of chatlog sealed\n");
+    }
+}
+
+
+// returns whether members of room append to 'log.d', or will, as split_log is on
+static BOOL
+split_room (void)
+{
+    return split_log || fds.fd_split >= 0 || faccessat(fds.fd_chatdir, SPLIT_DIR_NAME, F_OK, 0) == 0;
+}
+
+
+/* opens our own chatlog in 'log.d', creating the directory if needed
+ * - 'log.d' is set up like 'dm', setgid, so chatlogs inherit its group
+ * - we hold shared lock on our chatlog while we are member, --compact
+ *   folds only chatlogs nobody holds lock on
+ * - chatlog of process with our pid, folded while we were opening it,
+ *   is not appended to, new one is created instead
+ */
+static void
+split_open (void)
+{
+    struct stat sb = {0};
+    int fd = -1;
+
+    if (mkdirat(fds.fd_chatdir, SPLIT_DIR_NAME, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP) == 0) {
+        if ((fds.fd_split = dfd_openat(fds.fd_chatdir, SPLIT_DIR_NAME)) < 0
+         || fstat(fds.fd_split, &sb) < 0
+         || fchown(fds.fd_split, geteuid(), egid) < 0
+         || fchmod(fds.fd_split, (groupstr ? S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP : sb.st_mode & 07777) | S_ISGID) < 0) {
+            dprintf(2, "warning: Unable to set up per-member chatlog directory '%s/%s': %s\n", chatdirstr, SPLIT_DIR_NAME, strerror(errno));
+        }
+    } else if (errno != EEXIST) {
+        dprintf(2, "Unable to create per-member chatlog directory '%s/%s': %s\n", chatdirstr, SPLIT_DIR_NAME, strerror(errno));
+        exit(1);
+    }
+
+    if (fds.fd_split < 0 && (fds.fd_split = dfd_openat(fds.fd_chatdir, SPLIT_DIR_NAME)) < 0) {
+        dprintf(2, "Unable to open per-member chatlog directory '%s/%s': %s\n", chatdirstr, SPLIT_DIR_NAME, strerror(errno));
+        exit(1);
+    }
+
+    for (;;) {
+        if ((fd = openat(fds.fd_split, pidstr, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW | O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP)) < 0
+         || flock(fd, LOCK_SH) < 0
+         || fstat(fd, &sb) < 0) {
+            dprintf(2, "Unable to open per-member chatlog '%s/%s/%s': %s\n", chatdirstr, SPLIT_DIR_NAME, pidstr, strerror(errno));
+            exit(1);
+        }
+        if (sb.st_nlink > 0) {
+            break;
+        }
+        fd_close(fd);
+    }
+
+    if (fchown(fd, geteuid(), egid) < 0 || fchmod(fd, S_IRUSR|S_IWUSR|S_IRGRP) < 0) {
+        dprintf(2, "warning: Unable to set permissions on per-member chatlog '%s/%s/%s': %s\n", chatdirstr, SPLIT_DIR_NAME, pidstr, strerror(errno));
+    }
+
+    fds.fd_append = fd;
+}
+
+
+/* joins chatdir, creating it if it does not exist yet
+ * - "binds" to chatdir, chatlog and eventdir by holding onto their fds
+ * - registers pipe in eventdir
+ */
+static void
+chatdir_join (void)
+{
+    int event_dfd = -1;
+
+    while ((event_dfd = chatdir_bind()) < 0 && (event_dfd = chatdir_create()) < 0);
+
+    config_load(fds.fd_chatdir);
+    chatlog_seal_tail();
+
+    // by default, we don't want to see messages from the past, as they could be loooooong
+    last_chatlog_read_pos = lseek(fds.fd_chatlog, 0, SEEK_END);
+
+    // with split_log on, we append to our own chatlog and merge those of everybody, again from their current ends
+    fds.fd_append = fds.fd_chatlog;
+    if (split_log && mode == MODE_CHAT) {
+        split_open();
+    }
+
+    // broker relays 'log' only, members appending elsewhere would be missing in its stream
+    if (mode == MODE_BROKER && split_room()) {
+        dprintf(2, "Chatroom '%s' keeps per-member chatlogs in '%s' (split_log), broker relays 'log' only.\n", chatdirstr, SPLIT_DIR_NAME);
+        exit(1);
+    }
+
+    // members who joined with split_log on before could be still there, so readers merge even if they don't append there
+    if ((mode == MODE_CHAT || mode == MODE_FOLLOW || mode == MODE_RECORD)
+     && (fds.fd_split >= 0 || (fds.fd_split = dfd_openat(fds.fd_chatdir, SPLIT_DIR_NAME)) >= 0)) {
+        split_add_chatlog();
+        split_scan(YES, NO);
+    }
+
+    /* chat clients get chatlog from broker when there is one,
+     * then our pipe is dotted, so we get only control events through it
+     * - broker relays 'log' only, so not in room with 'log.d'
+     */
+    if (mode == MODE_CHAT && fds.fd_split < 0 && broker_connect() == 0) {
+        snprintf(notify_namestr, sizeof(notify_namestr), ".%s", pidstr);
+    }
+
+    notify_register_pipe(event_dfd);
+}
+
+
+/* registers in shared presence table of joined chatdir
+ * - so /list, /whois and /ptyof can be answered locally
+ * - without it we fall back to querying members through fifodir
+ */
+static void
+presence_join (void)
+{
+    if ((presence == NULL && presence_open(fds.fd_chatdir) < 0) || presence_register() < 0) {
+        dprintf(2, "warning: Unable to register in presence table '%s/presence': %s\n", chatdirstr, strerror(errno));
+    } else {
+        atexit(presence_unregister);
+    }
+}
+
+
+// removes our direct message inbox
+static void
+dm_close_inbox (void)
+{
+    // "dm/<pid>", NUL of first string makes room for the slash
+    char name[sizeof(DM_DIR_NAME) + sizeof(pidstr_buf)] = {0};
+
+    snprintf(name, sizeof(name), "%s/%s", DM_DIR_NAME, pidstr);
+    if (fds.fd_chatdir != -1 && unlinkat(fds.fd_chatdir, name, 0) < 0 && errno != ENOENT) {
+        dprintf(2, "warning: Unable to remove direct message inbox '%s/%s': %s\n", chatdirstr, name, strerror(errno));
+    }
+}
+
+
+/* creates our direct message inbox in 'dm' directory of joined chatdir
+ * - members can append to it, but only we can read it
+ * - 'dm' is created by whoever needs it first, with permissions of eventdir,
+ *   it's setgid too, so inboxes inherit its group, and sticky, so nobody
+ *   can replace inbox of somebody else
+ * - inbox left behind by crashed process with our pid is replaced
+ */
+static void
+dm_open_inbox (void)
+{
+    char name[sizeof(DM_DIR_NAME) + sizeof(pidstr_buf)] = {0};
+    struct stat sb = {0};
+    int dm_dfd = -1;
+
+    if (mkdirat(fds.fd_chatdir, DM_DIR_NAME, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP) == 0) {
+        if ((dm_dfd = dfd_openat(fds.fd_chatdir, DM_DIR_NAME)) < 0
+         || fstat(dm_dfd, &sb) < 0
+         || fchown(dm_dfd, geteuid(), egid) < 0
+         || fchmod(dm_dfd, (groupstr ? S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP : sb.st_mode & 07777) | S_ISGID | S_ISVTX) < 0) {
+            dprintf(2, "warning: Unable to set up direct message directory '%s/%s': %s\n", chatdirstr, DM_DIR_NAME, strerror(errno));
+        }
+        if (dm_dfd >= 0) {
+            fd_close(dm_dfd);
+        }
+    } else if (errno != EEXIST) {
+        dprintf(2, "warning: Unable to create direct message directory '%s/%s': %s\n", chatdirstr, DM_DIR_NAME, strerror(errno));
+        return;
+    }
+
+    snprintf(name, sizeof(name), "%s/%s", DM_DIR_NAME, pidstr);
+    unlinkat(fds.fd_chatdir, name, 0);
+
+    if ((fds.fd_inbox = openat(fds.fd_chatdir, name, O_RDWR | O_APPEND | O_CREAT | O_EXCL | O_NOFOLLOW, S_IRUSR|S_IWUSR|S_IWGRP)) < 0) {
+        dprintf(2, "warning: Unable to create direct message inbox '%s/%s': %s\n", chatdirstr, name, strerror(errno));
+        return;
+    }
+
+    atexit(dm_close_inbox);
+
+    if (fchown(fds.fd_inbox, geteuid(), egid) < 0 || fchmod(fds.fd_inbox, S_IRUSR|S_IWUSR|S_IWGRP) < 0) {
+        dprintf(2, "warning: Unable to set permissions on direct message inbox '%s/%s': %s\n", chatdirstr, name, strerror(errno));
+    }
+}
+
+
+// orders latency samples for percentiles
+static int
+bench_cmp_ns (const void * a, const void * b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+
+// prints latency distribution of samples in ms
+static void
+bench_report (const char * label, int64_t * samples, size_t count, int64_t total)
+{
+    if (count == 0) {
+        dprintf(1, "%-16s no samples\n", label);
+        return;
+    }
+
+    qsort(samples, count, sizeof(int64_t), bench_cmp_ns);
+
+    dprintf(1, "%-16s n=%-5zu min=%8.3fms p50=%8.3fms p90=%8.3fms p99=%8.3fms max=%8.3fms total=%8.3fms\n",
+        label, count,
+        samples[0] / 1e6,
+        samples[count * 50 / 100] / 1e6,
+        samples[count * 90 / 100] / 1e6,
+        samples[count * 99 / 100] / 1e6,
+        samples[count - 1] / 1e6,
+        total / 1e6);
+}
+
+
+/* runs single round of join benchmark with given number of joiners
+ * - each joiner is separate process, all of them are released at
+ *   once by closing shared start pipe, like from login script
+ * - joiners stay in until everybody joined, so late joiners pay
+ *   for notifying early ones, then they leave and room is destroyed
+ */
+static int
+bench_join_round (size_t joiners)
+{
+    int start[2] = {-1, -1}, results[2] = {-1, -1}, release[2] = {-1, -1};
+    int64_t * samples = NULL, began = 0;
+    size_t collected = 0, failed = 0, forked = 0;
+    char label[MAX_INFO_LINE_LEN] = {0};
+
+    if ((samples = calloc(joiners, sizeof(int64_t))) == NULL || pipe(start) < 0 || pipe(results) < 0 || pipe(release) < 0) {
+        dprintf(2, "Unable to set up join benchmark: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (; forked < joiners; forked++) {
+        pid_t child = fork();
+
+        if (child < 0) {
+            dprintf(2, "Unable to fork joiner %zu: %s\n", forked, strerror(errno));
+            break;
+        }
+
+        if (child == 0) {
+            char go = 0;
+            int64_t t0 = 0;
+
+            fd_close(start[1]);
+            fd_close(results[0]);
+            fd_close(release[1]);
+
+            // wait for everybody else
+            fd_read(start[0], &go, 1);
+
+            init_pidstr();
+            t0 = get_monotonic_ns();
+            chatdir_join();
+            presence_join();
+            writechat_presence(1, 0);
+            t0 = get_monotonic_ns() - t0;
+
+            fd_write(results[1], &t0, sizeof(t0));
+            fd_read(release[0], &go, 1);
+
+            exit(0);
+        }
+    }
+
+    fd_close(start[0]);
+    fd_close(results[1]);
+    fd_close(release[0]);
+
+    // off they go
+    began = get_monotonic_ns();
+    fd_close(start[1]);
+
+    while (collected + failed < forked) {
+        struct pollfd pfd = { .fd = results[0], .events = POLLIN };
+        int64_t sample = 0;
+
+        if (poll(&pfd, 1, 100) > 0 && fd_read(results[0], (char *) &sample, sizeof(sample)) == sizeof(sample)) {
+            samples[collected++] = sample;
+            continue;
+        }
+
+        // joiners only exit before being released when they fail
+        while (waitpid(-1, NULL, WNOHANG) > 0) {
+            failed++;
+        }
+    }
+    began = get_monotonic_ns() - began;
+
+    fd_close(release[1]);
+    while (wait(NULL) > 0);
+    fd_close(results[0]);
+
+    snprintf(label, sizeof(label), "join x%zu", joiners);
+    bench_report(label, samples, collected, began);
+    if (failed || forked < joiners) {
+        dprintf(1, "%-16s %zu joiner(s) failed\n", label, failed + joiners - forked);
+    }
+
+    free(samples);
+    return rmr_chatdir(chatdirstr);
+}
+
+
+/* measures how long it takes to join chatdir, when many clients
+ * join at once, for each comma separated count in bench_joiners
+ * - scratch chatdir must not exist, it's created and destroyed
+ *   in each round
+ */
+static int
+bench_join (void)
+{
+    char * counts = bench_joiners;
+
+    while (*counts) {
+        char * next = NULL;
+        long joiners = strtol(counts, &next, 10);
+
+        if (next == counts || joiners <= 0) {
+            dprintf(2, "Invalid joiner count list '%s'\n", bench_joiners);
+            return 1;
+        }
+        if (bench_join_round(joiners) < 0) {
+            return 1;
+        }
+
+        counts = (*next == ',') ? next + 1 : next;
+    }
+
+    return 0;
+}
+
+
+// stops headless modes on termination signals, so they unregister properly
+static void
+stop_handler (int sig)
+{
+    run = NO;
+}
+
+
+// installs stop_handler for usual termination signals
+static void
+install_stop_handlers (void)
+{
+    struct sigaction sa = {0};
+
+    sa.sa_handler = stop_handler;
+    sigemptyset(&sa.sa_mask);
+
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    // we want EPIPE from write() instead
+    signal(SIGPIPE, SIG_IGN);
+}
+
+
+/* handles events pending in our pipe in headless modes
+ * - returns CHECK_MESSAGE on any event, as chatlog might have grown
+ *   even when '\n' was coalesced into other pending events
+ * - 'D' stops the process and acknowledges destruction right away,
+ *   whatever made it into chatlog before destruction still counts
+ * - queries are left unanswered, headless listeners are not members
+ */
+static check_result
+headless_read_events (void)
+{
+    char event[MAX_EVENT_READ_LEN] = {0};
+    int len = fd_read(fds.fd_event, event, sizeof(event));
+
+    for (int i = 0; i < len; i++) {
+        if (event[i] == 'D') {
+            notify_unregister_pipe();
+            run = NO;
+            break;
+        }
+    }
+
+    return len > 0 ? CHECK_MESSAGE : CHECK_NOTHING;
+}
+
+
+// waits for events in our pipe in headless modes, see headless_read_events()
+static check_result
+headless_wait (int timeout)
+{
+    struct pollfd pfd = { .fd = fds.fd_event, .events = POLLIN };
+    int changed = 0;
+
+    if ((changed = poll(&pfd, 1, timeout)) < 0) {
+        return errno == EINTR ? CHECK_SIGNAL : CHECK_ERROR;
+    } else if (changed == 0) {
+        return CHECK_TIMEOUT;
+    }
+
+    return headless_read_events();
+}
+
+
+/* copies up to len bytes of chatlog at *pos into stdout, advancing *pos
+ * - splice() moves pages into stdout pipe without copying them through
+ *   userspace, sendfile() does the same for files, pread() + write()
+ *   is the last resort
+ */
+static ssize_t
+follow_copy (long * pos, size_t len)
+{
+    char buffer[MAX_CHAT_READ_BUFFER_LEN];
+    ssize_t res = -1;
+
+#ifdef __linux__
+    if (follow_copy_method == COPY_SPLICE) {
+        loff_t off = *pos;
+        if ((res = splice(fds.fd_chatlog, &off, 1, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE)) >= 0 || errno != EINVAL) {
+            *pos = off;
+            return res;
+        }
+        follow_copy_method = COPY_SENDFILE;
+    }
+    if (follow_copy_method == COPY_SENDFILE) {
+        off_t off = *pos;
+        if ((res = sendfile(1, fds.fd_chatlog, &off, len)) >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+            *pos = off;
+            return res;
+        }
+        follow_copy_method = COPY_READWRITE;
+    }
+#endif
+
+    if (len > sizeof(buffer)) {
+        len = sizeof(buffer);
+    }
+    if ((res = pread(fds.fd_chatlog, buffer, len, *pos)) > 0) {
+        for (ssize_t done = 0, wrote = 0; done < res; done += wrote) {
+            if ((wrote = fd_write(1, buffer + done, res - done)) < 0) {
+                return -1;
+            }
+        }
+        *pos += res;
+    }
+
+    return res;
+}
+
+
+/* streams complete records appended to chatlog since last time to stdout
+ * - only up to the last newline, so record still being written stays
+ *   for next round and downstream parsers never see torn records
+ * - in room with 'log.d', records of all chatlogs are merged into stream
+ */
+static int
+follow_flush (void)
+{
+    long end = -1, complete = -1;
+
+    retain_apply();
+
+    if (fds.fd_split < 0) {
+        split_discover();
+    }
+    if (fds.fd_split >= 0) {
+        split_out_fd = 1;
+        split_refresh();
+        split_collect(split_write);
+        split_write(NULL, 0);
+        return split_out_failed ? -1 : 0;
+    }
+    last_chatlog_read_pos = chatlog_skip_punched(last_chatlog_read_pos);
+
+    end = lseek(fds.fd_chatlog, 0, SEEK_END);
+    complete = chatlog_find_record_end(last_chatlog_read_pos, end);
+
+    while (last_chatlog_read_pos < complete) {
+        ssize_t res = follow_copy(&last_chatlog_read_pos, complete - last_chatlog_read_pos);
+
+        if (res < 0 && errno == EINTR) {
+            continue;
+        } else if (res <= 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* --follow: registers as listener like any other client, but
+ * instead of rendering chat, it streams raw chatlog to stdout
+ */
+static int
+follow_main (void)
+{
+    install_stop_handlers();
+    chatdir_join();
+
+    while (run) {
+        check_result result = headless_wait(-1);
+
+        if (result == CHECK_ERROR) {
+            dprintf(2, "Waiting for events failed: %s\n", strerror(errno));
+            return 1;
+        }
+        if (result == CHECK_MESSAGE && follow_flush() < 0) {
+            if (errno != EPIPE) {
+                dprintf(2, "Unable to follow chatlog '%s/log': %s\n", chatdirstr, strerror(errno));
+                return 1;
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+#ifdef __linux__
+
+/* --observe: renders chat to stdout like member does, without being one
+ * - no pipe is registered in eventdir, so senders don't know about us
+ *   and don't pay anything for us, read permission on chatlog is all
+ *   we need
+ * - inotify IN_MODIFY of chatlog wakes us up instead, and all of the
+ *   appends since last wakeup are read at once
+ * - in room with 'log.d', its chatlogs are watched too, and chatdir
+ *   is watched for 'log.d' to appear
+ * - chatlog losing its last link means chatroom was destroyed
+ */
+static int
+observe_main (void)
+{
+    char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char watchpath[PATH_MAX] = {0};
+    struct stat st = {0};
+    BOOL split_watched = NO;
+    int watchfd = -1;
+
+    install_stop_handlers();
+
+    if ((fds.fd_chatdir = dfd_opendir(chatdirstr)) < 0) {
+        dprintf(2, "Unable to open chatdir '%s': %s\n", chatdirstr, strerror(errno));
+        return 1;
+    }
+    if ((fds.fd_chatlog = openat(fds.fd_chatdir, "log", O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+        dprintf(2, "Unable to open chatlog '%s/log': %s\n", chatdirstr, strerror(errno));
+        return 1;
+    }
+    config_load(fds.fd_chatdir);
+
+    snprintf(watchpath, sizeof(watchpath), "/proc/self/fd/%d", fds.fd_chatlog);
+    if ((watchfd = inotify_init1(IN_CLOEXEC)) < 0 || inotify_add_watch(watchfd, watchpath, IN_MODIFY | IN_ATTRIB) < 0) {
+        dprintf(2, "Unable to watch chatlog '%s/log': %s\n", chatdirstr, strerror(errno));
+        return 1;
+    }
+    snprintf(watchpath, sizeof(watchpath), "/proc/self/fd/%d", fds.fd_chatdir);
+    if (inotify_add_watch(watchfd, watchpath, IN_CREATE | IN_ONLYDIR) < 0) {
+        dprintf(2, "Unable to watch chatdir '%s': %s\n", chatdirstr, strerror(errno));
+        return 1;
+    }
+
+    last_chatlog_read_pos = lseek(fds.fd_chatlog, 0, SEEK_END);
+
+    if ((fds.fd_split = dfd_openat(fds.fd_chatdir, SPLIT_DIR_NAME)) >= 0) {
+        split_add_chatlog();
+        split_scan(YES, NO);
+    }
+
+    while (run) {
+        // chatlogs appear in 'log.d' and grow without touching 'log', anything appended before watch is read right away
+        if (fds.fd_split >= 0 && ! split_watched) {
+            snprintf(watchpath, sizeof(watchpath), "/proc/self/fd/%d", fds.fd_split);
+            if (inotify_add_watch(watchfd, watchpath, IN_CREATE | IN_MODIFY | IN_ONLYDIR) < 0) {
+                dprintf(2, "Unable to watch per-member chatlog directory '%s/%s': %s\n", chatdirstr, SPLIT_DIR_NAME, strerror(errno));
+                return 1;
+            }
+            split_watched = YES;
+            process_messages();
+        }
+
+        if (read(watchfd, events, sizeof(events)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            dprintf(2, "Watching chatlog '%s/log' failed: %s\n", chatdirstr, strerror(errno));
+            return 1;
+        }
+        latency_wakeup_ns = get_monotonic_ns();
+
+        process_messages();
+
+        if (fstat(fds.fd_chatlog, &st) == 0 && st.st_nlink == 0) {
+            char time[MAX_TIME_STR_LEN] = {0};
+            get_timestr(time);
+            dprintf(1, "[%s] *** chatroom '%s' destroyed...\n", time, chatdirstr);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+#else
+
+static int
+observe_main (void)
+{
+    dprintf(2, "Observer is not supported on this platform.\n");
+    return 1;
+}
+
+#endif
+
+
+// returns pid of "[pid]" prefixed chatlog line, 0 if it's not prefixed
+static pid_t
+chatlog_parse_pid (const char * p, const char * end)
+{
+    pid_t pid = 0;
+
+    if (p >= end || *p++ != '[') {
+        return 0;
+    }
+    while (p < end && *p >= '0' && *p <= '9') {
+        pid = pid * 10 + (*p++ - '0');
+    }
+
+    return (p < end && *p == ']') ? pid : 0;
+}
+
+
+// maps pid to trace client number, 0 when there's no room for more clients
+static uint32_t
+trace_client (pid_t pid)
+{
+    size_t slot = (size_t) pid & (MAX_TRACE_CLIENTS - 1);
+
+    for (size_t probe = 0; probe < MAX_TRACE_CLIENTS; probe++, slot = (slot + 1) & (MAX_TRACE_CLIENTS - 1)) {
+        if (trace_pids[slot] == pid) {
+            return trace_clients[slot];
+        } else if (trace_pids[slot] == 0) {
+            trace_pids[slot] = pid;
+            trace_clients[slot] = ++trace_clients_len;
+            return trace_clients[slot];
+        }
+    }
+
+    return 0;
+}
+
+
+// writes batched trace records to stdout
+static int
+trace_flush (void)
+{
+    size_t size = trace_batch_len * sizeof(trace_record_t);
+
+    if (size > 0 && fd_write(1, trace_batch, size) != (int) size) {
+        return -1;
+    }
+    trace_batch_len = 0;
+
+    return 0;
+}
+
+
+/* adds record to trace
+ * - time since previous record is kept in us, longer pauses than
+ *   uint32_t can hold (71 minutes) are shortened
+ */
+static int
+trace_emit (uint8_t type, uint32_t client, uint32_t len)
+{
+    int64_t now = get_monotonic_ns();
+    int64_t delta = (now - trace_last_ns) / 1000;
+    trace_record_t * record = &trace_batch[trace_batch_len++];
+
+    record->delta_us = delta > UINT32_MAX ? UINT32_MAX : delta;
+    record->client = client;
+    record->len = len;
+    record->type = type;
+    trace_last_ns = now;
+
+    return trace_batch_len == MAX_TRACE_BATCH ? trace_flush() : 0;
+}
+
+
+// returns pid encoded in listener pipe name, dotted or not
+static pid_t
+trace_listener_pid (const char * name)
+{
+    if (name[0] == '.') {
+        name++;
+    }
+
+    return (name[0] >= '1' && name[0] <= '9') ? (pid_t) atol(name) : 0;
+}
+
+
+// records members present in room when recording starts as joined
+static void
+record_scan_eventdir (void)
+{
+    struct dirent * entry = NULL;
+
+    rewinddir(event_fifodir);
+    while ((entry = readdir(event_fifodir))) {
+        pid_t pid = trace_listener_pid(entry->d_name);
+
+        if (pid > 0 && pid != getpid()) {
+            trace_emit(TRACE_JOIN, trace_client(pid), 0);
+        }
+    }
+}
+
+
+// records message whose lines record_lines() collected so far, if any
+static void
+record_message_flush (void)
+{
+    if (record_message.len > 0) {
+        trace_emit(TRACE_MESSAGE, record_message.client, record_message.len);
+        record_message.len = 0;
+    }
+}
+
+
+/* records complete chatlog lines in [data, data + len)
+ * - multi-line message is single record of its total length, lines
+ *   of it can come in several calls, see record_message_flush()
+ * - anything but chat messages, i.e. status lines, are recorded as
+ *   plain appends of their writer, or of client 0 when unknown
+ * - emit of split_merge() for --record in room with 'log.d'
+ */
+static void
+record_lines (const char * data, size_t len)
+{
+    for (const char * p = data, * stop = data + len; p < stop; ) {
+        const char * eol = memchr(p, '\n', stop - p);
+        const char * next = eol ? eol + 1 : stop;
+        pid_t pid = 0;
+        int64_t time = 0;
+        int kind = rate_parse_line(p, next, &pid, &time);
+
+        if (kind == 2 && pid == record_message.pid && record_message.len > 0) {
+            record_message.len += next - p;
+        } else {
+            record_message_flush();
+            if (kind > 0) {
+                record_message.pid = pid;
+                record_message.client = trace_client(pid);
+                record_message.len = next - p;
+            } else {
+                pid = chatlog_parse_pid(p, next);
+                trace_emit(TRACE_APPEND, pid > 0 ? trace_client(pid) : 0, next - p);
+            }
+        }
+        p = next;
+    }
+}
+
+
+/* records complete chatlog lines appended since last time
+ * - in room with 'log.d', records of all chatlogs are merged first
+ */
+static int
+record_appends (void)
+{
+    static char buffer[MAX_CHATLOG_PRINT_LEN];
+    long end = -1;
+
+    if (fds.fd_split < 0) {
+        split_discover();
+    }
+    if (fds.fd_split >= 0) {
+        split_refresh();
+        split_collect(record_lines);
+        record_message_flush();
+        return 0;
+    }
+
+    end = chatlog_find_record_end(last_chatlog_read_pos, lseek(fds.fd_chatlog, 0, SEEK_END));
+
+    while (last_chatlog_read_pos < end) {
+        long chunk = end - last_chatlog_read_pos < (long) sizeof(buffer) ? end - last_chatlog_read_pos : (long) sizeof(buffer);
+        size_t printable = 0;
+
+        if (fd_pread(fds.fd_chatlog, buffer, chunk, last_chatlog_read_pos) != chunk) {
+            return -1;
+        }
+        printable = chatlog_printable(buffer, chunk, sizeof(buffer));
+        record_lines(buffer, printable);
+
+        last_chatlog_read_pos += printable;
+    }
+
+    record_message_flush();
+
+    return 0;
+}
+
+
+/* records members joining and leaving, as their pipes come and go
+ * - renames of pipes, when switching to and from broker, are not
+ *   joins or leaves, so they are not watched
+ */
+static int
+record_watch_eventdir (void)
+{
+    int watchfd = -1;
+
+#ifdef __linux__
+    char watchpath[MAX_NOTIFY_NAME_LEN] = {0};
+
+    snprintf(watchpath, sizeof(watchpath), "/proc/self/fd/%d", dirfd(event_fifodir));
+
+    if ((watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0) {
+        if (inotify_add_watch(watchfd, watchpath, IN_CREATE | IN_DELETE | IN_ONLYDIR) < 0) {
+            fd_close(watchfd);
+            watchfd = -1;
+        }
+    }
+#endif
+
+    return watchfd;
+}
+
+
+// records joins and leaves reported by eventdir watch
+static void
+record_membership (int watchfd)
+{
+#ifdef __linux__
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int len = -1;
+
+    while ((len = read(watchfd, buffer, sizeof(buffer))) > 0) {
+        for (char * p = buffer; p < buffer + len; ) {
+            struct inotify_event * ev = (struct inotify_event *) p;
+            pid_t pid = ev->len > 0 ? trace_listener_pid(ev->name) : 0;
+
+            if (pid > 0 && pid != getpid()) {
+                trace_emit((ev->mask & IN_CREATE) ? TRACE_JOIN : TRACE_LEAVE, trace_client(pid), 0);
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+#endif
+}
+
+
+/* --record: writes compact trace of appends, joins and leaves in room
+ * to stdout, so the load can be replayed later, see --replay
+ * - joins and leaves are recorded on Linux only
+ */
+static int
+record_main (void)
+{
+    trace_header_t header = { .magic = TRACE_MAGIC, .version = TRACE_VERSION };
+    int watchfd = -1;
+
+    if (isatty(1)) {
+        dprintf(2, "Refusing to write trace to terminal, redirect stdout to file.\n");
+        return 1;
+    }
+
+    install_stop_handlers();
+    chatdir_join();
+
+    header.started = time(NULL);
+    if (fd_write(1, &header, sizeof(header)) != sizeof(header)) {
+        dprintf(2, "Unable to write trace: %s\n", strerror(errno));
+        return 1;
+    }
+
+    trace_last_ns = get_monotonic_ns();
+    watchfd = record_watch_eventdir();
+    record_scan_eventdir();
+
+    while (run) {
+        struct pollfd pfd[2] = {
+            { .fd = fds.fd_event, .events = POLLIN },
+            { .fd = watchfd, .events = POLLIN },
+        };
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            dprintf(2, "Waiting for events failed: %s\n", strerror(errno));
+            return 1;
+        }
+
+        if (pfd[1].revents) {
+            record_membership(watchfd);
+        }
+        if (pfd[0].revents && headless_read_events() == CHECK_MESSAGE && record_appends() < 0) {
+            dprintf(2, "Unable to read chatlog '%s/log': %s\n", chatdirstr, strerror(errno));
+            return 1;
+        }
+        if (trace_flush() < 0) {
+            if (errno != EPIPE) {
+                dprintf(2, "Unable to write trace: %s\n", strerror(errno));
+                return 1;
+            }
+            break;
+        }
+    }
+
+    return trace_flush() < 0 ? 1 : 0;
+}
+
+
+/* appends record of given type and length on behalf of replayed client
+ * - messages look like real ones, padded to recorded length
+ */
+static void
+replay_append (trace_record_t * record)
+{
+    static char buffer[MAX_CHATLOG_PRINT_LEN];
+    char time[MAX_TIME_STR_LEN] = {0};
+    size_t len = record->len < sizeof(buffer) ? record->len : sizeof(buffer);
+    int prefix = 0;
+
+    get_timestr(time);
+    prefix = snprintf(buffer, sizeof(buffer), record->type == TRACE_MESSAGE ? "[%s][%s] <%s>: " : "[%s][%s] *** ", pidstr, time, nickstr);
+
+    if ((size_t) prefix + 1 > len) {
+        len = prefix + 1;
+    }
+    memset(buffer + prefix, 'x', len - prefix - 1);
+    buffer[len - 1] = '\n';
+
+    if (replay_render && record->type == TRACE_MESSAGE) {
+        buffer[len - 1] = '\0';
+        send_message(buffer + prefix);
+        return;
+    }
+
+    chatlog_append(buffer, len);
+    fsync(fds.fd_append);
+    notify_new_message(event_fifodir);
+}
+
+
+/* reads chatlog up to the end like member would, checking rate
+ * limits of senders, but throws it away instead of printing it
+ */
+static void
+replay_read_chatlog (void)
+{
+    static char buffer[MAX_CHATLOG_PRINT_LEN];
+    int read = -1;
+
+    while ((read = fd_pread(fds.fd_chatlog, buffer, sizeof(buffer), last_chatlog_read_pos)) > 0) {
+        size_t printable = chatlog_printable(buffer, read, sizeof(buffer));
+
+        for (char * p = buffer, * end = buffer + printable; p < end; ) {
+            char * eol = memchr(p, '\n', end - p);
+            char * next = eol ? eol + 1 : end;
+            pid_t pid = 0;
+            int64_t time = 0;
+            unsigned long reported = 0;
+
+            if (rate_parse_line(p, next, &pid, &time) == 1) {
+                rate_check_line(pid, time, &reported);
+            }
+            p = next;
+        }
+
+        if (printable == 0) {
+            break;
+        }
+        last_chatlog_read_pos += printable;
+    }
+}
+
+
+/* makes synthetic member render chat like real one would, but to
+ * terminal nobody looks at, with half of members filtering
+ * - room config is overridden, as everybody sends at full speed
+ */
+static void
+replay_render_start (uint32_t client)
+{
+    int null = open("/dev/null", O_WRONLY);
+
+    rate_burst = rate_sustained = 0;
+
+    if (null >= 0) {
+        dup2(null, 1);
+        fd_close(null);
+    }
+    print_bare = YES;
+    scrollback_init();
+    if (client % 2 == 0) {
+        filter_command("/ignore replay1");
+        filter_command("/mute-status");
+    }
+}
+
+
+/* synthetic member driven by replay, takes trace records from cmdfd
+ * - joins silently, as joins recorded are in trace as appends already
+ */
+static void
+replay_client_main (int cmdfd, uint32_t client)
+{
+    static char nick_buf[MAX_NICK_LEN + 1];
+
+    snprintf(nick_buf, sizeof(nick_buf), "replay%u", client);
+    nickstr = nick_buf;
+    init_pidstr();
+    chatdir_join();
+    presence_join();
+
+    if (replay_render) {
+        replay_render_start(client);
+    }
+
+    while (run) {
+        struct pollfd pfd[2] = {
+            { .fd = cmdfd, .events = POLLIN },
+            { .fd = fds.fd_event, .events = POLLIN },
+        };
+        trace_record_t record = {0};
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (pfd[1].revents && headless_read_events() == CHECK_MESSAGE) {
+            replay_render ? process_messages() : replay_read_chatlog();
+        }
+        if (pfd[0].revents) {
+            if (fd_read(cmdfd, (char *) &record, sizeof(record)) != sizeof(record) || record.type == TRACE_LEAVE) {
+                break;
+            }
+            replay_append(&record);
+        }
+    }
+
+    exit(0);
+}
+
+
+// forks synthetic member for trace client, returns its command pipe
+static int
+replay_spawn (uint32_t client, int * cmdfds, uint32_t clients)
+{
+    int cmd[2] = {-1, -1};
+    pid_t child = -1;
+
+    if (pipe(cmd) < 0 || (child = fork()) < 0) {
+        dprintf(2, "Unable to start replay client %u: %s\n", client, strerror(errno));
+        return -1;
+    }
+
+    if (child == 0) {
+        for (uint32_t i = 0; i <= clients; i++) {
+            if (cmdfds[i] >= 0) {
+                fd_close(cmdfds[i]);
+            }
+        }
+        fd_close(cmd[1]);
+        replay_client_main(cmd[0], client);
+    }
+
+    fd_close(cmd[0]);
+
+    return cmd[1];
+}
+
+
+/* loads --record trace into memory
+ * - returns number of records, -1 on failure
+ */
+static long
+replay_load (const char * path, trace_record_t ** records)
+{
+    trace_header_t header = {0};
+    struct stat sb = {0};
+    size_t size = 0;
+    int fd = -1;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+        dprintf(2, "Unable to open trace '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fd_read(fd, (char *) &header, sizeof(header)) != sizeof(header) || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        dprintf(2, "File '%s' is not pipechat trace.\n", path);
+        return -1;
+    }
+
+    size = (sb.st_size - sizeof(header)) / sizeof(trace_record_t) * sizeof(trace_record_t);
+    if ((*records = malloc(size + 1)) == NULL) {
+        dprintf(2, "Unable to load trace '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    for (size_t done = 0; done < size; ) {
+        int len = fd_read(fd, (char *) *records + done, size - done);
+        if (len <= 0) {
+            dprintf(2, "Unable to load trace '%s': %s\n", path, strerror(errno));
+            return -1;
+        }
+        done += len;
+    }
+    fd_close(fd);
+
+    return size / sizeof(trace_record_t);
+}
+
+
+/* drives synthetic members through scratch chatdir the way trace
+ * records say, at replay_speed times recorded pace (0 = as fast as
+ * possible), until all of them leave
+ * - dispatch lag of each record is collected, unless going full speed
+ * - returns -1 when replay could not be set up
+ */
+static int
+replay_run (trace_record_t * records, size_t count, replay_result_t * result)
+{
+    int64_t began = 0, due_us = 0;
+    uint32_t clients = 0;
+    int * cmdfds = NULL;
+    struct rlimit rl = {0};
+
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].client > clients) {
+            clients = records[i].client;
+        }
+    }
+    if ((cmdfds = malloc((clients + 1) * sizeof(int))) == NULL || (result->lag = calloc(count + 1, sizeof(int64_t))) == NULL) {
+        dprintf(2, "Unable to set up replay: %s\n", strerror(errno));
+        return -1;
+    }
+    for (uint32_t i = 0; i <= clients; i++) {
+        cmdfds[i] = -1;
+    }
+
+    // every replayed member holds command pipe of ours
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    began = get_monotonic_ns();
+
+    for (size_t i = 0; i < count && run; i++) {
+        trace_record_t * record = &records[i];
+        int64_t due = 0;
+
+        due_us += record->delta_us;
+
+        if (replay_speed > 0) {
+            struct timespec until = {0};
+
+            due = began + due_us * 1000 / replay_speed;
+            until.tv_sec = due / 1000000000;
+            until.tv_nsec = due % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR && run);
+        }
+
+        if (record->type == TRACE_LEAVE) {
+            if (cmdfds[record->client] >= 0) {
+                fd_write(cmdfds[record->client], record, sizeof(*record));
+                fd_close(cmdfds[record->client]);
+                cmdfds[record->client] = -1;
+            }
+            continue;
+        }
+
+        // members present before recording started join on first sight
+        if (cmdfds[record->client] < 0) {
+            if ((cmdfds[record->client] = replay_spawn(record->client, cmdfds, clients)) < 0) {
+                break;
+            }
+            result->members++;
+        }
+
+        if (record->type == TRACE_MESSAGE || record->type == TRACE_APPEND) {
+            if (fd_write(cmdfds[record->client], record, sizeof(*record)) != sizeof(*record)) {
+                fd_close(cmdfds[record->client]);
+                cmdfds[record->client] = -1;
+            }
+            record->type == TRACE_MESSAGE ? result->messages++ : result->appends++;
+        }
+
+        if (replay_speed > 0) {
+            result->lag[result->lagged++] = get_monotonic_ns() - due;
+        }
+    }
+
+    // everybody still in leaves now
+    for (uint32_t i = 0; i <= clients; i++) {
+        if (cmdfds[i] >= 0) {
+            fd_close(cmdfds[i]);
+        }
+    }
+    while (wait(NULL) > 0);
+
+    result->elapsed = get_monotonic_ns() - began;
+    result->traced = due_us * 1000;
+
+    free(cmdfds);
+
+    return 0;
+}
+
+
+// --replay: replays trace recorded by --record against scratch chatdir
+static int
+replay_main (void)
+{
+    trace_record_t * records = NULL;
+    replay_result_t result = {0};
+    long count = -1;
+    struct stat sb = {0};
+
+    if (stat(chatdirstr, &sb) == 0 || errno != ENOENT) {
+        dprintf(2, "Replay chatdir '%s' already exists, refusing to touch it.\n", chatdirstr);
+        return 1;
+    }
+
+    if ((count = replay_load(replay_trace, &records)) < 0) {
+        return 1;
+    }
+
+    install_stop_handlers();
+
+    if (replay_run(records, count, &result) < 0) {
+        return 1;
+    }
+
+    dprintf(1, "replayed %zu messages and %zu other appends of %zu members in %.3fs, trace spans %.3fs\n",
+        result.messages, result.appends, result.members, result.elapsed / 1e9, result.traced / 1e9);
+    if (replay_speed > 0) {
+        bench_report("dispatch lag", result.lag, result.lagged, result.elapsed);
+    }
+
+    free(records);
+    free(result.lag);
+
+    return rmr_chatdir(chatdirstr) < 0 ? 1 : 0;
+}
+
+
+/* catches up with whole chatlog of benchmark room, like member
+ * suspended since the room opened, returns time it took, -1 on failure
+ * - backlog past BENCH_TRAFFIC_LAG_SKIP is skipped to its last screen,
+ *   rest of it is paged through by /gap
+ */
+static int64_t
+bench_catch_up (void)
+{
+    static char nick_buf[MAX_NICK_LEN + 1];
+    int64_t began = get_monotonic_ns();
+    pid_t child = -1;
+    int status = 0;
+
+    if ((child = fork()) < 0) {
+        dprintf(2, "Unable to start catch-up member: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (child == 0) {
+        snprintf(nick_buf, sizeof(nick_buf), "catchup");
+        nickstr = nick_buf;
+        init_pidstr();
+        chatdir_join();
+        replay_render_start(0);
+        lag_skip_bytes = BENCH_TRAFFIC_LAG_SKIP;
+        last_chatlog_read_pos = 0;
+
+        process_messages();
+        while (lag_gap.end > 0 && lag_gap.cursor < lag_gap.end) {
+            lag_gap_command("/gap");
+        }
+        exit(0);
+    }
+
+    if (waitpid(child, &status, 0) < 0 || ! WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        dprintf(2, "Catch-up member failed\n");
+        return -1;
+    }
+
+    return get_monotonic_ns() - began;
+}
+
+
+/* measures message throughput of room with given number of members
+ * - synthetic trace, where BENCH_TRAFFIC_SENDERS of members send
+ *   BENCH_TRAFFIC_MESSAGES messages in turns as fast as possible,
+ *   while all of them listen, is replayed
+ * - members send, filter and render through client paths, so the run
+ *   doubles as profile guided optimization workload, see 'make pgo'
+ * - then member who missed all of it catches up
+ */
+static int
+bench_traffic_round (size_t members)
+{
+    size_t count = members * 2 + BENCH_TRAFFIC_MESSAGES, n = 0;
+    size_t senders = members < BENCH_TRAFFIC_SENDERS ? members : BENCH_TRAFFIC_SENDERS;
+    trace_record_t * records = calloc(count, sizeof(trace_record_t));
+    replay_result_t result = {0};
+    int64_t catch_up = 0;
+
+    if (records == NULL) {
+        dprintf(2, "Unable to set up traffic benchmark: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < members; i++) {
+        records[n++] = (trace_record_t) { .client = i + 1, .type = TRACE_JOIN };
+    }
+    for (size_t i = 0; i < BENCH_TRAFFIC_MESSAGES; i++) {
+        records[n++] = (trace_record_t) { .client = i % senders + 1, .len = BENCH_TRAFFIC_MESSAGE_LEN, .type = TRACE_MESSAGE };
+    }
+    for (size_t i = 0; i < members; i++) {
+        records[n++] = (trace_record_t) { .client = i + 1, .type = TRACE_LEAVE };
+    }
+
+    replay_speed = 0;
+    replay_render = 1;
+    if (replay_run(records, count, &result) < 0 || (catch_up = bench_catch_up()) < 0) {
+        return -1;
+    }
+
+    dprintf(1, "traffic x%-7zu messages=%zu senders=%zu time=%.3fs throughput=%.0f msg/s\n",
+        members, result.messages, senders, result.elapsed / 1e9, result.messages / (result.elapsed / 1e9));
+    dprintf(1, "catch-up x%-6zu messages=%zu time=%.3fs throughput=%.0f msg/s\n",
+        members, result.messages, catch_up / 1e9, result.messages / (catch_up / 1e9));
+
+    free(records);
+    free(result.lag);
+
+    return rmr_chatdir(chatdirstr);
+}
+
+
+// runs traffic benchmark round for each comma separated count in bench_members
+static int
+bench_traffic (void)
+{
+    char * counts = bench_members;
+
+    install_stop_handlers();
+
+    while (*counts) {
+        char * next = NULL;
+        long members = strtol(counts, &next, 10);
+
+        if (next == counts || members <= 0) {
+            dprintf(2, "Invalid member count list '%s'\n", bench_members);
+            return 1;
+        }
+        if (bench_traffic_round(members) < 0) {
+            return 1;
+        }
+
+        counts = (*next == ',') ? next + 1 : next;
+    }
+
+    return 0;
+}
+
+
+#ifdef __linux__
+
+// adds resident and proportional set size of process in kB to rss and pss
+static void
+bench_rss_of (pid_t pid, long * rss, long * pss)
+{
+    char path[MAX_INFO_LINE_LEN] = {0}, buffer[MAX_CHAT_READ_BUFFER_LEN * 2] = {0};
+    char * field = NULL;
+    ssize_t len = 0;
+    int fd = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+    if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0) {
+        return;
+    }
+    len = fd_read(fd, buffer, sizeof(buffer) - 1);
+    fd_close(fd);
+
+    buffer[len > 0 ? len : 0] = '\0';
+    if ((field = strstr(buffer, "\nRss:")) != NULL) {
+        *rss += strtol(field + 5, NULL, 10);
+    }
+    if ((field = strstr(buffer, "\nPss:")) != NULL) {
+        *pss += strtol(field + 5, NULL, 10);
+    }
+}
+
+
+// reads away whatever members printed to their terminals, so they don't block
+static void
+bench_rss_drain (int * masters, size_t count)
+{
+    char buffer[MAX_CHATLOG_PRINT_LEN];
+
+    for (size_t i = 0; i < count; i++) {
+        while (read(masters[i], buffer, sizeof(buffer)) > 0);
+    }
+}
+
+
+/* runs single round of memory footprint benchmark with given number of members
+ * - members are real chat clients, this very binary exec'd on a pty
+ *   of its own, so build with readline can be compared to lite one
+ * - each one is waited for to join, before next one is started,
+ *   then everybody quits and room is destroyed
+ * - PSS counts shared pages once, divided among sharers, so that's
+ *   what adds up on host where all of them run
+ */
+static int
+bench_rss_round (size_t members)
+{
+    pid_t * clients = calloc(members, sizeof(pid_t));
+    int * masters = calloc(members, sizeof(int));
+    char exe[PATH_MAX] = {0};
+    size_t started = 0;
+    long rss = 0, pss = 0;
+
+    if (clients == NULL || masters == NULL || readlink("/proc/self/exe", exe, sizeof(exe) - 1) < 0) {
+        dprintf(2, "Unable to set up rss benchmark: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (; started < members; started++) {
+        char event[PATH_MAX] = {0};
+        struct stat sb = {0};
+        char * slave = NULL;
+        int64_t deadline = 0;
+
+        if ((masters[started] = posix_openpt(O_RDWR|O_NOCTTY|O_NONBLOCK|O_CLOEXEC)) < 0 || grantpt(masters[started]) < 0
+            || unlockpt(masters[started]) < 0 || (slave = ptsname(masters[started])) == NULL) {
+            dprintf(2, "Unable to open pty for member %zu: %s\n", started, strerror(errno));
+            break;
+        }
+
+        if ((clients[started] = fork()) < 0) {
+            dprintf(2, "Unable to fork member %zu: %s\n", started, strerror(errno));
+            fd_close(masters[started]);
+            break;
+        }
+
+        if (clients[started] == 0) {
+            int tty = -1, null = -1;
+
+            setsid();
+            if ((tty = open(slave, O_RDWR)) < 0 || (null = open("/dev/null", O_WRONLY)) < 0) {
+                _exit(1);
+            }
+            dup2(tty, 0);
+            dup2(tty, 1);
+            dup2(null, 2);
+            execl(exe, "pipechat", chatdirstr, (char *) NULL);
+            _exit(1);
+        }
+
+        // member has joined, once its event pipe is there
+        snprintf(event, sizeof(event), "%s/event/%d", chatdirstr, clients[started]);
+        deadline = get_monotonic_ms() + 5000;
+        while (stat(event, &sb) < 0 && get_monotonic_ms() < deadline) {
+            bench_rss_drain(masters, started + 1);
+            usleep(1000);
+        }
+    }
+
+    // let everybody take in join lines of those who came after
+    for (int64_t deadline = get_monotonic_ms() + 200; get_monotonic_ms() < deadline; usleep(1000)) {
+        bench_rss_drain(masters, started);
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        bench_rss_of(clients[i], &rss, &pss);
+    }
+
+    if (started > 0) {
+        dprintf(1, "rss x%-10zu build=%s rss=%ldkB pss=%ldkB per member\n", started,
+#ifdef PIPECHAT_LITE
+            "lite",
+#else
+            "readline",
+#endif
+            rss / (long) started, pss / (long) started);
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        fd_write(masters[i], "/quit\r", 6);
+    }
+    // members stuck past deadline are killed, so benchmark always ends
+    for (int64_t deadline = get_monotonic_ms() + BENCH_RSS_QUIT_DEADLINE; started > 0; usleep(1000)) {
+        size_t left = 0;
+        pid_t pid = 0;
+
+        bench_rss_drain(masters, started);
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for (size_t i = 0; i < started; i++) {
+                clients[i] = clients[i] == pid ? 0 : clients[i];
+            }
+        }
+        for (size_t i = 0; i < started; i++) {
+            left += clients[i] > 0;
+        }
+        if (left == 0) {
+            break;
+        }
+        if (get_monotonic_ms() >= deadline) {
+            dprintf(2, "warning: %zu member(s) did not quit in time, killing them\n", left);
+            for (size_t i = 0; i < started; i++) {
+                if (clients[i] > 0) {
+                    kill(clients[i], SIGKILL);
+                    waitpid(clients[i], NULL, 0);
+                }
+            }
+            break;
+        }
+    }
+    for (size_t i = 0; i < started; i++) {
+        fd_close(masters[i]);
+    }
+
+    free(clients);
+    free(masters);
+
+    return started < members ? -1 : rmr_chatdir(chatdirstr);
+}
+
+
+// runs memory footprint benchmark round for each comma separated count in bench_members
+static int
+bench_rss (void)
+{
+    char * counts = bench_members;
+
+    while (*counts) {
+        char * next = NULL;
+        long members = strtol(counts, &next, 10);
+
+        if (next == counts || members <= 0) {
+            dprintf(2, "Invalid member count list '%s'\n", bench_members);
+            return 1;
+        }
+        if (bench_rss_round(members) < 0) {
+            return 1;
+        }
+
+        counts = (*next == ',') ? next + 1 : next;
+    }
+
+    return 0;
+}
+
+#endif
+
+
+// runs benchmark selected by --bench against scratch chatdir
+static int
+bench_main (void)
+{
+    struct stat sb = {0};
+
+    if (stat(chatdirstr, &sb) == 0 || errno != ENOENT) {
+        dprintf(2, "Benchmark chatdir '%s' already exists, refusing to touch it.\n", chatdirstr);
+        return 1;
+    }
+
+    if (strcmp(bench_name, "join") == 0) {
+        return bench_join();
+    } else if (strcmp(bench_name, "traffic") == 0) {
+        return bench_traffic();
+#ifdef __linux__
+    } else if (strcmp(bench_name, "rss") == 0) {
+        return bench_rss();
+#endif
+    }
+
+    dprintf(2, "Unknown benchmark: %s\n", bench_name);
+    return 1;
+}
+
+
+#ifdef __linux__
+
+// chunk of chatlog data shared by all broker clients it's queued for
+typedef struct broker_chunk_s {
+    size_t refs;      // number of queues holding this chunk
+    size_t len;       // length of data
+    char data[];
+} broker_chunk_t;
+
+// broker client connection and its queue of chunks waiting to be sent
+typedef struct broker_client_s {
+    int fd;           // client socket, -1 once dropped
+    size_t index;     // slot in broker_clients
+    struct broker_client_s * next_dropped; // dropped clients freed once epoll batch is over
+    BOOL want_out;    // whether we wait for socket to become writable again
+    size_t head;      // first queued chunk in queue ring
+    size_t len;       // number of queued chunks
+    size_t sent;      // bytes of first queued chunk already sent
+    broker_chunk_t * queue[MAX_BROKER_QUEUE_LEN];
+} broker_client_t;
+
+static int broker_epfd = -1;
+static int broker_listenfd = -1;
+static ino_t broker_socket_ino = 0;
+static broker_client_t ** broker_clients = NULL;
+static size_t broker_clients_len = 0;
+static size_t broker_clients_cap = 0;
+static broker_client_t * broker_dropped = NULL;
+
+
+// drops reference to chunk, freeing it when nobody needs it anymore
+static void
+broker_chunk_release (broker_chunk_t * chunk)
+{
+    if (--chunk->refs == 0) {
+        free(chunk);
+    }
+}
+
+
+/* disconnects client, it will fall back to fifodir notifications
+ * - last client takes over its slot
+ * - client is freed only by broker_dropped_free(), as events of current
+ *   epoll batch may still point to it
+ */
+static void
+broker_client_drop (size_t index)
+{
+    broker_client_t * client = broker_clients[index];
+
+    while (client->len > 0) {
+        broker_chunk_release(client->queue[client->head]);
+        client->head = (client->head + 1) % MAX_BROKER_QUEUE_LEN;
+        client->len--;
+    }
+
+    epoll_ctl(broker_epfd, EPOLL_CTL_DEL, client->fd, NULL);
+    fd_close(client->fd);
+    client->fd = -1;
+    client->next_dropped = broker_dropped;
+    broker_dropped = client;
+
+    broker_clients[index] = broker_clients[--broker_clients_len];
+    broker_clients[index]->index = index;
+}
+
+
+// frees clients dropped during last epoll batch
+static void
+broker_dropped_free (void)
+{
+    while (broker_dropped) {
+        broker_client_t * client = broker_dropped;
+        broker_dropped = client->next_dropped;
+        free(client);
+    }
+}
+
+
+/* sends as much of client's queue as socket takes
+ * - queued chunks are batched into single writev()
+ * - returns -1 when client should be dropped
+ */
+static int
+broker_client_flush (broker_client_t * client)
+{
+    struct iovec iov[MAX_BROKER_IOV_LEN];
+    ssize_t res = -1;
+
+    while (client->len > 0) {
+        int iovcnt = 0;
+
+        for (size_t i = 0; i < client->len && iovcnt < MAX_BROKER_IOV_LEN; i++, iovcnt++) {
+            broker_chunk_t * chunk = client->queue[(client->head + i) % MAX_BROKER_QUEUE_LEN];
+            size_t skip = (i == 0) ? client->sent : 0;
+            iov[iovcnt].iov_base = chunk->data + skip;
+            iov[iovcnt].iov_len = chunk->len - skip;
+        }
+
+        if ((res = writev(client->fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN) {
+                return -1;
+            }
+            break;
+        }
+
+        while (res > 0) {
+            broker_chunk_t * chunk = client->queue[client->head];
+            size_t left = chunk->len - client->sent;
+
+            if ((size_t) res < left) {
+                client->sent += res;
+                break;
+            }
+            res -= left;
+            client->sent = 0;
+            client->head = (client->head + 1) % MAX_BROKER_QUEUE_LEN;
+            client->len--;
+            broker_chunk_release(chunk);
+        }
+    }
+
+    // wait for socket to drain, when we could not send everything
+    if ((client->len > 0) != client->want_out) {
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = client };
+        client->want_out = client->len > 0;
+        if (client->want_out) {
+            ev.events |= EPOLLOUT;
+        }
+        epoll_ctl(broker_epfd, EPOLL_CTL_MOD, client->fd, &ev);
+    }
+
+    return 0;
+}
+
+
+/* reads complete records appended to chatlog since last time once
+ * and queues them for all clients
+ * - clients that can't keep up with MAX_BROKER_QUEUE_LEN chunks are
+ *   dropped, they catch up with chatlog on their own
+ */
+static int
+broker_flush_log (void)
+{
+    long end = -1, complete = -1;
 
-    // we care only if we're called on a real input
-    if (line) {
+    retain_apply();
+    last_chatlog_read_pos = chatlog_skip_punched(last_chatlog_read_pos);
 
-        // readline keeps history, let's make use of it
-        add_history(line);
+    end = lseek(fds.fd_chatlog, 0, SEEK_END);
+    complete = chatlog_find_record_end(last_chatlog_read_pos, end);
 
-        /* process commands:
-         *  - quit if we are told to quit
-         *  - list participants if we are told to list them
-         *  - ... etc
-         *  - or write the message, if there's something to say
-         */
-        if(strncmp(line, "/help", 5) == 0 || strncmp(line, "/h", 2) == 0 || strncmp(line, "/?", 2) == 0 )  {
-            print_buffer("commands:\n");
-            print_buffer("  /help, /h, /?        - print this help\n");
-            print_buffer("  /quit, /q            - quit\n");
-            print_buffer("  /list, /l            - list active connected users\n");
-            print_buffer("  /whois $pid, /w $pid - try to identify connection by $pid\n");
-            print_buffer("  /ptyof $pid, /p $pid - try to identify terminal line by $pid\n");
-            print_buffer("  /destroy             - disconnect all users and destroy chatroom\n");
-            //print_buffer("  /save $logfile       - save copy of chatlog as file named $logfile\n");
-        } else if(strncmp(line, "/quit", 5) == 0 || strncmp(line, "/q", 2) == 0)  {
-            run = NO;
-        } else if(strncmp(line, "/list", 7) == 0 || strncmp(line, "/l", 2) == 0)  {
-            notify_list(event_fifodir);
-        } else if(strncmp(line, "/whois", 4) == 0 || strncmp(line, "/w", 2) == 0)  {
-            if ((line = strstr(line, " "))) {
-                pid_t pid = atoi(line);
-                if (pid) {
-                    notify_whois(event_fifodir, pid);
-                } else {
-                    snprintf(lmsg, MAX_CHAT_READ_BUFFER_LEN, "Invalid pid!\n");
-                    print_buffer(lmsg);
-                }
-            } else {
-                snprintf(lmsg, MAX_CHAT_READ_BUFFER_LEN, "Invalid pid!\n");
-                print_buffer(lmsg);
+    while (last_chatlog_read_pos < complete) {
+        size_t len = complete - last_chatlog_read_pos;
+        broker_chunk_t * chunk = NULL;
+
+        if (len > MAX_BROKER_CHUNK_LEN) {
+            len = MAX_BROKER_CHUNK_LEN;
+        }
+        if ((chunk = malloc(sizeof(broker_chunk_t) + len)) == NULL) {
+            return -1;
+        }
+        if (fd_pread(fds.fd_chatlog, chunk->data, len, last_chatlog_read_pos) != len) {
+            free(chunk);
+            return -1;
+        }
+
+        chunk->len = len;
+        chunk->refs = 1;
+
+        for (size_t i = 0; i < broker_clients_len; i++) {
+            broker_client_t * client = broker_clients[i];
+            if (client->len < MAX_BROKER_QUEUE_LEN) {
+                client->queue[(client->head + client->len++) % MAX_BROKER_QUEUE_LEN] = chunk;
+                chunk->refs++;
             }
-        } else if(strncmp(line, "/pty", 4) == 0 || strncmp(line, "/p", 2) == 0)  {
-            if ((line = strstr(line, " "))) {
-                pid_t pid = atoi(line);
-                if (pid) {
-                    notify_pty(event_fifodir, pid);
-                } else {
-                    snprintf(lmsg, MAX_CHAT_READ_BUFFER_LEN, "Invalid pid!\n");
-                    print_buffer(lmsg);
-                }
-            } else {
-                snprintf(lmsg, MAX_CHAT_READ_BUFFER_LEN, "Invalid pid!\n");
-                print_buffer(lmsg);
+        }
+
+        broker_chunk_release(chunk);
+        last_chatlog_read_pos += len;
+    }
+
+    for (size_t i = 0; i < broker_clients_len; ) {
+        broker_client_t * client = broker_clients[i];
+
+        if (client->len == MAX_BROKER_QUEUE_LEN || broker_client_flush(client) < 0) {
+            broker_client_drop(i);
+        } else {
+            i++;
+        }
+    }
+
+    return 0;
+}
+
+
+/* accepts pending clients
+ * - each one is told offset in chatlog our stream continues from
+ */
+static void
+broker_accept (void)
+{
+    int fd = -1;
+
+    while ((fd = accept4(broker_listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int64_t offset = last_chatlog_read_pos;
+        broker_client_t * client = NULL;
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP };
+
+        if (broker_clients_len == broker_clients_cap) {
+            size_t cap = broker_clients_cap ? broker_clients_cap * 2 : 64;
+            broker_client_t ** clients = realloc(broker_clients, cap * sizeof(broker_client_t *));
+            if (clients == NULL) {
+                fd_close(fd);
+                continue;
             }
-        } else if(strncmp(line, "/destroy", 8) == 0)  {
-            notify_destroy(event_fifodir);
-            usleep(200000);
-            rmr_chatdir(chatdirstr);
-        } else if(strncmp(line, "/save", 5) == 0)  {
+            broker_clients = clients;
+            broker_clients_cap = cap;
+        }
 
-        } else if(strncmp(line, "/", 1) == 0) {
-            snprintf(lmsg, MAX_CHAT_READ_BUFFER_LEN, "Unknown command: %s\n", line + 1);
-            print_buffer(lmsg);
-        } else if(strlen(line) > 0) {
-            send_message(line);
+        if ((client = calloc(1, sizeof(broker_client_t))) == NULL) {
+            fd_close(fd);
+            continue;
+        }
+
+        client->fd = fd;
+        ev.data.ptr = client;
+
+        if (fd_write(fd, &offset, sizeof(offset)) != sizeof(offset) || epoll_ctl(broker_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            fd_close(fd);
+            free(client);
+            continue;
         }
+
+        client->index = broker_clients_len;
+        broker_clients[broker_clients_len++] = client;
     }
 }
 
 
-// returns list of possible completions to readline
-char *
-rlcb_commands_generator(const char *text, int state)
+// removes broker socket from chatdir, unless somebody else replaced it already
+void
+broker_unregister (void)
 {
-    static int list_index, len;
-    char *name;
+    struct stat sb = {0};
 
-    if (!state) {
-        list_index = 0;
-        len = strlen(text);
+    if (fstatat(fds.fd_chatdir, BROKER_SOCKET_NAME, &sb, AT_SYMLINK_NOFOLLOW) == 0 && sb.st_ino == broker_socket_ino) {
+        unlinkat(fds.fd_chatdir, BROKER_SOCKET_NAME, 0);
     }
+}
 
-    while ((name = pipechat_commands[list_index++])) {
-        if (strncmp(name, text, len) == 0) {
-            return strdup(name);
+
+/* publishes broker socket in chatdir
+ * - socket is bound under temporary name first, so it's only
+ *   visible with proper group and permissions applied, which
+ *   keep chatdir's group based access model
+ */
+static int
+broker_listen (void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    // "broker.<pid>", NUL of first string makes room for the dot
+    char tmpname[sizeof(BROKER_SOCKET_NAME) + sizeof(pidstr_buf)] = {0};
+    struct stat sb = {0};
+
+    snprintf(tmpname, sizeof(tmpname), "%s.%s", BROKER_SOCKET_NAME, pidstr);
+
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", chatdirstr, tmpname) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if ((broker_listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+
+    unlinkat(fds.fd_chatdir, tmpname, 0);
+
+    if (bind(broker_listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+     || listen(broker_listenfd, SOMAXCONN) < 0
+     || fchownat(fds.fd_chatdir, tmpname, geteuid(), egid, AT_SYMLINK_NOFOLLOW) < 0
+     || fchmodat(fds.fd_chatdir, tmpname, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP, 0) < 0
+     || fstatat(fds.fd_chatdir, tmpname, &sb, AT_SYMLINK_NOFOLLOW) < 0
+     || renameat(fds.fd_chatdir, tmpname, fds.fd_chatdir, BROKER_SOCKET_NAME) < 0) {
+        unlinkat(fds.fd_chatdir, tmpname, 0);
+        return -1;
+    }
+
+    broker_socket_ino = sb.st_ino;
+    atexit(broker_unregister);
+
+    return 0;
+}
+
+
+/* --broker: single listener in fifodir, that reads each chatlog
+ * update once and pushes it to any number of chat clients connected
+ * through UNIX socket in chatdir
+ */
+static int
+broker_main (void)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct epoll_event events[MAX_EVENT_READ_LEN / 8];
+
+    install_stop_handlers();
+    chatdir_join();
+
+    // stream starts at record boundary
+    last_chatlog_read_pos = chatlog_find_record_end(0, last_chatlog_read_pos);
+
+    if ((broker_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        dprintf(2, "Unable to create broker eventloop: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (broker_listen() < 0) {
+        dprintf(2, "Unable to create broker socket '%s/%s': %s\n", chatdirstr, BROKER_SOCKET_NAME, strerror(errno));
+        return 1;
+    }
+
+    ev.data.ptr = &fds.fd_event;
+    epoll_ctl(broker_epfd, EPOLL_CTL_ADD, fds.fd_event, &ev);
+    ev.data.ptr = &broker_listenfd;
+    epoll_ctl(broker_epfd, EPOLL_CTL_ADD, broker_listenfd, &ev);
+
+    while (run) {
+        int changed = epoll_wait(broker_epfd, events, sizeof(events) / sizeof(events[0]), -1);
+
+        if (changed < 0 && errno != EINTR) {
+            dprintf(2, "Broker eventloop failed: %s\n", strerror(errno));
+            return 1;
         }
+
+        for (int i = 0; i < changed; i++) {
+            if (events[i].data.ptr == &fds.fd_event) {
+                // member joining with split_log on appends past us, clients go back to reading on their own and merge
+                if (split_room()) {
+                    dprintf(2, "Chatroom '%s' got per-member chatlogs in '%s' (split_log), broker relays 'log' only, leaving.\n", chatdirstr, SPLIT_DIR_NAME);
+                    run = NO;
+                    break;
+                }
+                if (headless_read_events() == CHECK_MESSAGE && broker_flush_log() < 0) {
+                    dprintf(2, "Unable to read chatlog '%s/log': %s\n", chatdirstr, strerror(errno));
+                }
+            } else if (events[i].data.ptr == &broker_listenfd) {
+                broker_accept();
+            } else {
+                broker_client_t * client = events[i].data.ptr;
+
+                // dropped earlier in this batch
+                if (client->fd < 0) {
+                    continue;
+                }
+
+                // clients never talk to us, so anything but writability means they are gone
+                if ((events[i].events & ~EPOLLOUT) || broker_client_flush(client) < 0) {
+                    broker_client_drop(client->index);
+                }
+            }
+        }
+
+        broker_dropped_free();
     }
 
-    return NULL;
+    return 0;
 }
 
+#else
 
-// handles readline completion
-char * *
-rlcb_commands_completion(const char *text, int start, int end)
+static int
+broker_main (void)
 {
-    rl_attempted_completion_over = 1;
-    return rl_completion_matches(text, rlcb_commands_generator);
+    dprintf(2, "Broker is not supported on this platform.\n");
+    return 1;
 }
 
+#endif
 
-// handles readline input line
-static void
-rlcb_handle_line (char *line)
+
+/* copies up to len bytes of chatlog at *pos into archive fd at *out,
+ * advancing both
+ * - copy_file_range() copies inside kernel, sendfile() does the same
+ *   across filesystems on kernels which refuse that for the former,
+ *   pread() + pwrite() is the last resort
+ */
+static ssize_t
+archive_copy (int fd, long * pos, off_t * out, size_t len)
 {
-    /* we want to ignore when readline says it has the end of a message,
-     * as we'll only care if the user presses ENTER.
-     * if line buffer is empty, it means user sent EOF,
-     * and wants to quit.
-     */
-    if (line != NULL) {
-        rl_set_prompt(PROMPT);
-        rl_already_prompted = 1;
-    } else {
-        run = NO;
+    char buffer[MAX_CHAT_READ_BUFFER_LEN];
+    ssize_t res = -1;
+
+#ifdef __linux__
+    if (archive_copy_method == COPY_FILE_RANGE) {
+        loff_t in = *pos, off = *out;
+        if ((res = copy_file_range(fds.fd_chatlog, &in, fd, &off, len, 0)) >= 0
+         || (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)) {
+            *pos = in;
+            *out = off;
+            return res;
+        }
+        archive_copy_method = COPY_SENDFILE;
+    }
+    if (archive_copy_method == COPY_SENDFILE) {
+        off_t in = *pos;
+        if (lseek(fd, *out, SEEK_SET) == *out
+         && ((res = sendfile(fd, fds.fd_chatlog, &in, len)) >= 0 || (errno != EINVAL && errno != ENOSYS))) {
+            *pos = in;
+            *out += res > 0 ? res : 0;
+            return res;
+        }
+        archive_copy_method = COPY_READWRITE;
+    }
+#endif
+
+    if (len > sizeof(buffer)) {
+        len = sizeof(buffer);
     }
+    if ((res = pread(fds.fd_chatlog, buffer, len, *pos)) > 0) {
+        for (ssize_t done = 0, wrote = 0; done < res; done += wrote) {
+            if ((wrote = pwrite(fd, buffer + done, res - done, *out + done)) < 0) {
+                return -1;
+            }
+        }
+        *pos += res;
+        *out += res;
+    }
+
+    return res;
 }
 
 
-// handles readline enter keypress
+/* makes archive durable up to out and records, which chatlog offset
+ * that corresponds to
+ * - in room with 'log.d', offsets of per-member chatlogs follow, line
+ *   per chatlog with its pid, inode and offset
+ * - checkpoint is replaced with rename(), so it's either old or new one
+ *   after crash, never torn, and its directory is synced, so the rename
+ *   itself survives crash too
+ */
 static int
-rlcb_handle_enter (int x, int y)
+archive_checkpoint (int fd, long pos, off_t out, ino_t ino)
 {
-    char *line = NULL;
+    char path[PATH_MAX] = {0}, tmp[PATH_MAX] = {0};
+    size_t size = (split_writers_len + 1) * MAX_ARCHIVE_CHECKPOINT_LINE_LEN;
+    char * line = NULL, * slash = NULL;
+    int cfd = -1, dfd = -1, len = -1, res = -1;
 
-    /* handle when a user presses enter.
-     *  - save the contents of the line.
-     *  - set the prompt to nothing.
-     *  - blank the line.
-     *  - pass the message to the message handler
-     *  - rl_copy_text returns malloc'd mem, so free it
-     *  - restore the prompt
-     *  - tell readline we're done mucking
-     */
-    line = rl_copy_text(0, rl_end);
-    rl_set_prompt("");
-    rl_replace_line("", 1);
-    rl_redisplay();
+    if (fsync(fd) < 0 || (line = malloc(size)) == NULL) {
+        return -1;
+    }
 
-    dispatch_input_line(line);
+    snprintf(path, sizeof(path), "%s.checkpoint", archive_dest);
+    snprintf(tmp, sizeof(tmp), "%s.checkpoint.tmp", archive_dest);
+    len = snprintf(line, size, "%ld %lld %llu\n", pos, (long long) out, (unsigned long long) ino);
+    for (size_t i = 0; i < split_writers_len; i++) {
+        if (split_writers[i].pid > 0) {
+            len += snprintf(line + len, size - len, "%d %llu %zu\n", split_writers[i].pid, (unsigned long long) split_writers[i].ino, split_writers[i].pos);
+        }
+    }
+
+    if ((cfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP)) >= 0) {
+        if (fd_write(cfd, line, len) == len && fsync(cfd) == 0) {
+            res = rename(tmp, path);
+        }
+        fd_close(cfd);
+    }
+    free(line);
+
+    if (res < 0) {
+        return res;
+    }
+
+    // path is cut to checkpoint's parent directory, root keeps its slash
+    if ((slash = strrchr(path, '/')) == NULL) {
+        snprintf(path, sizeof(path), ".");
+    } else {
+        slash[slash == path] = '\0';
+    }
+    if ((dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    res = fsync(dfd);
+    fd_close(dfd);
+
+    return res;
+}
+
+
+/* finds where to resume archiving from, in chatlog and archive
+ * - archive data past checkpoint might not have made it to disk
+ *   whole, so it's copied again
+ * - chatlog replaced by new chatroom is archived from the beginning,
+ *   after what's archived already
+ * - per-member chatlogs in 'log.d' continue from their checkpoint
+ *   offsets, those not in checkpoint are archived whole
+ */
+static void
+archive_resume (int fd, ino_t ino, long * pos, off_t * out)
+{
+    char path[PATH_MAX] = {0};
+    char * line = NULL;
+    long long offset = 0, size = 0;
+    unsigned long long last_ino = 0;
+    struct stat sb = {0};
+    BOOL resumed = NO;
+    int cfd = -1, len = -1;
+
+    *pos = 0;
+    *out = fstat(fd, &sb) == 0 ? sb.st_size : 0;
+
+    // checkpoint has line per per-member chatlog, so it's read whole
+    snprintf(path, sizeof(path), "%s.checkpoint", archive_dest);
+    if ((cfd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        if (fstat(cfd, &sb) == 0 && (line = calloc(sb.st_size + 1, 1)) != NULL) {
+            len = fd_read(cfd, line, sb.st_size);
+        }
+        fd_close(cfd);
+
+        if (len <= 0 || sscanf(line, "%lld %lld %llu", &offset, &size, &last_ino) != 3 || size > *out) {
+            dprintf(2, "warning: Ignoring invalid archive checkpoint '%s'\n", path);
+        } else if (last_ino == ino && offset <= lseek(fds.fd_chatlog, 0, SEEK_END)) {
+            *pos = offset;
+            *out = size;
+            if (ftruncate(fd, size) < 0) {
+                dprintf(2, "warning: Unable to drop unsynced tail of archive '%s': %s\n", archive_dest, strerror(errno));
+            }
+            resumed = YES;
+        }
+    }
+
+    if (fds.fd_split < 0) {
+        free(line);
+        return;
+    }
+
+    last_chatlog_read_pos = *pos;
+    split_add_chatlog();
+    split_scan(NO, NO);
+
+    for (char * p = resumed ? strchr(line, '\n') : NULL; p && *++p; p = strchr(p, '\n')) {
+        unsigned long long split_ino = 0;
+        size_t split_pos = 0;
+        int split_pid = 0;
 
+        if (sscanf(p, "%d %llu %zu", &split_pid, &split_ino, &split_pos) != 3) {
+            break;
+        }
+        for (size_t i = 0; i < split_writers_len; i++) {
+            if (split_writers[i].pid == split_pid && split_writers[i].ino == split_ino) {
+                split_writers[i].pos = split_writers[i].end = split_pos;
+            }
+        }
+    }
     free(line);
+}
+
+
+/* archives merged records of 'log' and per-member chatlogs into fd at *out
+ * - 'log' offset archived so far goes to *pos, per-member chatlogs keep
+ *   theirs, see archive_checkpoint()
+ */
+static int
+archive_merge (int fd, long * pos, off_t * out)
+{
+    if (lseek(fd, *out, SEEK_SET) != *out) {
+        return -1;
+    }
+
+    split_out_fd = fd;
+    split_collect(split_write);
+    split_write(NULL, 0);
+    if (split_out_failed) {
+        return -1;
+    }
 
-    rl_set_prompt(PROMPT);
-    rl_redisplay();
+    *pos = last_chatlog_read_pos;
+    *out = lseek(fd, 0, SEEK_CUR);
 
-    rl_done = 1;
     return 0;
 }
 
 
-/* reads all of the messages from the chatlog since the last read
- * and prints them
+/* --archive: registers as listener like any other client, and copies
+ * complete chatlog records into durable file, while chatdir itself
+ * can stay on tmpfs
+ * - copies in batches of ARCHIVE_BATCH_LEN, or whatever there is once
+ *   ARCHIVE_SYNC_WINDOW passed since last copy, so archive disk sees
+ *   one fsync() per batch, not per message
+
+ * - in room with 'log.d', records of all chatlogs are merged into it
+ *   instead, through userspace
  */
-static void
-process_messages (void)
+static int
+archive_main (void)
 {
-    char buffer[MAX_CHAT_READ_BUFFER_LEN] = {0};
-    ssize_t read = -1;
+    struct stat sb = {0};
+    int64_t last = 0;
+    long pos = 0;
+    off_t out = 0;
+    int fd = -1;
 
-    read = fd_pread(fds.fd_chatlog, buffer, MAX_CHAT_READ_BUFFER_LEN, last_chatlog_read_pos);
+    install_stop_handlers();
+    chatdir_join();
 
-    // if we failed to read from chatlog something went really wrong
-    if (read == -1) {
-        if (errno != EPIPE) {
-            run = NO;
-            dprintf(2, "chatlog read failed with errno %d: %s\n", errno, strerror(errno));
-        }
-        return;
+    if ((fd = open(archive_dest, O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP)) < 0 || fstat(fds.fd_chatlog, &sb) < 0) {
+        dprintf(2, "Unable to open archive '%s': %s\n", archive_dest, strerror(errno));
+        return 1;
     }
 
-    if (read)  {
-        print_buffer(buffer);
+    // in room with 'log.d', its chatlogs are archived too, merged with 'log'
+    fds.fd_split = dfd_openat(fds.fd_chatdir, SPLIT_DIR_NAME);
+    archive_resume(fd, sb.st_ino, &pos, &out);
+
+    for (;;) {
+        int64_t now = get_monotonic_ms();
+        long end = -1, complete = -1;
+        size_t pending = 0;
+        int timeout = -1;
+        check_result result = CHECK_NOTHING;
+
+        if (fds.fd_split < 0) {
+            last_chatlog_read_pos = pos;
+            split_discover();
+        }
+        if (fds.fd_split >= 0) {
+            pending = split_refresh();
+        } else {
+            pos = chatlog_skip_punched(pos);
+            end = lseek(fds.fd_chatlog, 0, SEEK_END);
+            complete = chatlog_find_record_end(pos, end);
+            pending = complete - pos;
+        }
+
+        if (pending > 0 && (pending >= ARCHIVE_BATCH_LEN || now - last >= ARCHIVE_SYNC_WINDOW || ! run)) {
+            if (fds.fd_split >= 0 && archive_merge(fd, &pos, &out) < 0) {
+                dprintf(2, "Unable to archive chatlogs of '%s' into '%s': %s\n", chatdirstr, archive_dest, strerror(errno));
+                return 1;
+            }
+            while (fds.fd_split < 0 && pos < complete) {
+                ssize_t res = archive_copy(fd, &pos, &out, complete - pos);
+
+                if (res < 0 && errno == EINTR) {
+                    continue;
+                } else if (res <= 0) {
+                    dprintf(2, "Unable to archive chatlog '%s/log' into '%s': %s\n", chatdirstr, archive_dest, strerror(errno));
+                    return 1;
+                }
+            }
+            if (archive_checkpoint(fd, pos, out, sb.st_ino) < 0) {
+                dprintf(2, "Unable to checkpoint archive '%s': %s\n", archive_dest, strerror(errno));
+                return 1;
+            }
+            last = now;
+        } else if (pending > 0) {
+            timeout = ARCHIVE_SYNC_WINDOW - (now - last);
+        }
+
+        if (! run) {
+            break;
+        }
+
+        if ((result = headless_wait(timeout)) == CHECK_ERROR) {
+            dprintf(2, "Waiting for events failed: %s\n", strerror(errno));
+            return 1;
+        }
     }
 
-    // update the last read position
-    last_chatlog_read_pos = lseek(fds.fd_chatlog, last_chatlog_read_pos + read, SEEK_SET);
+    fd_close(fd);
 
-    // set the file position at the end of the file
-    //lseek(fds.fd_chatlog, 0, SEEK_END);
+    return 0;
 }
 
 
-// handles specific event pipe notifcation events
-static check_result
-process_event (char * event)
+/* --compact: folds per-member chatlogs of members who left into file
+ * - chatlogs nobody holds lock on are merged in order their records
+ *   were sent, appended to file and removed from 'log.d'
+ * - torn record at the end of chatlog is sealed, as join does it
+ * - members merging them still read them up to the end, as they
+ *   hold them open
+ */
+static int
+compact_main (void)
 {
-    if (event[0] == '\n') {
-        return CHECK_MESSAGE;
-    } else if (event[0] == 'L' || event[0] == 'w') {
-        int ret = -1;
-        char list_ident[MAX_INFO_LINE_LEN] = {0};
-        if ((ret = snprintf(list_ident, sizeof(list_ident), "[%s] is <%s>\n", pidstr, nickstr)) > 0 && ret <= sizeof(list_ident)) {
-            writechat_raw(list_ident);
-            notify_new_message(event_fifodir);
+    char seal[] = { CHATLOG_FIELD_SEP, 'X', '\n' };
+    size_t records = 0, folded = 0;
+    long long bytes = 0;
+
+    if ((fds.fd_chatdir = dfd_opendir(chatdirstr)) < 0) {
+        dprintf(2, "Unable to open chatdir '%s': %s\n", chatdirstr, strerror(errno));
+        return 1;
+    }
+    if ((fds.fd_split = dfd_openat(fds.fd_chatdir, SPLIT_DIR_NAME)) < 0) {
+        dprintf(2, "Unable to open per-member chatlog directory '%s/%s': %s\n", chatdirstr, SPLIT_DIR_NAME, strerror(errno));
+        return 1;
+    }
+    if ((split_out_fd = open(archive_dest, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP)) < 0) {
+        dprintf(2, "Unable to open archive '%s': %s\n", archive_dest, strerror(errno));
+        return 1;
+    }
+
+    split_scan(NO, YES);
+    for (size_t i = 0; i < split_writers_len; i++) {
+        split_map(&split_writers[i]);
+        bytes += split_writers[i].mapped;
+    }
+
+    records = split_merge(split_write);
+    for (size_t i = 0; i < split_writers_len; i++) {
+        if (split_writers[i].pos < split_writers[i].mapped) {
+            split_write(split_writers[i].map + split_writers[i].pos, split_writers[i].mapped - split_writers[i].pos);
+            split_write(seal, sizeof(seal));
+            records++;
         }
-    } else if (event[0] == 'p') {
-        int ret = -1;
-        char pty_ident[MAX_INFO_LINE_LEN] = {0};
-        if ((ret = snprintf(pty_ident, sizeof(pty_ident), "[%s] is <%s> on fds[ 0='%s', 1='%s' ]\n", pidstr, nickstr, ttyname(0), ttyname(1))) > 0 && ret <= sizeof(pty_ident)) {
-            writechat_raw(pty_ident);
-            notify_new_message(event_fifodir);
+    }
+    split_write(NULL, 0);
+
+    // chatlogs go only once they are safely in archive
+    if (split_out_failed || fsync(split_out_fd) < 0) {
+        dprintf(2, "Unable to write archive '%s': %s\n", archive_dest, strerror(errno));
+        return 1;
+    }
+
+    for (size_t i = 0; i < split_writers_len; i++) {
+        char name[MAX_NOTIFY_NAME_LEN] = {0};
+        struct stat st;
+
+        snprintf(name, sizeof(name), "%d", split_writers[i].pid);
+        if (fstatat(fds.fd_split, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && st.st_ino == split_writers[i].ino) {
+            if (unlinkat(fds.fd_split, name, 0) < 0) {
+                dprintf(2, "warning: Unable to remove per-member chatlog '%s/%s/%s': %s\n", chatdirstr, SPLIT_DIR_NAME, name, strerror(errno));
+                continue;
+            }
+            folded++;
         }
-    } else if (event[0] == 'D') {
-        char time[MAX_TIME_STR_LEN] = {0};
-        get_timestr(time);
-        rl_set_prompt("");
-        rl_clear_message();
-        rl_redisplay();
-        dprintf(1, "[%s] *** chatroom '%s' destroyed...\n", time, chatdirstr);
-        run = NO;
-        log_leaving_message = NO;
     }
-    return CHECK_NOTHING;
+    fd_close(split_out_fd);
+
+    dprintf(1, "%s: folded %zu member chatlogs, %zu records, %lld bytes into %s\n", chatdirstr, folded, records, bytes, archive_dest);
+
+    return 0;
 }
 
 
-/* this is a "message" emitter, i.e. it "sends" a chat message from one user to another.
- *  - it first writes into chatlog file
- *  - then it notifies other users registered through event fifodir
- *    by writing newline into their "notify" pipes
- */
+// reports damaged chatlog record found by --fsck, up to MAX_FSCK_REPORTED of them
 static void
-send_message (const char *message)
+fsck_report (size_t * reported, off_t offset, const char * what)
 {
-    char time[MAX_TIME_STR_LEN] = {0};
-    get_timestr(time);
-    dprintf(fds.fd_chatlog, "[%s][%s] <%s>: %s\n", pidstr, time, nickstr, message);
-    fsync(fds.fd_chatlog);
-    notify_new_message(event_fifodir);
+    if ((*reported)++ < MAX_FSCK_REPORTED) {
+        dprintf(1, "offset %lld: %s\n", (long long) offset, what);
+    }
 }
 
 
-/* tiny eventloop "core" based on (p)poll(), it either:
- * - handles signals
- * - notification events
- * - messages
- * - or nothing
+/* --fsck: validates chatlog without joining the chatroom
+ * - checks record checksums and looks for torn records
+ * - returns 0 when chatlog is intact, 1 otherwise
  */
-static check_result
-check_events ()
+static int
+fsck_main (void)
 {
-    struct pollfd pfd[3] = {0};
-    char event[1] = {0};
-    int changed = 0;
-
-    pfd[0].fd = fds.fd_selfpipe; // selfpipe
-    pfd[0].events = POLLIN;
-    pfd[1].fd = fds.fd_event;    // event notifications
-    pfd[1].events = POLLIN;
-    pfd[2].fd = 0;               // user input
-    pfd[2].events = POLLIN;
+    size_t lines = 0, sealed = 0, plain = 0, torn = 0, corrupt = 0, reported = 0;
+    struct stat st;
+    char * log = NULL, * p = NULL, * end = NULL;
 
-    do {
-        changed = ppoll(pfd, 3, NULL, NULL);
+    if ((fds.fd_chatdir = dfd_opendir(chatdirstr)) < 0) {
+        dprintf(2, "Unable to open chatdir '%s': %s\n", chatdirstr, strerror(errno));
+        return 1;
+    }
 
-        if (changed < 0 && errno != EINTR) {
-            return CHECK_ERROR;
-        } else if (changed == 0) {
-            return CHECK_NOTHING;
-        } else {
-            if ((pfd[0].revents & POLLIN) == POLLIN) {
+    if ((fds.fd_chatlog = openat(fds.fd_chatdir, "log", O_RDONLY | O_NOFOLLOW)) < 0 || fstat(fds.fd_chatlog, &st) < 0) {
+        dprintf(2, "Unable to open chatlog '%s/log': %s\n", chatdirstr, strerror(errno));
+        return 1;
+    }
 
-                return CHECK_SIGNAL;
+    if (st.st_size > 0 && (log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fds.fd_chatlog, 0)) == MAP_FAILED) {
+        dprintf(2, "Unable to map chatlog '%s/log': %s\n", chatdirstr, strerror(errno));
+        return 1;
+    }
 
-            } else if ((pfd[1].revents & POLLIN) == POLLIN) {
+    // range punched out by --retain is not there to check
+    for (p = log + chatlog_skip_punched(0), end = log + st.st_size; p < end; ) {
+        char * eol = memchr(p, '\n', end - p);
+        char * field = NULL, * start = NULL;
+        int64_t stamp = 0;
+        int state = LINE_PLAIN;
 
-                if (fd_read(pfd[1].fd, event, 1) == 1) {
-                    return process_event(event);
-                }
-                return CHECK_NOTHING;
+        if (eol == NULL) {
+            torn++;
+            fsck_report(&reported, p - log, "torn record at the end, not sealed yet");
+            break;
+        }
 
-            } else if ((pfd[2].revents & POLLIN) == POLLIN) {
+        lines++;
+        if ((field = memchr(p, CHATLOG_FIELD_SEP, eol - p))) {
+            state = chatlog_parse_fields(p, field, eol, &stamp);
+        }
 
-                return CHECK_INPUT;
-            }
+        if (state == LINE_CORRUPT && (start = chatlog_resync(p, eol))) {
+            torn++;
+            sealed++;
+            fsck_report(&reported, p - log, "torn record, intact one glued to it");
+        } else if (state == LINE_CORRUPT) {
+            corrupt++;
+            fsck_report(&reported, p - log, "checksum mismatch");
+        } else if (state == LINE_TORN) {
+            torn++;
+            fsck_report(&reported, p - log, "torn record, sealed");
+        } else if (state == LINE_SEALED) {
+            sealed++;
+        } else {
+            plain++;
         }
-    } while ((changed == -1) && errno == EINTR);
 
-    return CHECK_ERROR;
-}
+        p = eol + 1;
+    }
 
+    if (reported > MAX_FSCK_REPORTED) {
+        dprintf(1, "... %zu more not shown\n", reported - MAX_FSCK_REPORTED);
+    }
+    dprintf(1, "%s/log: %lld bytes, %lld retained, %zu lines, %zu sealed, %zu without checksum, %zu torn, %zu corrupt\n",
+        chatdirstr, (long long) st.st_size, (long long) (st.st_size - chatlog_skip_punched(0)), lines, sealed, plain, torn, corrupt);
 
-static void
-check_signal(void)
-{
-    // TODO: implement selfpipe signal handling
+    if (log) {
+        munmap(log, st.st_size);
+    }
+
+    return torn + corrupt > 0 ? 1 : 0;
 }
 
 
@@ -1121,9 +7946,39 @@ static void
 main_usage(char * progname)
 {
     dprintf(1, "%s v%s - a small fifodir based chat system for multiple users\n\n", progname, VERSION);
-    dprintf(1, "Usage: %s [OPTIONS] chatdir [groupname]\n\n", progname);
+    dprintf(1, "Usage: %s [OPTIONS] chatdir [groupname]\n", progname);
+    dprintf(1, "       %s [OPTIONS] --follow chatdir\n", progname);
+    dprintf(1, "       %s [OPTIONS] --observe chatdir\n", progname);
+    dprintf(1, "       %s [OPTIONS] --broker chatdir\n", progname);
+    dprintf(1, "       %s [OPTIONS] --record chatdir > trace\n", progname);
+    dprintf(1, "       %s [OPTIONS] --archive chatdir file\n", progname);
+    dprintf(1, "       %s --compact chatdir file\n", progname);
+    dprintf(1, "       %s [OPTIONS] --replay trace scratchdir [groupname]\n", progname);
+    dprintf(1, "       %s [OPTIONS] --bench join|traffic|rss scratchdir [groupname]\n", progname);
+    dprintf(1, "       %s --fsck chatdir\n\n", progname);
     dprintf(1, "OPTIONS\n");
     dprintf(1, " -h     this help\n");
+    dprintf(1, " -j N   coalesce join/leave lines in rooms with more than N members\n");
+    dprintf(1, " -t MS  wait at most MS milliseconds for members to leave on /destroy (default %d)\n", DESTROY_ACK_DEADLINE);
+    dprintf(1, " -n N,N  numbers of concurrent joiners for --bench join (default %s)\n", bench_joiners);
+    dprintf(1, "        or members for --bench traffic and rss (default %s)\n", bench_members);
+    dprintf(1, " -x N   replay trace N times faster than recorded, 0 as fast as possible (default 1)\n");
+    dprintf(1, " --scrollback MB  keep last MB of rendered chat for /scroll (default %d, 0 = off)\n", SCROLLBACK_DEFAULT_MB);
+    dprintf(1, " --lag-skip SIZE  skip to last screen when more than SIZE (like 16M) of chat is unread (default %ldM, 0 = never)\n", LAG_SKIP_DEFAULT >> 20);
+    dprintf(1, " --retain AGE|SIZE  punch out chatlog older than AGE (like 24h) or before last SIZE (like 512M)\n");
+    dprintf(1, "\n");
+    dprintf(1, "MODES\n");
+    dprintf(1, " --follow       stream new chatlog records to stdout, like tail -f\n");
+    dprintf(1, " --observe      show chat read-only, without being member senders notify\n");
+    dprintf(1, " --broker       serve new chatlog records to chat clients over UNIX socket\n");
+    dprintf(1, " --record       write trace of appends, joins and leaves in chatroom to stdout\n");
+    dprintf(1, " --archive      copy chatlog records into file in batches, resuming after restart\n");
+    dprintf(1, " --compact      fold per-member chatlogs of members who left into file, in order\n");
+    dprintf(1, " --replay TRACE drive synthetic members through scratchdir as TRACE says\n");
+    dprintf(1, " --bench join   measure chatdir creation and join latency of concurrent joiners\n");
+    dprintf(1, " --bench traffic  measure message throughput and catch-up of room with members listening\n");
+    dprintf(1, " --bench rss    measure memory footprint of chat clients in room\n");
+    dprintf(1, " --fsck         check chatlog for torn and corrupt records, without joining\n");
     dprintf(1, "\n");
 }
 
@@ -1133,11 +7988,6 @@ main (int argc, char *argv[])
 {
     int ret = -1;
 
-    if (!isatty(0) || !isatty(1)) {
-        dprintf(2, "This program must be run on real terminal.");
-        exit(1);
-    }
-
     /* we always require a chatdir, and we guess a nick
      * from process state and environment.
      *
@@ -1154,14 +8004,92 @@ main (int argc, char *argv[])
         return 1;
     }
 
-    for (int argi = 1; argi < argc; argi++) {
+    int argi = 1;
+    for (; argi < argc; argi++) {
         if (argv[argi][0] == '-') {
             if (argv[argi][1] == 'h') {
                 main_usage(argv[0]);
                 return 0;
-            } else if (argv[argi][1] == '-') {
-                argv += argi;
-                argc -= argi;
+            } else if (argv[argi][1] == 'j' && argi + 1 < argc) {
+                status_coalesce_threshold = atoi(argv[++argi]);
+                continue;
+            } else if (argv[argi][1] == 't' && argi + 1 < argc) {
+                destroy_ack_deadline = atol(argv[++argi]);
+                continue;
+            } else if (argv[argi][1] == 'n' && argi + 1 < argc) {
+                bench_joiners = bench_members = argv[++argi];
+                continue;
+            } else if (argv[argi][1] == 'x' && argi + 1 < argc) {
+                replay_speed = atol(argv[++argi]);
+                continue;
+            } else if (strcmp(argv[argi], "--follow") == 0) {
+                mode = MODE_FOLLOW;
+                continue;
+            } else if (strcmp(argv[argi], "--observe") == 0) {
+                mode = MODE_OBSERVE;
+                continue;
+            } else if (strcmp(argv[argi], "--broker") == 0) {
+                mode = MODE_BROKER;
+                continue;
+            } else if (strcmp(argv[argi], "--record") == 0) {
+                mode = MODE_RECORD;
+                continue;
+            } else if (strcmp(argv[argi], "--replay") == 0 && argi + 1 < argc) {
+                mode = MODE_REPLAY;
+                replay_trace = argv[++argi];
+                continue;
+            } else if (strcmp(argv[argi], "--retain") == 0 && argi + 1 < argc) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+                // single policy applies, age and size are not combined
+                if (retain_ms > 0 || retain_bytes > 0) {
+                    dprintf(2, "Only one retention policy, age or size, may be given.\n");
+                    exit(1);
+                }
+                if (retain_parse(argv[++argi]) < 0) {
+                    dprintf(2, "Invalid retention policy: %s\n", argv[argi]);
+                    exit(1);
+                }
+#else
+                dprintf(2, "Retention is not supported on this platform.\n");
+                exit(1);
+#endif
+                continue;
+            } else if (strcmp(argv[argi], "--scrollback") == 0 && argi + 1 < argc) {
+                char * end = NULL;
+                scrollback_mb = strtol(argv[++argi], &end, 10);
+                if (end == argv[argi] || *end != '\0' || scrollback_mb < 0 || scrollback_mb > 4095) {
+                    dprintf(2, "Invalid scrollback size: %s\n", argv[argi]);
+                    exit(1);
+                }
+                continue;
+            } else if (strcmp(argv[argi], "--lag-skip") == 0 && argi + 1 < argc) {
+                char * unit = NULL;
+                lag_skip_bytes = strtol(argv[++argi], &unit, 10);
+                switch (*unit) {
+                    case 'K' : lag_skip_bytes <<= 10; unit++; break;
+                    case 'M' : lag_skip_bytes <<= 20; unit++; break;
+                    case 'G' : lag_skip_bytes <<= 30; unit++; break;
+                }
+                if (unit == argv[argi] || *unit != '\0' || lag_skip_bytes < 0) {
+                    dprintf(2, "Invalid lag skip size: %s\n", argv[argi]);
+                    exit(1);
+                }
+                continue;
+            } else if (strcmp(argv[argi], "--archive") == 0) {
+                mode = MODE_ARCHIVE;
+                continue;
+            } else if (strcmp(argv[argi], "--compact") == 0) {
+                mode = MODE_COMPACT;
+                continue;
+            } else if (strcmp(argv[argi], "--fsck") == 0) {
+                mode = MODE_FSCK;
+                continue;
+            } else if (strcmp(argv[argi], "--bench") == 0 && argi + 1 < argc) {
+                mode = MODE_BENCH;
+                bench_name = argv[++argi];
+                continue;
+            } else if (argv[argi][1] == '-' && argv[argi][2] == '\0') {
+                argi++;
                 break;
             }
             dprintf(2, "Unknown option: %s\n", argv[argi]);
@@ -1172,6 +8100,27 @@ main (int argc, char *argv[])
         }
     }
 
+    // let argv[1] point to first non-option argument
+    argv += argi - 1;
+    argc -= argi - 1;
+
+    if (mode == MODE_CHAT && (!isatty(0) || !isatty(1))) {
+        dprintf(2, "This program must be run on real terminal.");
+        exit(1);
+    }
+
+    // --archive and --compact take destination file right after chatdir, group may follow
+    if (mode == MODE_ARCHIVE || mode == MODE_COMPACT) {
+        if (argc < 3) {
+            dprintf(2, "Can't determine archive file. Specify it after chatdir on the command line.\n");
+            exit(1);
+        }
+        archive_dest = argv[2];
+        argv[2] = argv[1];
+        argv++;
+        argc--;
+    }
+
     //  get chatdir name
     if (argv[1] == NULL) {
         dprintf(2, "Can't determine chatdir. Specify chatdir on the command line.\n");
@@ -1253,13 +8202,8 @@ main (int argc, char *argv[])
         egid = getegid();
     }
 
-    /* convert PID to string for further use
-     *  - PID of process should never change so it's okay to "cache" it
-     */
-    if ((ret = snprintf(pidstr, sizeof(pidstr_buf), "%d", getpid())) < 0 || ret > sizeof(pidstr_buf)) {
-        dprintf(2, "Can't convert pid to string %d %d %ld\n", ret, getpid(), sizeof(pidstr_buf));
-        exit(1);
-    }
+    // cache PID string for further use
+    init_pidstr();
 
     // construct chat prompt
     if ((ret = snprintf(promptstr, sizeof(promptstr_buf), "[%s]<%s>: ", pidstr, nickstr)) < 0 || ret > sizeof(promptstr_buf)) {
@@ -1269,175 +8213,76 @@ main (int argc, char *argv[])
 
     // TODO: implement selfpipe
     fds.fd_selfpipe = -1;
-
-    /* "bind" to chatdir
-     * - check whether it exists
-     * - if it does not, create it
-     * - then fix chatdir perms if necessary
-     * - and finally "bind" to it by holding onto it's fd
-     */
-    {
-        struct stat sb;
-        if (stat(chatdirstr, &sb) < 0 && errno != ENOENT) {
-            dprintf(2, "Unable to stat chatdir '%s': %s\n", chatdirstr, strerror(errno));
-            exit(1);
-        } else if (errno == ENOENT) {
-            if (mkdir(chatdirstr, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP) < 0) {
-                dprintf(2, "Unable to create chatdir '%s': %s\n", chatdirstr, strerror(errno));
-                exit(1);
-            }
-        } else if (! S_ISDIR(sb.st_mode)) {
-            dprintf(2, "Chatdir '%s' is not directory.\n", chatdirstr);
-            exit(1);
-        }
-        if (groupstr && chown(chatdirstr, geteuid(), egid)) {
-            dprintf(2, "Unable to change group ownership of chatdir '%s' to '%s': %s\n", chatdirstr, groupstr, strerror(errno));
-            exit(1);
-        }
-        if (groupstr && chmod(chatdirstr, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP) < 0) {
-            dprintf(2, "Unable to change permissions on chatdir '%s': %s\n", chatdirstr, strerror(errno));
-            exit(1);
-        }
-        if ((fds.fd_chatdir = dfd_opendir(chatdirstr)) < 0 ) {
-            dprintf(2, "Unable to open chatdir '%s': %s\n", chatdirstr, strerror(errno));
-            exit(1);
-        }
-    }
-
-    /* "bind" to chatlog
-     * - try opening chatlog anchored at chatdir directory
-     * - fix chatlog perms if necessary
-     */
-    {
-        if ((fds.fd_chatlog = openat(fds.fd_chatdir, "log", O_RDWR | O_APPEND | O_CREAT | O_NONBLOCK | O_NOFOLLOW, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP)) < 0) {
-            dprintf(2, "Unable to open chatlog file 'log' in '%s': %s\n", chatdirstr, strerror(errno));
-            exit(1);
-        }
-        if (groupstr && fchown(fds.fd_chatlog, geteuid(), egid) < 0) {
-            dprintf(2, "Unable to change group ownership of chatlog file '%s/log': %s\n", chatdirstr, strerror(errno));
-            exit(1);
-        }
-        if (groupstr && fchmod(fds.fd_chatlog, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP) < 0) {
-            dprintf(2, "Unable to set permissions on chatlog file '%s/log': %s\n", chatdirstr, strerror(errno));
-            exit(1);
-        }
-    }
-
-    /* bind to "event" fifodir
-     * - check whether it exists
-     * - if it does not, create it
-     * - if asked, fix perms
-     */
-    {
-        struct stat sb = {0};
-        if (fstatat(fds.fd_chatdir, "event", &sb, 0) < 0 && errno != ENOENT) {
-            dprintf(2, "Unable to stat eventdir 'event' at '%s': %s\n", chatdirstr, strerror(errno));
-            exit(1);
-        } else if (errno == ENOENT) {
-            if (mkdirat(fds.fd_chatdir, "event", S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP) < 0) {
-                dprintf(2, "Unable to create eventdir 'event' at '%s': %s\n", chatdirstr, strerror(errno));
-                exit(1);
-            }
-            if (fstatat(fds.fd_chatdir, "event", &sb, 0) < 0) {
-                dprintf(2, "Unable to stat eventdir 'event' at '%s': %s\n", chatdirstr, strerror(errno));
-                exit(1);
-            }
-        } else if (! S_ISDIR(sb.st_mode)) {
-            dprintf(2, "eventdir 'event' at '%s' is not directory.\n", chatdirstr);
-            exit(1);
-        }
-        /* critical: we need to properly handle gorup permissions on eventdir */
-        if (groupstr) {
-           if (fchownat(fds.fd_chatdir, "event", geteuid(), egid, 0) < 0) {
-                dprintf(2, "Unable to change group ownership of eventdir '%s/event' to '%s': %s\n", chatdirstr, groupstr, strerror(errno));
-                exit(1);
-            }
-        }  else {
-            egid = sb.st_gid;
-        }
-        if (groupstr && fchmodat(fds.fd_chatdir, "event", S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP, 0) < 0) {
-            dprintf(2, "Unable to change permissions on eventdir '%s/event': %s\n", chatdirstr, strerror(errno));
-            exit(1);
-        }
-    }
-
-    /* register for pipe in event fifodir for events notification
-     * - ensure proper perms
-     */
-    {
-        int event_dfd = -1;
-        if ((event_dfd = dfd_openat(fds.fd_chatdir, "event")) < 0) {
-            dprintf(2, "Unable to open eventdir 'event' in '%s': %s\n", chatdirstr, strerror(errno));
-            exit(1);
-        } else {
-            char notify_name[30] = {0};
-            ret = -1;
-            if ((ret = snprintf(notify_name, sizeof(notify_name), "%s", pidstr)) < 0 || ret > sizeof(notify_name)) {
-                dprintf(2, "Notify event listener name too long for '%s/event' or error occured: %s\n", chatdirstr, strerror(errno));
-                exit(1);
-            }
-            if (mkfifoat(event_dfd, notify_name, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP) < 0) {
-                dprintf(2, "Unable to register notify event listener '%s' at '%s/event': %s\n", notify_name, chatdirstr, strerror(errno));
-                exit(1);
-            }
-            if ((fds.fd_event = openat(event_dfd, notify_name, O_RDWR | O_NONBLOCK | O_NOFOLLOW)) < 0) {
-                // add event unlink
-                dprintf(2, "Unable to open notify event listener '%s' at '%s/event': %s\n", notify_name, chatdirstr, strerror(errno));
-                exit(1);
-            }
-            if (groupstr) {
-                if (getegid() != 0 && egid == 0) {
-                    dprintf(2, "warning: user group '%s' is superuser group, this is potentially unsafe!\n", groupstr);
-                }
-            } else {
-                if (getegid() != 0 && egid == 0) {
-                    dprintf(2, "warning: user group '%d' is superuser group, this is potentially unsafe!\n", egid);
-                }
-            }
-
-            atexit(notify_unregister_pipe);
-
-            if (fchown(fds.fd_event, geteuid(), egid) < 0) {
-                dprintf(2, "Unable to change group ownership of listener '%s' at '%s/event': %s %d\n", notify_name, chatdirstr, strerror(errno), egid);
-                exit(1);
-            }
-            if (fchmod(fds.fd_event, S_IRUSR|S_IWUSR|S_IWGRP) < 0) {
-                dprintf(2, "Unable to set permissions on event listener '%s' at '%s/event': %s\n", notify_name, chatdirstr, strerror(errno));
-                exit(1);
-            }
-            if ((event_fifodir = fdopendir(event_dfd)) == NULL) {
-                dprintf(2, "Unable to open notify event listener '%s' at '%s/event': %s\n", notify_name, chatdirstr, strerror(errno));
-                exit(1);
-            }
-        }
+    fds.fd_broker = -1;
+    fds.fd_inbox = -1;
+    fds.fd_split = -1;
+
+    if (mode == MODE_BENCH) {
+        return bench_main();
+    } else if (mode == MODE_FOLLOW) {
+        return follow_main();
+    } else if (mode == MODE_OBSERVE) {
+        return observe_main();
+    } else if (mode == MODE_BROKER) {
+        return broker_main();
+    } else if (mode == MODE_RECORD) {
+        return record_main();
+    } else if (mode == MODE_REPLAY) {
+        return replay_main();
+    } else if (mode == MODE_FSCK) {
+        return fsck_main();
+    } else if (mode == MODE_ARCHIVE) {
+        return archive_main();
+    } else if (mode == MODE_COMPACT) {
+        return compact_main();
     }
 
-    // by default, we don't want to see messages from the past, as they could be loooooong
-    lseek(fds.fd_chatlog, 0, SEEK_END);
-
-    // so this is now our "last read" position
-    last_chatlog_read_pos = lseek(fds.fd_chatlog, 0, SEEK_CUR);
+    // join chatdir (creating it, if necessary) and register for notifications
+    chatdir_join();
+    presence_join();
+    dm_open_inbox();
+    scrollback_init();
 
+#ifdef PIPECHAT_LITE
+    // built-in line editor takes terminal input over
+    lineedit_start();
+#else
     /* we register handlers with readline to let us know when the user hits enter
      * and bind the compeltion key.
      */
     rl_bind_key(RETURN, rlcb_handle_enter);
     rl_bind_key(TAB, rl_complete);
 
+#if RL_READLINE_VERSION >= 0x0700
+    /* pasted text comes in as single line with newlines in it,
+     * instead of pressing enter after each of pasted lines
+     */
+    rl_variable_bind("enable-bracketed-paste", "on");
+#endif
+
 
     /* we setup the "fake" handler for when readline
      * thinks user is done editing line
      */
     rl_callback_handler_install(PROMPT, rlcb_handle_line);
 
+    /* we read input for readline ourselves, so it takes all of pending
+     * input per wakeup
+     */
+    rl_getc_function = input_getc;
+#if RL_READLINE_VERSION >= 0x0603
+    rl_input_available_hook = input_available;
+#endif
+
     /* we register completion function
      */
     rl_attempted_completion_function = rlcb_commands_completion;
+#endif
 
     /* finally done with chatdir setup, chatdir binding and readline!
      * - now we can let everyone know that the user has arrived.
      */
-    writechat_status("joined", 1, 0);
+    writechat_presence(1, 0);
 
     /* until we decide to quit, we run the program's eventloop core
      *  - on new message notification we read and display chatlog
@@ -1447,6 +8292,25 @@ main (int argc, char *argv[])
      */
     while(run) {
 
+        // retry control events others could not take in before
+        if (notify_retry_len > 0) {
+            notify_retry_flush(event_fifodir);
+        }
+
+        // free chatlog range beyond --retain policy, now and then
+        retain_apply();
+
+        // tell others how many lines we suppressed, once limit allows it
+        if (rate_self.suppressed > 0 && rate_bucket_wait(&rate_self, get_monotonic_ms()) == 0) {
+            rate_report_suppressed();
+            notify_new_message(event_fifodir);
+        }
+
+        // report joins and leaves nobody reported when their window was over
+        if (presence_status_wait() == 0) {
+            presence_status_flush();
+        }
+
         switch(check_events()) {
 
             case CHECK_NOTHING :
@@ -1467,8 +8331,12 @@ main (int argc, char *argv[])
                 process_messages();
             } break;
 
+            case CHECK_BROKER : {
+                broker_process();
+            } break;
+
             case CHECK_INPUT : {
-                rl_callback_read_char();
+                input_process();
             } break;
         }
     }
@@ -1480,12 +8348,22 @@ main (int argc, char *argv[])
      * - however if this is not wanted (like on room destruction)
      *   we skip it completely
      */
-    if (log_leaving_message) writechat_status("left", 1, 1);
+    if (log_leaving_message) writechat_presence(0, 1);
+
+    // what we've measured is left on screen
+    latency_print(print_stdout);
+
+    // give control events we still owe to others last chance
+    notify_retry_drain(event_fifodir, NOTIFY_RETRY_DRAIN_DEADLINE);
 
     // clean up readline now state
+#ifdef PIPECHAT_LITE
+    lineedit_stop();
+#else
     rl_unbind_key(RETURN);
     rl_unbind_key(TAB);
     rl_callback_handler_remove();
+#endif
 
     /* being a good citizen, we close chatlog file handle,
      * but other closures will be handled by atexit() handler
@@ -1494,9 +8372,7 @@ main (int argc, char *argv[])
     fd_close(fds.fd_chatlog);
 
     // finally we clean up the screen.
-    rl_set_prompt("");
-    rl_clear_message();
-    rl_redisplay();
+    prompt_clear();
 
     return 0;
 }
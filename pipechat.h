@@ -0,0 +1,227 @@
+/*
+
+  Copyright (c) 2018, Martin Mišúth - /ETC, 960 01 Zvolen, Slovak Republic
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+/***********************************************************************
+ * libpipechat - chatdir protocol of pipechat for embedding            *
+ ***********************************************************************/
+
+/* Single pipechat_t is one membership in one chatroom, so one process
+ * can be member of many chatrooms at once:
+ *
+ *   pipechat_t * room = pipechat_join("/tmp/chat", "monitor");
+ *
+ *   poll() pipechat_fd(room) for POLLIN, then
+ *   while ((len = pipechat_read(room, buffer, sizeof(buffer))) > 0) ...
+ *
+ *   pipechat_send(room, "disk full on /var");
+ *   pipechat_leave(room);
+ *
+ * None of the calls block, all of them return -1 and set errno on
+ * failure. Chatroom must have been created by pipechat(1) already.
+ */
+
+#ifndef PIPECHAT_H
+#define PIPECHAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// chatlog line field separator, fields after it are not shown
+#define PIPECHAT_FIELD_SEP '\x1f'
+
+// length of record checksum field, i.e. separator, 'C' and 8 hex digits
+#define PIPECHAT_CRC_FIELD_LEN 10
+
+// chatdir directory of per-member chatlogs, see split_log in chatdir config
+#define PIPECHAT_SPLIT_DIR "log.d"
+
+// control frame start, ASCII SOH, see pipechat_frame_encode()
+#define PIPECHAT_FRAME_START '\x01'
+
+// maximum payload of control frame
+#define PIPECHAT_MAX_FRAME_PAYLOAD 96
+
+// control frame length, start, type, pid, request id, payload length and payload
+#define PIPECHAT_FRAME_LEN (2 + 8 + 8 + 4 + 2 * PIPECHAT_MAX_FRAME_PAYLOAD)
+
+// control frame types, none of them is single byte event
+#define PIPECHAT_FRAME_LIST 'S'      // who is here? sent to everybody
+#define PIPECHAT_FRAME_WHOIS 'W'     // who are you? sent to single member
+#define PIPECHAT_FRAME_PTY 'P'       // which terminal are you on? ditto
+#define PIPECHAT_FRAME_IDENT 'I'     // answer to any of above, sent to asker only
+
+typedef struct pipechat_s pipechat_t;
+
+// control frame, as passed between listener pipes directly
+typedef struct pipechat_frame_s {
+    char type;                                   // PIPECHAT_FRAME_*
+    pid_t pid;                                   // sender
+    uint32_t request;                            // picked by asker, echoed in answer
+    size_t len;                                  // payload length
+    char payload[PIPECHAT_MAX_FRAME_PAYLOAD + 1];
+} pipechat_frame_t;
+
+/* joins existing chatroom at chatdir as nick
+ * - registers event pipe named after our pid, so one process can
+ *   join any chatroom only once
+ * - reading starts at the end of chatlog
+ * - fails with ENOTSUP in chatroom with split_log on, or with
+ *   per-member chatlogs in 'log.d', as library reads 'log' only
+ */
+pipechat_t * pipechat_join (const char * chatdir, const char * nick);
+
+/* returns fd to wait for POLLIN on, it gets readable when there is
+ * something new in chatroom
+ */
+int pipechat_fd (pipechat_t * room);
+
+/* sends text to chatroom, multi-line text as single message
+ * - fails with EAGAIN when over chatroom's rate limit
+ */
+int pipechat_send (pipechat_t * room, const char * text);
+
+/* reads complete chatlog records appended since last read into buffer
+ * - returns their length, 0 when there's nothing new
+ * - records are raw chatlog lines, with hidden fields, if any
+ * - answers queries of other members as they come
+ * - fails with ENOTSUP once member joins with split_log on, whatever
+ *   they send goes to 'log.d', so only leaving makes sense
+ */
+ssize_t pipechat_read (pipechat_t * room, char * buffer, size_t size);
+
+// returns whether chatroom was destroyed, then only leaving makes sense
+int pipechat_destroyed (pipechat_t * room);
+
+// leaves chatroom and frees room
+void pipechat_leave (pipechat_t * room);
+
+
+/* chatlog format helpers, shared with pipechat(1) */
+
+// returns CRC32C of data, using crc32 instruction when CPU has one
+uint32_t pipechat_crc32c (const char * data, size_t len);
+
+/* continues CRC32C of earlier data with more data, so record scattered
+ * over several buffers can be checksummed in place
+ * - pipechat_crc32c_extend(0, ...) equals pipechat_crc32c(...)
+ */
+uint32_t pipechat_crc32c_extend (uint32_t crc, const char * data, size_t len);
+
+/* copies complete lines of data into sealed, adding checksum field to each
+ * - sealed must have room for PIPECHAT_CRC_FIELD_LEN more bytes per line
+ * - returns length of sealed data
+ */
+size_t pipechat_seal (const char * data, size_t len, char * sealed);
+
+/* seals torn record left at the end of chatlog by writer killed
+ * mid-append, so the next record does not get glued to it
+ * - tail must stay the same for grace ms, so record being appended
+ *   right now is not sealed
+ * - it is re-checked and sealed under flock(LOCK_EX), so racing
+ *   joiners seal it once
+ * - returns 1 when it sealed one, 0 otherwise
+ */
+int pipechat_seal_tail (int fd_chatlog, int grace);
+
+/* parses "[pid][YYYY.MM.DD HH:MM:SS]" chatlog record prefix
+ * - fills pid and UTC time in ms and returns pointer right after it,
+ *   or NULL when there's none
+ */
+const char * pipechat_parse_prefix (const char * p, const char * end, pid_t * pid, int64_t * time);
+
+/* appends complete lines of data to chatlog at fd with single write(),
+ * sealing each with checksum field first when seal is set
+ * - fd must be opened with O_APPEND, so record lands in one piece
+ * - returns 0 when all of it was written, -1 otherwise
+ */
+int pipechat_append (int fd, const char * data, size_t len, int seal);
+
+
+/* chatroom plumbing, shared with pipechat(1) */
+
+// chatroom settings, as chatdir 'config' has them
+typedef struct pipechat_config_s {
+    long rate_burst;      // chat lines member may send at once, 0 = unlimited
+    long rate_sustained;  // chat lines member may send per second, 0 = unlimited
+    long latency_stamps;  // records carry send time, so members see delivery latency
+    long record_crc;      // records are sealed with checksum
+    long split_log;       // members append to their own chatlogs in 'log.d'
+} pipechat_config_t;
+
+/* reads chatdir 'config' of "key = value" lines into config
+ * - missing config or keys leave values in config as they are
+ * - unknown keys are ignored, so older versions can join newer rooms
+ */
+void pipechat_config_load (int fd_chatdir, pipechat_config_t * config);
+
+/* token bucket of chat lines
+ * - tokens are kept in thousandths, so they refill without floats
+ * - zeroed bucket is full on first use
+ */
+typedef struct pipechat_rate_s {
+    long tokens;          // available lines * 1000
+    int64_t last;         // time of last refill in ms
+} pipechat_rate_t;
+
+/* refills bucket by sustained lines per second up to burst lines at given
+ * time in ms, and takes one line from it
+ * - returns 1 when line fits into limit, 0 otherwise, and always 1
+ *   when either of burst and sustained is 0, i.e. unlimited
+ */
+int pipechat_rate_take (pipechat_rate_t * bucket, int64_t now, long burst, long sustained);
+
+// returns ms from given time until bucket refilled by sustained lines per second holds a line
+long pipechat_rate_wait (const pipechat_rate_t * bucket, int64_t now, long sustained);
+
+/* writes single event byte into listener pipe name at dirfd
+ * - newline is skipped for listener with unread events already,
+ *   it rereads chatlog anyway
+ * - returns 1 when event was written, 0 when it was skipped, -1 on
+ *   failure, errno is EAGAIN when pipe is full and ENXIO when pipe
+ *   has no reader
+ */
+int pipechat_notify_pipe (int dirfd, const char * name, char event);
+
+
+/* control frames, shared with pipechat(1) */
+
+/* encodes frame into PIPECHAT_FRAME_LEN bytes at out
+ * - frame is written into listener pipe with single write(), and as it's
+ *   shorter than PIPE_BUF, it never interleaves with other writers
+ * - all but start and type are hex digits, so members which know only
+ *   single byte events read past it harmlessly
+ * - payload longer than PIPECHAT_MAX_FRAME_PAYLOAD is cut
+ */
+void pipechat_frame_encode (const pipechat_frame_t * frame, char * out);
+
+/* decodes PIPECHAT_FRAME_LEN bytes at data into frame
+ * - returns -1 when it is not valid frame
+ */
+int pipechat_frame_decode (const char * data, pipechat_frame_t * frame);
+
+#endif